@@ -0,0 +1,289 @@
+/**
+ * Micro-benchmarks for the shell's hot paths: lexing and parsing command
+ * lines, builtin dispatch (against the external program a builtin replaces),
+ * loops of builtins, command substitution, command name completion, history
+ * churn and the cost of starting a program with each backend.  The shell's source is compiled in
+ * (without its main()) so its internals can be called directly.
+ *
+ * Usage: ush_bench [scale]   (scale multiplies the iteration counts, default 1)
+ */
+#define USH_NO_MAIN
+#include "../src/main.c"
+
+/**
+ * Command lines of the kind seen in scripts and at the prompt.
+ */
+const char *bench_lines[] = {
+  "ls -la",
+  "cd /usr/local/src",
+  "grep -rn \"struct ush_job\" src/main.c | sort -t: -k2 -n | head -20",
+  "find . -name '*.o' -newer Makefile > /tmp/objs 2>&1",
+  "CFLAGS=-O2 make -j8 all >> build.log 2>> errors.log",
+  "echo \"$HOME/bin:$PATH\" | tr : '\\n' | wc -l",
+  "tar czf backup.tar.gz --exclude=.git ~/projects/shell",
+  "cat <<< 'hello world' | sed -e 's/world/there/' | tee out.txt",
+};
+
+#define BENCH_NUM_LINES (sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+/**
+   @brief Print one result.
+   @param name What was measured.
+   @param ops Number of operations.
+   @param ns Time they took, in nanoseconds.
+ */
+void bench_report(const char *name, uint64_t ops, uint64_t ns)
+{
+  double per_op = (double)ns / ops;
+
+  printf("%-32s %10lu ops %12.1f ns/op %14.0f ops/sec\n", name, (unsigned long)ops, per_op, 1e9 / per_op);
+}
+
+/**
+   @brief Tokenize the sample lines.
+   @param iterations Number of lines to lex.
+ */
+void bench_lex(uint64_t iterations)
+{
+  size_t bytes = 0;
+  uint64_t start = ush_trace_clock();
+  uint64_t ns;
+
+  for (uint64_t i = 0; i < iterations; i++){
+    const char *line = bench_lines[i % BENCH_NUM_LINES];
+
+    ush_lex(&session_lexer, line);
+    bytes += strlen(line);
+  }
+  ns = ush_trace_clock() - start;
+  bench_report("lex", iterations, ns);
+  printf("%-32s %10.1f MB/s\n", "", bytes / (ns / 1e9) / 1e6);
+}
+
+/**
+   @brief Parse the sample lines, without and then through the parse cache.
+   @param iterations Number of lines to parse each way.
+ */
+void bench_parse(uint64_t iterations)
+{
+  uint64_t start = ush_trace_clock();
+  int incomplete;
+
+  for (uint64_t i = 0; i < iterations; i++){
+    ush_parse(bench_lines[i % BENCH_NUM_LINES], &ast_arena, &incomplete);
+    if(ast_arena.in_use > USH_AST_CACHE_LIMIT){
+      //Nothing refers to these trees; the cache is still empty.
+      ush_arena_reset(&ast_arena);
+    }
+  }
+  bench_report("parse (uncached)", iterations, ush_trace_clock() - start);
+  ush_arena_reset(&ast_arena);
+
+  start = ush_trace_clock();
+  for (uint64_t i = 0; i < iterations; i++){
+    ush_parse_line(bench_lines[i % BENCH_NUM_LINES], &incomplete);
+  }
+  bench_report("parse (cached)", iterations, ush_trace_clock() - start);
+}
+
+/**
+   @brief Run builtins through ush_execute(), output going to /dev/null.
+   @param iterations Number of calls per builtin.
+ */
+void bench_builtins(uint64_t iterations)
+{
+  char *pwd_args[] = { "pwd", NULL };
+  char *echo_args[] = { "echo", "a", "few", "words", NULL };
+  char *test_args[] = { "[", "3", "-lt", "10", "]", NULL };
+  char *printf_args[] = { "printf", "%s=%d\n", "x", "42", NULL };
+  char **runs[] = { pwd_args, echo_args, test_args, printf_args };
+  int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  char name[48];
+
+  builtin_out.fd = null_fd;
+  for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++){
+    uint64_t start = ush_trace_clock();
+
+    for (uint64_t i = 0; i < iterations; i++){
+      ush_arena_reset(&cmd_arena);
+      ush_execute(runs[r]);
+    }
+    snprintf(name, sizeof(name), "builtin %s", runs[r][0]);
+    bench_report(name, iterations, ush_trace_clock() - start);
+  }
+  builtin_out.fd = STDOUT_FILENO;
+  close(null_fd);
+}
+
+/**
+   @brief Run a parsed loop of builtins, as scripts do: every iteration
+   tests, prints and assigns, and none of them starts a process.
+   @param iterations Number of loop iterations.
+ */
+void bench_loop(uint64_t iterations)
+{
+  const char *line = "for i in 1 2 3 4 5 6 7 8 9 10; do if [ $i -lt 5 ]; then printf '%s\\n' $i; else x=$i; true; fi; done";
+  int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  struct ush_list *list;
+  uint64_t start;
+  int incomplete;
+
+  list = ush_parse_line(line, &incomplete);
+  builtin_out.fd = null_fd;
+  start = ush_trace_clock();
+  for (uint64_t i = 0; i < iterations; i += 10){
+    ush_arena_reset(&cmd_arena);
+    ush_execute_list(list);
+  }
+  bench_report("loop iteration (builtins)", iterations, ush_trace_clock() - start);
+  builtin_out.fd = STDOUT_FILENO;
+  close(null_fd);
+}
+
+/**
+   @brief Run the external test(1) the builtin replaces, for comparison.
+   @param iterations Number of runs.
+ */
+void bench_external_test(uint64_t iterations)
+{
+  char *args[] = { "test", "3", "-lt", "10", NULL };
+  uint64_t start = ush_trace_clock();
+
+  for (uint64_t i = 0; i < iterations; i++){
+    ush_launch(args, NULL);
+  }
+  bench_report("external test (spawn)", iterations, ush_trace_clock() - start);
+}
+
+/**
+   @brief Expand command substitutions: one of builtins, captured in the
+   shell, and one of an external command, read from the reused pipe.
+   @param iterations Number of builtin substitutions; a thousandth as many
+   external ones.
+ */
+void bench_subst(uint64_t iterations)
+{
+  const char *builtin = "x=$(printf '%s\\n' word; echo more)";
+  const char *external = "x=$(/bin/echo word)";
+  struct ush_list *list;
+  uint64_t start;
+  int incomplete;
+
+  list = ush_parse_line(builtin, &incomplete);
+  start = ush_trace_clock();
+  for (uint64_t i = 0; i < iterations; i++){
+    ush_arena_reset(&cmd_arena);
+    ush_execute_list(list);
+  }
+  bench_report("substitution (builtins)", iterations, ush_trace_clock() - start);
+
+  iterations = (iterations + 999) / 1000;
+  list = ush_parse_line(external, &incomplete);
+  start = ush_trace_clock();
+  for (uint64_t i = 0; i < iterations; i++){
+    ush_arena_reset(&cmd_arena);
+    ush_execute_list(list);
+  }
+  bench_report("substitution (external)", iterations, ush_trace_clock() - start);
+}
+
+/**
+   @brief Complete command names from the $PATH index, as Tab does: the
+   first call lists the directories, the others only check for changes.
+   @param iterations Number of completions.
+ */
+void bench_complete(uint64_t iterations)
+{
+  const char *prefixes[] = { "g", "ls", "py", "x" };
+  uint64_t start = ush_trace_clock();
+
+  ush_complete_commands("", 0);
+  bench_report("index $PATH", 1, ush_trace_clock() - start);
+  printf("%-32s %10zu commands\n", "", complete_count);
+
+  start = ush_trace_clock();
+  for (uint64_t i = 0; i < iterations; i++){
+    const char *prefix = prefixes[i % 4];
+
+    complete_count = 0;
+    ush_complete_commands(prefix, strlen(prefix));
+  }
+  bench_report("complete command", iterations, ush_trace_clock() - start);
+  complete_count = 0;
+}
+
+/**
+   @brief Add distinct lines to the history, wrapping the ring many times.
+   @param iterations Number of lines added.
+ */
+void bench_history(uint64_t iterations)
+{
+  char line[64];
+  uint64_t start = ush_trace_clock();
+
+  for (uint64_t i = 0; i < iterations; i++){
+    snprintf(line, sizeof(line), "make -C build/%lu install", (unsigned long)(i % 4096));
+    add_to_history_util(line);
+  }
+  bench_report("add_to_history_util", iterations, ush_trace_clock() - start);
+}
+
+/**
+   @brief Start "true" and wait for it with every backend.
+   @param iterations Number of runs per backend.
+   @param label Appended to the names of the results.
+ */
+void bench_spawn(uint64_t iterations, const char *label)
+{
+  char *args[] = { "true", NULL };
+  char name[48];
+
+  for (size_t backend = 0; backend < sizeof(backend_str) / sizeof(char *); backend++){
+    uint64_t start;
+
+    ush_backend = backend;
+    start = ush_trace_clock();
+    for (uint64_t i = 0; i < iterations; i++){
+      ush_launch(args, NULL);
+    }
+    snprintf(name, sizeof(name), "spawn true (%s%s)", backend_str[backend], label);
+    bench_report(name, iterations, ush_trace_clock() - start);
+  }
+  ush_backend = USH_BACKEND_SPAWN;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t scale = (argc > 1 && atol(argv[1]) > 0) ? (uint64_t)atol(argv[1]) : 1;
+  size_t big_heap = 256 << 20;
+  char *heap;
+  sigset_t mask;
+
+  //Same setup as the shell itself, minus the terminal.
+  ush_zygote_start();
+  ush_var_import();
+  ush_cwd_init();
+  ush_history_resize(USH_DEFAULT_HISTORY_COUNT);
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  ush_sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  sigaddset(&mask, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &mask, &ush_child_sigmask);
+
+  bench_lex(1000000 * scale);
+  bench_parse(200000 * scale);
+  bench_builtins(200000 * scale);
+  bench_loop(200000 * scale);
+  bench_external_test(500 * scale);
+  bench_subst(500000 * scale);
+  bench_complete(100000 * scale);
+  bench_history(1000000 * scale);
+  bench_spawn(500 * scale, "");
+
+  //A shell that has grown: fork() has more page tables to copy, the zygote does not.
+  heap = ush_malloc(big_heap);
+  memset(heap, 1, big_heap);
+  bench_spawn(200 * scale, ", 256M heap");
+  free(heap);
+  return 0;
+}
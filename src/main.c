@@ -1,359 +1,10591 @@
-/***************************************************************************//**
-  @file         main.c
-  @author       Aditya Narad
-  @date         Thursday,  8 August 2019
-  @brief        LSH (Linux Shell)
-*******************************************************************************/
-
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/wait.h>
-#include <errno.h>
-
-
-/**
- * Function Declarations for builtin shell commands:
- */
-int ush_cd(char **args);
-int ush_help(char **args);
-int ush_exit(char **args);
-int ush_echo(char **args);
-int ush_history(char **args);
-int ush_pwd(char **args);
-
-/**
- * List of builtin commands, followed by their corresponding functions.
- */
-char *builtin_str[] = { "cd", "help", "exit", "echo", "history", "pwd"};
-
-int (*builtin_func[]) (char **) = {ush_cd, ush_help, ush_exit, ush_echo, ush_history, ush_pwd};
-
-/**
-   @brief  Find number of builtin commands in shell.
-   @return Number of elements in builtin_str array.
- */
-int ush_num_builtins()
-{
-  return (sizeof(builtin_str) / sizeof(char *));
-}
-
-/*
- *Builtin commands' function implementations.
-*/
-
-/**
-   @brief Builtin command: change directory.
-   @param args List of args.  args[0] is "cd".  args[1] is the directory.
-   @return Always returns 1, to continue executing.
- */
-int ush_cd(char **args)
-{
-    if(args[1] == NULL){
-        fprintf(stderr, "ush: expected argument with \"cd\"\n");
-    }
-    else if(chdir(args[1]) != 0){
-        perror("ush");
-    }
-    return 1;
-}
-
-/**
-   @brief Builtin command: print help.
-   @param args List of args.  Not examined.
-   @return Always returns 1, to continue executing.
- */
-int ush_help(char **args)
-{
-    printf("Aditya Narad's Linux Shell\n");
-    printf("How to Use Shell: Type the commands followed by arguments(if any) and press Enter.\n");
-    printf("Following are the builtin commands :\n");
-    int num_builtin_commands = ush_num_builtins();
-
-    for (int i = 0; i < num_builtin_commands; i++){
-        printf("\t%s\n", builtin_str[i]);
-    }
-    return 1;
-}
-
-/**
-   @brief Builtin command: exit.
-   @param args List of args.  Not examined.
-   @return Always returns 0, to terminate execution.
- */
-int ush_exit(char **args)
-{
-  return 0;
-}
-
-/**
-   @brief Builtin command: print input string.
-   @param args List of args.  args[0] is "echo".  Rest values in args is the input string.
-   @return Always returns 1, to continue executing.
- */
-int ush_echo(char **args)
-{
-    for (int i = 1; args[i]!=NULL; i++){
-        printf("%s ",args[i]);
-    }
-    printf("\n");
-    return 1;
-}
-
-/**
-   @brief Builtin command: current directory.
-   @param args List of args.  args[0] is "pwd".
-   @return Always returns 1, to continue executing.
- */
-int ush_pwd(char **args)
-{
-    long path_max;
-    unsigned int size;
-    char *buf;
-    char *ptr;
-
-
-    path_max = pathconf(".", _PC_PATH_MAX);
-    if (path_max == -1)
-        size = 1024;
-    else if (path_max > 10240)
-        size = 10240;
-    else
-        size = path_max;
-
-
-    for (buf = ptr = NULL; ptr == NULL; size *= 2)
-    {
-      buf = realloc(buf, size);
-      if (buf == NULL){
-        fprintf(stderr, "ush: allocation error\n");
-        exit(EXIT_FAILURE);
-      }
-
-
-      ptr = getcwd(buf, size);
-      if (ptr == NULL && errno != ERANGE){
-        perror("ush");
-        return 1;
-      }
-    }
-    printf("%s", ptr);
-    free (buf);
-    return 1;
-}
-
-#define USH_MAX_HISTORY_COUNT 20
-char* history_str[USH_MAX_HISTORY_COUNT];
-size_t history_pos = 0;
-
-/**
-   @brief Builtin command: shows a list of the commands entered since the start of session..
-   @param args List of args.  args[0] is "history".
-   @return Always returns 1, to continue executing.
- */
-int ush_history(char **args)
-{
-  size_t history_num = 1;
-  size_t i = history_pos;
-
-  do
-  {
-    if(history_str[i] != NULL){
-      printf("%4lu   %s\n", history_num, history_str[i]);
-      ++history_num;
-    }
-    i = (i + 1) % USH_MAX_HISTORY_COUNT;
-  } while (i != history_pos);
-
-  return 1;
-}
-
-/**
-  @brief Launch a program and wait for it to terminate.
-  @param args Null terminated list of arguments (including program).
-  @return Always returns 1, to continue execution.
- */
-int ush_launch(char **args)
-{
-  pid_t pid = fork();
-  if(pid == 0){
-    //Child Process
-    if(execvp(args[0], args) == -1){
-      perror("ush");
-      exit(EXIT_FAILURE);
-    }
-    exit(EXIT_SUCCESS);
-  }
-  else if(pid < 0){
-    //Couldn't fork.
-    perror("ush");
-  }
-  else{
-    //Parent Process
-    //Waiting for child to terminate.
-    wait(NULL);
-  }
-  return 1;
-}
-
-
-/**
- * @brief Adds input to history.
- * @param line The input string
- */
-void add_to_history_util(char *line)
-{
-  free(history_str[history_pos]);
-
-  size_t line_size = strlen(line);
-  char* history_entry = (char*)malloc(line_size * sizeof(char));
-
-  if(history_entry == NULL){
-    fprintf(stderr, "ush: allocation error\n");
-    exit(EXIT_FAILURE);
-  }
-  strcpy(history_entry, line);
-
-  history_str[history_pos] = history_entry;
-
-  history_pos = (history_pos + 1) % USH_MAX_HISTORY_COUNT;
-}
-
-
-/**
-   @brief Calls shell built-in or launch program. Used to execute internal and external commands.
-   @param args Null terminated list of arguments.
-   @return 1 if the shell should continue running, 0 if it should terminate
- */
-int ush_execute(char **args)
-{
-  if(args[0] == NULL){
-    //Empty Command
-    return 1;
-  }
-
-  int num_builtin_commands = ush_num_builtins();
-
-  for (int i = 0; i < num_builtin_commands; i++){
-    if(strcmp(args[0], builtin_str[i]) == 0){
-      //Command entered is Internal Command
-      return (builtin_func[i](args));
-    }
-  }
-  //Command entered is External Command
-  return ush_launch(args);
-}
-
-/**
- * @brief Read a line of input from stdin.
- * @return The line raed from stdin
- */
-
-char* ush_read_line()
-{
-  char* inp_line = NULL;
-  size_t bufsize = 0;
-  getline(&inp_line, &bufsize, stdin);
-
-  return inp_line;
-}
-
-#define USH_TOK_BUFSIZE 64
-#define USH_TOK_DELIM " \"\t\r\n\a()"
-/**
- * @brief Split the input line into tokens.
- * @param line The input line.
- * @return Null-terminated array of tokens.
- */
-char** ush_split_line(char* line)
-{
-  size_t bufsize = USH_TOK_BUFSIZE;
-  size_t pos = 0;
-  char** tokens = (char**)malloc(sizeof(char*) * bufsize);
-  char** ptr = NULL;
-  char* token;
-
-  if(tokens == NULL){
-    fprintf(stderr, "ush: allocation error\n");
-    exit(EXIT_FAILURE);
-  }
-
-  token = strtok(line, USH_TOK_DELIM);
-  while(token!=NULL){
-    tokens[pos++] = token;
-
-    if(pos == bufsize){
-      bufsize = bufsize * 2;
-      ptr = (char**)realloc(tokens, bufsize);
-
-      if(ptr == NULL){
-        free(tokens);
-        fprintf(stderr, "ush: allocation error\n");
-        exit(EXIT_FAILURE);
-      }
-      tokens = ptr;
-    }
-
-    token = strtok(NULL, USH_TOK_DELIM);
-  }
-  tokens[pos] = NULL;
-  return tokens;
-}
-
-/**
- * @brief Loop for getting input and excuting it.
- */
-void ush_loop()
-{
-  char* line;
-  char** args;
-  int status;
-
-  do
-  {
-    fputs("\n> ", stdout);
-    line = ush_read_line();
-    args = ush_split_line(line);
-
-    if(args[0] != NULL){
-      add_to_history_util(line);
-    }
-    status = ush_execute(args);
-
-    free(line);
-    free(args);
-  } while (status);
-}
-
-/**
- * @brief Main entry point.
- * @param argc Argument count.
- * @param argv Argument(Command Line) vector.
- * @return status code.
- */
-int main(int argc, char** argv)
-{
-
-  for (int i = 0; i < 80; i++){
-    fputc('*', stdout);
-  }
-  puts("\n Welcome to Linux Shell.");
-  puts("\nDeveloped in C by Aditya Narad - CSE 1");
-  for (int i = 0; i < 80; i++){
-    fputc('*', stdout);
-  }
-
-  //Initialize history_str array with NULL values.
-  for (size_t i = 0; i < USH_MAX_HISTORY_COUNT; i++){
-    history_str[i] = NULL;
-  }
-
-  //Run command loop.
-  ush_loop();
-
-  puts("\nGoodBye!!!");
-
-  return EXIT_SUCCESS;
-}
+/***************************************************************************//**
+  @file         main.c
+  @author       Aditya Narad
+  @date         Thursday,  8 August 2019
+  @brief        LSH (Linux Shell)
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+
+extern char **environ;
+
+/**
+ * Exit status of the last command (or pipeline) that was run.
+ */
+int ush_last_status = 0;
+
+/**
+ * Status before the builtin now running; ush_call_builtin() clears
+ * ush_last_status for it.
+ */
+int ush_prev_status = 0;
+
+/**
+ * Set when Ctrl-C interrupts the command line being run (see job control).
+ */
+volatile sig_atomic_t ush_interrupted = 0;
+
+/**
+ * Pipe to the execution log's writer, or -1 when $USH_LOG is not set (see
+ * ush_log_start()).
+ */
+int ush_log_fd = -1;
+
+/**
+ * Nonzero when reading commands from a terminal: only then are the banner,
+ * prompt, history and job notifications used.
+ */
+int ush_interactive = 0;
+
+
+/**
+ * Function Declarations for builtin shell commands:
+ */
+int ush_cd(char **args);
+int ush_help(char **args);
+int ush_exit(char **args);
+int ush_echo(char **args);
+int ush_history(char **args);
+int ush_pwd(char **args);
+int ush_set(char **args);
+int ush_jobs(char **args);
+int ush_fg(char **args);
+int ush_bg(char **args);
+int ush_wait(char **args);
+int ush_parallel(char **args);
+int ush_hash(char **args);
+int ush_memstat(char **args);
+int ush_export(char **args);
+int ush_unset(char **args);
+int ush_env(char **args);
+int ush_batch(char **args);
+int ush_time(char **args);
+int ush_profile(char **args);
+int ush_pool(char **args);
+int ush_break(char **args);
+int ush_continue(char **args);
+int ush_return(char **args);
+int ush_shift(char **args);
+int ush_true(char **args);
+int ush_false(char **args);
+int ush_test(char **args);
+int ush_printf(char **args);
+int ush_read(char **args);
+
+/**
+ * Builtin flags.
+ * USH_BUILTIN_PARENT:   Changes shell state, so it must run in the shell process itself.
+ * USH_BUILTIN_PIPESAFE: Only writes output, and only through ush_out_*(), so it
+ *                       may run in the shell as a pipeline stage.
+ * USH_BUILTIN_GLOBSTREAM: Patterns after a ":::" argument are not expanded for
+ *                       it but streamed to it (see ush_arg_pattern()).
+ */
+#define USH_BUILTIN_PARENT     0x1
+#define USH_BUILTIN_PIPESAFE   0x2
+#define USH_BUILTIN_GLOBSTREAM 0x4
+
+/**
+ * Descriptor of a builtin command.
+ */
+struct ush_builtin {
+  const char *name;
+  int (*func)(char **);
+  int flags;
+  const char *help;
+};
+
+/**
+ * Table of builtin commands.  Keep it sorted by name: it is searched with bsearch().
+ */
+const struct ush_builtin builtins[] = {
+  { ":",       ush_true,    USH_BUILTIN_PIPESAFE, "do nothing, successfully" },
+  { "[",       ush_test,    USH_BUILTIN_PIPESAFE, "evaluate a test expression, ending with ]" },
+  { "batch",   ush_batch,   USH_BUILTIN_GLOBSTREAM, "run a command over many arguments, as many per run as fit" },
+  { "bg",      ush_bg,      USH_BUILTIN_PARENT,   "continue a stopped job in the background" },
+  { "break",   ush_break,   USH_BUILTIN_PARENT,   "leave the enclosing loop, or N of them" },
+  { "cd",      ush_cd,      USH_BUILTIN_PARENT,   "change the current directory" },
+  { "continue", ush_continue, USH_BUILTIN_PARENT, "go on with the next iteration of the enclosing (or Nth) loop" },
+  { "echo",    ush_echo,    USH_BUILTIN_PIPESAFE, "print the arguments" },
+  { "env",     ush_env,     0,                    "show the environment, or run a command with NAME=value added" },
+  { "exit",    ush_exit,    USH_BUILTIN_PARENT,   "leave the shell with status N" },
+  { "export",  ush_export,  USH_BUILTIN_PARENT,   "export NAME[=value] to the environment of commands" },
+  { "false",   ush_false,   USH_BUILTIN_PIPESAFE, "do nothing, unsuccessfully" },
+  { "fg",      ush_fg,      USH_BUILTIN_PARENT,   "continue a job in the foreground" },
+  { "hash",    ush_hash,    USH_BUILTIN_PARENT,   "show or change remembered command locations" },
+  { "help",    ush_help,    USH_BUILTIN_PIPESAFE, "show this help" },
+  { "history", ush_history, USH_BUILTIN_PIPESAFE, "list the last N commands, or search saved ones with -s [^]pattern" },
+  { "jobs",    ush_jobs,    USH_BUILTIN_PARENT,   "list background jobs" },
+  { "memstat", ush_memstat, USH_BUILTIN_PIPESAFE, "show memory usage of the shell" },
+  { "parallel", ush_parallel, USH_BUILTIN_GLOBSTREAM, "run a command over many arguments at once" },
+  { "pool",    ush_pool,    USH_BUILTIN_PARENT,   "keep helper processes running and send them requests" },
+  { "printf",  ush_printf,  USH_BUILTIN_PIPESAFE, "print the arguments under control of a format" },
+  { "profile", ush_profile, USH_BUILTIN_PIPESAFE, "show where the shell spends its time (set -o trace first)" },
+  { "pwd",     ush_pwd,     USH_BUILTIN_PIPESAFE, "print the current directory" },
+  { "read",    ush_read,    USH_BUILTIN_PARENT,   "read a line of stdin into variables" },
+  { "return",  ush_return,  USH_BUILTIN_PARENT,   "return from a function with status N" },
+  { "set",     ush_set,     USH_BUILTIN_PARENT,   "show or change shell options" },
+  { "shift",   ush_shift,   USH_BUILTIN_PARENT,   "drop the first N positional parameters" },
+  { "test",    ush_test,    USH_BUILTIN_PIPESAFE, "evaluate a test expression" },
+  { "time",    ush_time,    0,                    "run a command and report the time and resources it used" },
+  { "true",    ush_true,    USH_BUILTIN_PIPESAFE, "do nothing, successfully" },
+  { "unset",   ush_unset,   USH_BUILTIN_PARENT,   "remove shell variables" },
+  { "wait",    ush_wait,    USH_BUILTIN_PARENT,   "wait for background jobs to finish" },
+};
+
+#define USH_NUM_BUILTINS (sizeof(builtins) / sizeof(builtins[0]))
+
+/**
+   @brief Compare a command name against a builtin descriptor (for bsearch).
+   @param key Command name.
+   @param elem Pointer to a struct ush_builtin.
+   @return strcmp() style ordering.
+ */
+int ush_builtin_cmp(const void *key, const void *elem)
+{
+  return strcmp((const char*)key, ((const struct ush_builtin*)elem)->name);
+}
+
+/**
+   @brief Look up a builtin command.
+   @param name Command name.
+   @return The builtin's descriptor, or NULL if name is not a builtin.
+ */
+const struct ush_builtin* ush_find_builtin(const char *name)
+{
+  return bsearch(name, builtins, USH_NUM_BUILTINS, sizeof(builtins[0]), ush_builtin_cmp);
+}
+
+/*
+ * Memory management.
+ */
+
+/**
+ * Number of heap allocations (malloc/realloc) made by the shell since start.
+ * Once the session's buffers have warmed up this stops moving for ordinary
+ * commands; the "memstat" builtin prints it.
+ */
+unsigned long ush_heap_allocs = 0;
+
+/**
+   @brief Allocate memory, exiting the shell if it is not available.
+   @param size Number of bytes.
+   @return The allocated block.
+ */
+void* ush_malloc(size_t size)
+{
+  void *ptr = malloc(size);
+
+  if(ptr == NULL){
+    fprintf(stderr, "ush: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  ush_heap_allocs++;
+  return ptr;
+}
+
+/**
+   @brief Resize memory, exiting the shell if it is not available.
+   @param ptr The block to resize (may be NULL).
+   @param size New size in bytes.
+   @return The (possibly moved) block.
+ */
+void* ush_realloc(void *ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+  if(ptr == NULL){
+    fprintf(stderr, "ush: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  ush_heap_allocs++;
+  return ptr;
+}
+
+/**
+   @brief Duplicate a string, exiting the shell if memory is not available.
+   @param str The string.
+   @return Newly allocated copy.
+ */
+char* ush_strdup(const char *str)
+{
+  size_t size = strlen(str) + 1;
+
+  return memcpy(ush_malloc(size), str, size);
+}
+
+#define USH_ARRAY_MIN_CAPACITY 16
+
+/**
+   @brief Grow an array so it can hold at least `needed` elements.
+   @param array The array (may be NULL).
+   @param capacity Current capacity in elements, updated on growth.
+   @param needed Number of elements required.
+   @param elem_size Size of one element in bytes.
+   @return The (possibly moved) array.
+ */
+void* ush_grow_array(void *array, size_t *capacity, size_t needed, size_t elem_size)
+{
+  size_t new_capacity = (*capacity == 0) ? USH_ARRAY_MIN_CAPACITY : *capacity;
+  void *ptr;
+
+  if(needed <= *capacity){
+    return array;
+  }
+  while(new_capacity < needed){
+    new_capacity *= 2;
+  }
+  ptr = ush_realloc(array, new_capacity * elem_size);
+  *capacity = new_capacity;
+  return ptr;
+}
+
+/**
+ * Bump allocator.  Memory is handed out from large chunks and released all at
+ * once by ush_arena_reset(); the chunks are kept, so an arena that is reset
+ * between commands stops calling malloc once it has grown to the size of the
+ * largest command.
+ */
+#define USH_ARENA_CHUNK_SIZE 16384
+#define USH_ARENA_ALIGN 16
+
+struct ush_arena_chunk {
+  struct ush_arena_chunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+struct ush_arena {
+  struct ush_arena_chunk *first;
+  struct ush_arena_chunk *current;
+  size_t in_use;
+  size_t peak;
+};
+
+/**
+ * Arena for everything that only lives while one command line is processed.
+ * Reset at the top of every iteration of ush_loop().
+ */
+struct ush_arena cmd_arena;
+
+/**
+ * Arena holding the parse cache (see ush_parse_line()); it lives across
+ * commands and is only reset when the cache is dropped.
+ */
+struct ush_arena ast_arena;
+size_t ast_cache_entries = 0;
+unsigned long ast_cache_hits = 0;
+unsigned long ast_cache_misses = 0;
+
+/**
+   @brief Allocate from an arena.
+   @param arena The arena.
+   @param size Number of bytes.
+   @return Memory aligned to USH_ARENA_ALIGN, valid until the arena is reset.
+ */
+void* ush_arena_alloc(struct ush_arena *arena, size_t size)
+{
+  struct ush_arena_chunk *chunk = arena->current;
+
+  size = (size + USH_ARENA_ALIGN - 1) & ~(size_t)(USH_ARENA_ALIGN - 1);
+  while(chunk != NULL && chunk->size - chunk->used < size){
+    chunk = chunk->next;
+  }
+  if(chunk == NULL){
+    size_t chunk_size = (size > USH_ARENA_CHUNK_SIZE) ? size : USH_ARENA_CHUNK_SIZE;
+
+    chunk = (struct ush_arena_chunk*)ush_malloc(sizeof(struct ush_arena_chunk) + chunk_size);
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    //Keep the chain ordered: append after the last chunk.
+    chunk->next = NULL;
+    if(arena->first == NULL){
+      arena->first = chunk;
+    }
+    else{
+      struct ush_arena_chunk *last = arena->current;
+      while(last->next != NULL){
+        last = last->next;
+      }
+      last->next = chunk;
+    }
+  }
+  arena->current = chunk;
+  chunk->used += size;
+  arena->in_use += size;
+  if(arena->in_use > arena->peak){
+    arena->peak = arena->in_use;
+  }
+  return chunk->data + chunk->used - size;
+}
+
+/**
+   @brief Copy a string into an arena.
+   @param arena The arena.
+   @param str The string.
+   @param len Number of characters to copy.
+   @return NUL terminated copy.
+ */
+char* ush_arena_strndup(struct ush_arena *arena, const char *str, size_t len)
+{
+  char *copy = ush_arena_alloc(arena, len + 1);
+
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+/**
+   @brief Release everything allocated from an arena, keeping its chunks.
+   @param arena The arena.
+ */
+void ush_arena_reset(struct ush_arena *arena)
+{
+  for (struct ush_arena_chunk *chunk = arena->first; chunk != NULL; chunk = chunk->next){
+    chunk->used = 0;
+  }
+  arena->current = arena->first;
+  arena->in_use = 0;
+}
+
+/**
+ * A point in an arena's allocations, to go back to with ush_arena_rewind().
+ */
+struct ush_arena_mark {
+  struct ush_arena_chunk *chunk;
+  size_t used;
+  size_t in_use;
+};
+
+/**
+   @brief Remember how much of an arena is allocated.
+   @param arena The arena.
+   @param mark Receives the position.
+ */
+void ush_arena_mark(struct ush_arena *arena, struct ush_arena_mark *mark)
+{
+  mark->chunk = arena->current;
+  mark->used = (arena->current != NULL) ? arena->current->used : 0;
+  mark->in_use = arena->in_use;
+}
+
+/**
+   @brief Release everything allocated from an arena since a mark was taken.
+   Allocations only move forward along the chunk chain, so the chunks after
+   the marked one are emptied and the marked one cut back.
+   @param arena The arena.
+   @param mark Position from ush_arena_mark().
+ */
+void ush_arena_rewind(struct ush_arena *arena, const struct ush_arena_mark *mark)
+{
+  if(mark->chunk == NULL){
+    ush_arena_reset(arena);
+    return;
+  }
+  for (struct ush_arena_chunk *chunk = mark->chunk->next; chunk != NULL; chunk = chunk->next){
+    chunk->used = 0;
+  }
+  mark->chunk->used = mark->used;
+  arena->current = mark->chunk;
+  arena->in_use = mark->in_use;
+}
+
+/**
+   @brief Give all of an arena's memory back.
+   @param arena The arena.
+ */
+void ush_arena_release(struct ush_arena *arena)
+{
+  for (struct ush_arena_chunk *chunk = arena->first; chunk != NULL; ){
+    struct ush_arena_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  memset(arena, 0, sizeof(*arena));
+}
+
+/**
+ * Tracing.  With "set -o trace" (or $USH_TRACE set at startup) the phases of
+ * running a command are timed and kept as fixed size binary events in a ring
+ * of the last USH_TRACE_EVENTS, and every duration is also counted in a log2
+ * histogram per phase; "profile" shows both.  Probes are written with
+ * USH_TRACE_BEGIN()/USH_TRACE_END(), which cost one predicted-not-taken
+ * branch each while tracing is off.
+ *
+ * With the spawn and vfork backends the shell resumes only once the child has
+ * exec'd, so the spawn phase includes the exec; the child itself runs during
+ * the wait phase.
+ */
+#define USH_TRACE_EVENTS 4096
+#define USH_TRACE_BUCKETS 32
+
+enum ush_trace_kind {
+  USH_TR_READ, USH_TR_LEX, USH_TR_PARSE, USH_TR_COMMAND, USH_TR_LOOKUP,
+  USH_TR_SPAWN, USH_TR_WAIT, USH_TR_BUILTIN, USH_TR_NUM_KINDS
+};
+
+const char *trace_kind_str[USH_TR_NUM_KINDS] = {
+  "read", "lex", "parse", "command", "lookup", "spawn", "wait", "builtin"
+};
+
+struct ush_trace_event {
+  uint64_t start;
+  uint32_t duration;
+  uint16_t kind;
+  uint16_t flags;
+};
+
+struct ush_trace_event trace_ring[USH_TRACE_EVENTS];
+uint64_t trace_count = 0;
+uint64_t trace_hist[USH_TR_NUM_KINDS][USH_TRACE_BUCKETS];
+uint64_t trace_total[USH_TR_NUM_KINDS];
+int ush_opt_trace = 0;
+
+#define USH_TRACE_BEGIN(var) \
+  uint64_t var = __builtin_expect(ush_opt_trace, 0) ? ush_trace_clock() : 0
+#define USH_TRACE_END(kind, var) \
+  do { if(__builtin_expect(ush_opt_trace, 0)) ush_trace_record((kind), (var)); } while(0)
+
+/**
+   @brief Clock used for trace events.
+   @return Monotonic time in nanoseconds.
+ */
+uint64_t ush_trace_clock()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+   @brief Record a finished phase.
+   @param kind The phase (enum ush_trace_kind).
+   @param start When it began (0 if tracing was off then: nothing is recorded).
+ */
+void ush_trace_record(int kind, uint64_t start)
+{
+  struct ush_trace_event *event;
+  uint64_t duration;
+  int bucket;
+
+  if(start == 0){
+    return;
+  }
+  duration = ush_trace_clock() - start;
+  if(duration > UINT32_MAX){
+    duration = UINT32_MAX;
+  }
+  event = &trace_ring[trace_count++ % USH_TRACE_EVENTS];
+  event->start = start;
+  event->duration = duration;
+  event->kind = kind;
+  event->flags = 0;
+
+  bucket = (duration == 0) ? 0 : 64 - __builtin_clzll(duration);
+  trace_hist[kind][bucket < USH_TRACE_BUCKETS ? bucket : USH_TRACE_BUCKETS - 1]++;
+  trace_total[kind] += duration;
+}
+
+/**
+ * Builtin output.  Builtins write their standard output through ush_out_*():
+ * the pieces are collected as an iovec, referencing strings that outlive the
+ * command and formatting the rest into the command arena, and go to
+ * builtin_out.fd with writev() when the builtin returns, so a builtin makes
+ * one system call however many pieces it prints.
+ */
+struct ush_output {
+  struct iovec *iov;
+  size_t count;
+  size_t capacity;
+  int fd;
+};
+
+struct ush_output builtin_out = { NULL, 0, 0, STDOUT_FILENO };
+
+/**
+ * Output of command substitutions (see ush_substitute()).  While capturing
+ * is set, builtins run for a substitution in the shell itself have their
+ * output appended to capture_buf instead of written out; the output of other
+ * commands is read into it from subst_pipe, which is kept for the next one.
+ * Nested substitutions append after what the outer ones have so far.
+ */
+char *capture_buf = NULL;
+size_t capture_len = 0;
+size_t capture_capacity = 0;
+int capturing = 0;
+int subst_pipe[2] = { -1, -1 };
+//Substitutions run so far: a command of only assignments takes its status from one.
+unsigned long subst_count = 0;
+
+/**
+   @brief Append to the captured output.
+   @param str The text.
+   @param len Its length.
+ */
+void ush_capture_append(const char *str, size_t len)
+{
+  capture_buf = ush_grow_array(capture_buf, &capture_capacity, capture_len + len + 1, 1);
+  memcpy(capture_buf + capture_len, str, len);
+  capture_len += len;
+}
+
+/**
+   @brief Add a string to the builtin output without copying it.
+   @param str The string; it must stay valid until ush_out_flush().
+   @param len Its length.
+ */
+void ush_out_str(const char *str, size_t len)
+{
+  struct iovec *last = builtin_out.count ? &builtin_out.iov[builtin_out.count - 1] : NULL;
+
+  if(len == 0){
+    return;
+  }
+  if(last != NULL && (const char*)last->iov_base + last->iov_len == str){
+    last->iov_len += len;
+    return;
+  }
+  builtin_out.iov = ush_grow_array(builtin_out.iov, &builtin_out.capacity, builtin_out.count + 1, sizeof(struct iovec));
+  builtin_out.iov[builtin_out.count].iov_base = (void*)str;
+  builtin_out.iov[builtin_out.count].iov_len = len;
+  builtin_out.count++;
+}
+
+/**
+   @brief Add a NUL terminated string to the builtin output without copying it.
+   @param str The string; it must stay valid until ush_out_flush().
+ */
+void ush_out_puts(const char *str)
+{
+  ush_out_str(str, strlen(str));
+}
+
+/**
+   @brief Add formatted text to the builtin output.
+   @param fmt printf() format.
+ */
+void ush_out_printf(const char *fmt, ...)
+{
+  size_t size = 128;
+  char *buf = ush_arena_alloc(&cmd_arena, size);
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  if(len >= (int)size){
+    buf = ush_arena_alloc(&cmd_arena, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(buf, len + 1, fmt, ap);
+    va_end(ap);
+  }
+  if(len > 0){
+    ush_out_str(buf, len);
+  }
+}
+
+/**
+   @brief Write out the builtin output, IOV_MAX pieces per writev().
+   A reader that has gone away (EPIPE) silently discards the rest.  While a
+   command substitution is capturing, the output is kept instead.
+ */
+void ush_out_flush()
+{
+  struct iovec *iov = builtin_out.iov;
+  size_t count = builtin_out.count;
+
+  fflush(stdout);
+  if(capturing){
+    for (size_t i = 0; i < count; i++){
+      ush_capture_append(iov[i].iov_base, iov[i].iov_len);
+    }
+    count = 0;
+  }
+  while(count > 0){
+    ssize_t n = writev(builtin_out.fd, iov, (count < IOV_MAX) ? count : IOV_MAX);
+
+    if(n < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      if(errno != EPIPE){
+        perror("ush: write error");
+      }
+      break;
+    }
+    //Skip what was written, which may end inside a piece.
+    while(count > 0 && (size_t)n >= iov->iov_len){
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if(count > 0){
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  builtin_out.count = 0;
+}
+
+//The execution log comes with the job table, further on.
+void ush_log_builtin(const char *name, uint64_t start);
+
+/**
+   @brief Run a builtin and write out its output.
+   @param builtin The builtin.
+   @param args Null terminated list of arguments.
+   @return The builtin's return value.
+ */
+int ush_call_builtin(const struct ush_builtin *builtin, char **args)
+{
+  USH_TRACE_BEGIN(start);
+  uint64_t log_start = __builtin_expect(ush_log_fd >= 0, 0) ? ush_trace_clock() : 0;
+  int ret;
+
+  //Builtins only set the status when they fail.
+  ush_prev_status = ush_last_status;
+  ush_last_status = 0;
+  ret = builtin->func(args);
+
+  ush_out_flush();
+  USH_TRACE_END(USH_TR_BUILTIN, start);
+  if(__builtin_expect(log_start != 0, 0)){
+    ush_log_builtin(builtin->name, log_start);
+  }
+  return ret;
+}
+
+/**
+   @brief Builtin command: print memory usage statistics.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int ush_memstat(char **args)
+{
+  size_t chunks = 0;
+  size_t bytes = 0;
+
+  for (struct ush_arena_chunk *chunk = cmd_arena.first; chunk != NULL; chunk = chunk->next){
+    chunks++;
+    bytes += chunk->size;
+  }
+  ush_out_printf("heap allocations:  %lu\n", ush_heap_allocs);
+  ush_out_printf("command arena:     %zu bytes in %zu chunks, peak use %zu bytes\n", bytes, chunks, cmd_arena.peak);
+  ush_out_printf("parse cache:       %zu lines in %zu bytes, %lu hits, %lu misses\n",
+                 ast_cache_entries, ast_arena.in_use, ast_cache_hits, ast_cache_misses);
+  return 1;
+}
+
+/**
+   @brief Format a duration for the profile.
+   @param buf Buffer of at least 16 bytes.
+   @param ns Duration in nanoseconds.
+   @return buf.
+ */
+char* ush_trace_fmt(char *buf, double ns)
+{
+  if(ns < 1e3){
+    snprintf(buf, 16, "%.0fns", ns);
+  }
+  else if(ns < 1e6){
+    snprintf(buf, 16, "%.1fus", ns / 1e3);
+  }
+  else if(ns < 1e9){
+    snprintf(buf, 16, "%.1fms", ns / 1e6);
+  }
+  else{
+    snprintf(buf, 16, "%.2fs", ns / 1e9);
+  }
+  return buf;
+}
+
+/**
+   @brief Builtin command: show the trace.
+   @param args List of args.  args[0] is "profile".  Without options, per
+   phase counts, mean latency and latency histograms; "-e [N]" lists the last
+   N events (default: all kept); "-r" clears everything.
+   @return Always returns 1, to continue executing.
+ */
+int ush_profile(char **args)
+{
+  char a[16], b[16];
+
+  if(args[1] != NULL && strcmp(args[1], "-r") == 0){
+    trace_count = 0;
+    memset(trace_hist, 0, sizeof(trace_hist));
+    memset(trace_total, 0, sizeof(trace_total));
+    return 1;
+  }
+  if(args[1] != NULL && strcmp(args[1], "-e") == 0){
+    uint64_t kept = (trace_count < USH_TRACE_EVENTS) ? trace_count : USH_TRACE_EVENTS;
+    uint64_t n = (args[2] != NULL && atol(args[2]) > 0) ? (uint64_t)atol(args[2]) : kept;
+    uint64_t base;
+
+    if(n > kept){
+      n = kept;
+    }
+    //Events are kept in the order they ended; times are shown from the
+    //earliest start.
+    base = UINT64_MAX;
+    for (uint64_t i = trace_count - n; i < trace_count; i++){
+      if(trace_ring[i % USH_TRACE_EVENTS].start < base){
+        base = trace_ring[i % USH_TRACE_EVENTS].start;
+      }
+    }
+    for (uint64_t i = trace_count - n; i < trace_count; i++){
+      struct ush_trace_event *event = &trace_ring[i % USH_TRACE_EVENTS];
+
+      ush_out_printf("%12.3fus  %-8s %s\n", (event->start - base) / 1e3,
+                     trace_kind_str[event->kind], ush_trace_fmt(a, event->duration));
+    }
+    return 1;
+  }
+  if(args[1] != NULL){
+    fprintf(stderr, "ush: usage: profile [-e [N] | -r]\n");
+    ush_last_status = 2;
+    return 1;
+  }
+
+  if(!ush_opt_trace && trace_count == 0){
+    ush_out_puts("tracing is off: turn it on with \"set -o trace\" or USH_TRACE=1\n");
+    return 1;
+  }
+  ush_out_printf("%-8s %10s %10s %10s\n", "phase", "count", "total", "mean");
+  for (int kind = 0; kind < USH_TR_NUM_KINDS; kind++){
+    uint64_t count = 0;
+
+    for (int i = 0; i < USH_TRACE_BUCKETS; i++){
+      count += trace_hist[kind][i];
+    }
+    if(count == 0){
+      continue;
+    }
+    ush_out_printf("%-8s %10lu %10s %10s\n", trace_kind_str[kind], (unsigned long)count,
+                   ush_trace_fmt(a, trace_total[kind]), ush_trace_fmt(b, (double)trace_total[kind] / count));
+  }
+  for (int kind = 0; kind < USH_TR_NUM_KINDS; kind++){
+    uint64_t most = 0;
+    int lo = USH_TRACE_BUCKETS, hi = 0;
+
+    for (int i = 0; i < USH_TRACE_BUCKETS; i++){
+      if(trace_hist[kind][i] != 0){
+        most = (trace_hist[kind][i] > most) ? trace_hist[kind][i] : most;
+        lo = (i < lo) ? i : lo;
+        hi = i;
+      }
+    }
+    if(most == 0){
+      continue;
+    }
+    ush_out_printf("\n%s:\n", trace_kind_str[kind]);
+    for (int i = lo; i <= hi; i++){
+      //Bucket i holds durations in [2^(i-1), 2^i) ns.
+      int bar = (int)((trace_hist[kind][i] * 40 + most - 1) / most);
+
+      ush_out_printf("  < %-8s %8lu |%.*s\n", ush_trace_fmt(a, (double)(1ULL << i)),
+                     (unsigned long)trace_hist[kind][i], bar, "########################################");
+    }
+  }
+  return 1;
+}
+
+/*
+ *Builtin commands' function implementations.
+*/
+
+/**
+   @brief Builtin command: print help.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int ush_help(char **args)
+{
+    ush_out_puts("Aditya Narad's Linux Shell\n");
+    ush_out_puts("How to Use Shell: Type the commands followed by arguments(if any) and press Enter.\n");
+    ush_out_puts("Following are the builtin commands :\n");
+    for (size_t i = 0; i < USH_NUM_BUILTINS; i++){
+        ush_out_printf("\t%-10s%s\n", builtins[i].name, builtins[i].help);
+    }
+    return 1;
+}
+
+/**
+   @brief Builtin command: exit.
+   @param args List of args.  args[0] is "exit".  args[1], if given, is the
+   exit status; otherwise it is that of the last command.
+   @return Always returns 0, to terminate execution.
+ */
+int ush_exit(char **args)
+{
+  ush_last_status = (args[1] != NULL) ? atoi(args[1]) & 0xff : ush_prev_status;
+  return 0;
+}
+
+/**
+   @brief Builtin command: print input string.
+   @param args List of args.  args[0] is "echo".  Rest values in args is the input string.
+   @return Always returns 1, to continue executing.
+ */
+int ush_echo(char **args)
+{
+    for (int i = 1; args[i]!=NULL; i++){
+        if(i > 1){
+            ush_out_str(" ", 1);
+        }
+        ush_out_puts(args[i]);
+    }
+    ush_out_str("\n", 1);
+    return 1;
+}
+
+/**
+   @brief FNV-1a hash of a NUL terminated string.
+   @param str The string.
+   @return Hash value.
+ */
+unsigned long ush_strhash(const char *str)
+{
+  unsigned long hash = 2166136261UL;
+
+  while(*str != '\0'){
+    hash = (hash ^ (unsigned char)*str++) * 16777619UL;
+  }
+  return hash;
+}
+
+#define USH_DEFAULT_HISTORY_COUNT 20
+#define USH_MAX_HISTORY_COUNT 100000
+
+/**
+ * History entries, a ring of $HISTSIZE slots.  Each slot keeps its buffer when
+ * overwritten and only grows it, so history is a long-lived pool separate from
+ * the per-command arena.
+ */
+struct ush_history_slot {
+  char *line;
+  size_t capacity;
+  unsigned long digest;
+};
+
+struct ush_history_slot *history_str = NULL;
+size_t history_size = 0;
+size_t history_pos = 0;
+size_t history_filled = 0;
+size_t history_count = 0;
+
+/**
+ * Digests of the lines in the ring, counted, in an open addressing table at
+ * most half full.  With "set -o ignoredups" a line whose digest is present is
+ * not stored again.
+ */
+struct ush_digest {
+  unsigned long digest;
+  size_t count;
+};
+
+struct ush_digest *history_digests = NULL;
+size_t history_digest_mask = 0;
+int ush_opt_ignoredups = 0;
+
+/**
+   @brief Find a digest in the history digest table.
+   @param digest The digest.
+   @return Its entry, or the free entry where it belongs.
+ */
+struct ush_digest* ush_digest_find(unsigned long digest)
+{
+  size_t i = digest & history_digest_mask;
+
+  while(history_digests[i].count != 0 && history_digests[i].digest != digest){
+    i = (i + 1) & history_digest_mask;
+  }
+  return &history_digests[i];
+}
+
+/**
+   @brief Count one more line with a digest.
+   @param digest The digest.
+ */
+void ush_digest_add(unsigned long digest)
+{
+  struct ush_digest *entry = ush_digest_find(digest);
+
+  entry->digest = digest;
+  entry->count++;
+}
+
+/**
+   @brief Count one line less with a digest.
+   An entry that drops to zero is deleted by moving later entries of its
+   probe run back, so lookups never need tombstones.
+   @param digest The digest.
+ */
+void ush_digest_remove(unsigned long digest)
+{
+  size_t i = ush_digest_find(digest) - history_digests;
+  size_t j = i;
+
+  if(history_digests[i].count == 0 || --history_digests[i].count != 0){
+    return;
+  }
+  for (;;){
+    size_t home;
+
+    j = (j + 1) & history_digest_mask;
+    if(history_digests[j].count == 0){
+      break;
+    }
+    home = history_digests[j].digest & history_digest_mask;
+    //Entries whose home lies cyclically in (i, j] are still reachable.
+    if((i <= j) ? (i < home && home <= j) : (i < home || home <= j)){
+      continue;
+    }
+    history_digests[i] = history_digests[j];
+    i = j;
+  }
+  history_digests[i].count = 0;
+}
+
+/**
+   @brief Resize the history ring, keeping the most recent lines.
+   @param size New number of slots (at least 1).
+ */
+void ush_history_resize(size_t size)
+{
+  struct ush_history_slot *slots = ush_malloc(size * sizeof(struct ush_history_slot));
+  size_t keep = (history_filled < size) ? history_filled : size;
+  size_t oldest = (history_pos + history_size - history_filled) % (history_size ? history_size : 1);
+  size_t table_size = USH_ARRAY_MIN_CAPACITY;
+
+  for (size_t i = 0; i < history_filled; i++){
+    struct ush_history_slot *slot = &history_str[(oldest + i) % history_size];
+
+    if(i < history_filled - keep){
+      free(slot->line);
+    }
+    else{
+      slots[i - (history_filled - keep)] = *slot;
+    }
+  }
+  memset(slots + keep, 0, (size - keep) * sizeof(struct ush_history_slot));
+  free(history_str);
+  history_str = slots;
+  history_size = size;
+  history_filled = keep;
+  history_pos = keep % size;
+
+  while(table_size < 2 * size){
+    table_size *= 2;
+  }
+  free(history_digests);
+  history_digests = ush_malloc(table_size * sizeof(struct ush_digest));
+  memset(history_digests, 0, table_size * sizeof(struct ush_digest));
+  history_digest_mask = table_size - 1;
+  for (size_t i = 0; i < keep; i++){
+    ush_digest_add(slots[i].digest);
+  }
+}
+
+/**
+   @brief Write a whole buffer to a descriptor.
+   @param fd The descriptor.
+   @param buf The data.
+   @param len Number of bytes.
+   @return 0 on success, -1 on error.
+ */
+int ush_write_all(int fd, const char *buf, size_t len)
+{
+  while(len > 0){
+    ssize_t n = write(fd, buf, len);
+
+    if(n < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+   @brief Store a line in the next history slot, overwriting the oldest one.
+   The slot keeps room for a newline after the line, so it can be appended to
+   the history file as it is.
+   @param line The line.
+   @param len Length of the line.
+   @return The slot.
+ */
+struct ush_history_slot* ush_history_store(const char *line, size_t len)
+{
+  struct ush_history_slot *slot = &history_str[history_pos];
+
+  if(history_filled == history_size){
+    ush_digest_remove(slot->digest);
+  }
+  else{
+    history_filled++;
+  }
+  if(slot->capacity < len + 2){
+    slot->capacity = (len + 2 + 63) & ~(size_t)63;
+    slot->line = ush_realloc(slot->line, slot->capacity);
+  }
+  memcpy(slot->line, line, len);
+  slot->line[len] = '\0';
+  slot->digest = ush_strhash(slot->line);
+  ush_digest_add(slot->digest);
+
+  history_pos = (history_pos + 1) % history_size;
+  history_count++;
+  return slot;
+}
+
+/**
+ * Shell variables.  Each variable is kept as one "NAME=value" string, so the
+ * environment handed to children is just an array of pointers to the
+ * exported ones.  That array is rebuilt only when an exported variable has
+ * changed since it was last built (ush_env_generation), and otherwise reused
+ * by every launch.
+ */
+#define USH_VAR_BUCKETS 256
+
+struct ush_var {
+  char *entry;
+  size_t name_len;
+  size_t capacity;
+  int exported;
+  struct ush_var *next;
+};
+
+struct ush_var *var_table[USH_VAR_BUCKETS];
+size_t var_exported = 0;
+unsigned long ush_env_generation = 1;
+char **env_cache = NULL;
+size_t env_cache_capacity = 0;
+unsigned long env_cache_generation = 0;
+
+/**
+   @brief Check that a string starts with a valid variable name.
+   @param str The string.
+   @return Length of the name (0 if there is none).
+ */
+size_t ush_var_name_len(const char *str)
+{
+  size_t len = 0;
+
+  if((*str < 'A' || *str > 'Z') && (*str < 'a' || *str > 'z') && *str != '_'){
+    return 0;
+  }
+  while((str[len] >= 'A' && str[len] <= 'Z') || (str[len] >= 'a' && str[len] <= 'z') ||
+        (str[len] >= '0' && str[len] <= '9') || str[len] == '_'){
+    len++;
+  }
+  return len;
+}
+
+/**
+   @brief Find the link to a variable in its bucket.
+   @param name Variable name (not necessarily NUL terminated).
+   @param len Length of the name.
+   @return Link pointing at the variable, or at the NULL ending the bucket.
+ */
+struct ush_var** ush_var_slot(const char *name, size_t len)
+{
+  unsigned long hash = 2166136261UL;
+  struct ush_var **link;
+
+  for (size_t i = 0; i < len; i++){
+    hash = (hash ^ (unsigned char)name[i]) * 16777619UL;
+  }
+  link = &var_table[hash % USH_VAR_BUCKETS];
+  while(*link != NULL && ((*link)->name_len != len || memcmp((*link)->entry, name, len) != 0)){
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/**
+   @brief Look up a variable.
+   @param name Variable name.
+   @return Its value, valid until the variable changes, or NULL if unset.
+ */
+const char* ush_var_get(const char *name)
+{
+  struct ush_var *var = *ush_var_slot(name, strlen(name));
+
+  return (var != NULL) ? var->entry + var->name_len + 1 : NULL;
+}
+
+/**
+   @brief Mark a variable as exported or not.
+   @param var The variable.
+   @param exported Nonzero to export it.
+ */
+void ush_var_set_exported(struct ush_var *var, int exported)
+{
+  exported = (exported != 0);
+  if(var->exported != exported){
+    var->exported = exported;
+    var_exported += exported ? 1 : -1;
+    ush_env_generation++;
+  }
+}
+
+/**
+   @brief Set a variable, creating it (unexported) if needed.
+   The variable's buffer is reused when the new value fits.
+   @param name Variable name (a valid name, not necessarily NUL terminated).
+   @param len Length of the name.
+   @param value The value.
+   @return The variable.
+ */
+struct ush_var* ush_var_setn(const char *name, size_t len, const char *value)
+{
+  struct ush_var **link = ush_var_slot(name, len);
+  struct ush_var *var = *link;
+  size_t size = len + strlen(value) + 2;
+
+  if(var == NULL){
+    var = *link = ush_malloc(sizeof(struct ush_var));
+    var->entry = NULL;
+    var->capacity = 0;
+    var->name_len = len;
+    var->exported = 0;
+    var->next = NULL;
+  }
+  if(var->capacity < size){
+    var->capacity = (size + 31) & ~(size_t)31;
+    var->entry = ush_realloc(var->entry, var->capacity);
+  }
+  memcpy(var->entry, name, len);
+  var->entry[len] = '=';
+  memcpy(var->entry + len + 1, value, size - len - 1);
+  if(var->exported){
+    ush_env_generation++;
+  }
+  return var;
+}
+
+/**
+   @brief Set a variable, creating it (unexported) if needed.
+   @param name Variable name.
+   @param value The value.
+   @return The variable.
+ */
+struct ush_var* ush_var_set(const char *name, const char *value)
+{
+  return ush_var_setn(name, strlen(name), value);
+}
+
+/**
+   @brief Remove a variable.
+   @param name Variable name.
+ */
+void ush_var_unset(const char *name)
+{
+  struct ush_var **link = ush_var_slot(name, strlen(name));
+  struct ush_var *var = *link;
+
+  if(var == NULL){
+    return;
+  }
+  ush_var_set_exported(var, 0);
+  *link = var->next;
+  free(var->entry);
+  free(var);
+}
+
+/**
+   @brief Environment for a child.
+   @return Null terminated "NAME=value" array of the exported variables,
+   rebuilt only if one of them has changed since the last call.
+ */
+char** ush_envp()
+{
+  size_t n = 0;
+
+  if(env_cache_generation == ush_env_generation){
+    return env_cache;
+  }
+  env_cache = ush_grow_array(env_cache, &env_cache_capacity, var_exported + 1, sizeof(char*));
+  for (size_t i = 0; i < USH_VAR_BUCKETS; i++){
+    for (struct ush_var *var = var_table[i]; var != NULL; var = var->next){
+      if(var->exported){
+        env_cache[n++] = var->entry;
+      }
+    }
+  }
+  env_cache[n] = NULL;
+  env_cache_generation = ush_env_generation;
+  return env_cache;
+}
+
+/**
+   @brief Import the shell's environment as exported variables.
+ */
+void ush_var_import()
+{
+  for (char **env = environ; *env != NULL; env++){
+    const char *eq = strchr(*env, '=');
+    size_t len = ush_var_name_len(*env);
+
+    if(eq != NULL && len == (size_t)(eq - *env)){
+      ush_var_set_exported(ush_var_setn(*env, len, eq + 1), 1);
+    }
+  }
+}
+
+/**
+   @brief Builtin command: export variables, or list the exported ones.
+   @param args List of args.  args[0] is "export".  Each argument is NAME or NAME=value.
+   @return Always returns 1, to continue executing.
+ */
+int ush_export(char **args)
+{
+  if(args[1] == NULL){
+    char **envp = ush_envp();
+
+    for (size_t i = 0; envp[i] != NULL; i++){
+      ush_out_str("export ", 7);
+      ush_out_puts(envp[i]);
+      ush_out_str("\n", 1);
+    }
+    return 1;
+  }
+  for (int i = 1; args[i] != NULL; i++){
+    size_t len = ush_var_name_len(args[i]);
+    struct ush_var *var;
+
+    if(len == 0 || (args[i][len] != '\0' && args[i][len] != '=')){
+      fprintf(stderr, "ush: export: `%s': not a valid identifier\n", args[i]);
+      ush_last_status = 1;
+      continue;
+    }
+    if(args[i][len] == '='){
+      var = ush_var_setn(args[i], len, args[i] + len + 1);
+    }
+    else if((var = *ush_var_slot(args[i], len)) == NULL){
+      //Nothing to export yet.
+      continue;
+    }
+    ush_var_set_exported(var, 1);
+  }
+  return 1;
+}
+
+/**
+   @brief Builtin command: remove variables.
+   @param args List of args.  args[0] is "unset".  The rest are variable names.
+   @return Always returns 1, to continue executing.
+ */
+int ush_unset(char **args)
+{
+  for (int i = 1; args[i] != NULL; i++){
+    ush_var_unset(args[i]);
+  }
+  return 1;
+}
+
+/*
+ * Standard utilities as builtins.  Scripts run these more than anything
+ * else, mostly in loops; as builtins they cost a function call instead of
+ * a fork and exec.  They follow POSIX, so they can stand in for the programs.
+ */
+
+/**
+   @brief Builtin command: true (and ":").
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int ush_true(char **args)
+{
+  return 1;
+}
+
+/**
+   @brief Builtin command: false.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int ush_false(char **args)
+{
+  ush_last_status = 1;
+  return 1;
+}
+
+/**
+ * State of the evaluation of a test expression.  name is "test" or "[", for
+ * messages; failed is set by the first error, which makes the status 2.
+ */
+struct ush_test {
+  const char *name;
+  char **args;
+  int argc;
+  int pos;
+  int failed;
+};
+
+/**
+   @brief Report an error in a test expression (only the first one).
+   @param t The evaluation.
+   @param arg Argument the error is about.
+   @param msg What is wrong.
+   @return 0, the value of a failed expression.
+ */
+int ush_test_error(struct ush_test *t, const char *arg, const char *msg)
+{
+  if(!t->failed){
+    fprintf(stderr, "ush: %s: %s%s%s\n", t->name, arg ? arg : "", arg ? ": " : "", msg);
+    t->failed = 1;
+  }
+  return 0;
+}
+
+/**
+   @brief Check for a unary operator (-n, -f...).
+   @param op The argument.
+   @return Nonzero if it is one.
+ */
+int ush_test_unary_op(const char *op)
+{
+  return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefghkLnprsStuwxz", op[1]) != NULL;
+}
+
+/**
+   @brief Check for a binary operator (=, -eq...).
+   @param op The argument.
+   @return Nonzero if it is one.
+ */
+int ush_test_binary_op(const char *op)
+{
+  static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef" };
+
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++){
+    if(strcmp(op, ops[i]) == 0){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Convert an operand of an integer comparison.
+   @param t The evaluation.
+   @param str The operand.
+   @param value Receives its value.
+   @return Nonzero on success.
+ */
+int ush_test_integer(struct ush_test *t, const char *str, long long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtoll(str, &end, 10);
+  while(*end == ' ' || *end == '\t'){
+    end++;
+  }
+  if(end == str || *end != '\0' || errno != 0){
+    return ush_test_error(t, str, "integer expression expected");
+  }
+  return 1;
+}
+
+/**
+   @brief Evaluate a unary primary.
+   @param t The evaluation.
+   @param op The operator.
+   @param arg Its operand.
+   @return Nonzero if true.
+ */
+int ush_test_unary(struct ush_test *t, const char *op, const char *arg)
+{
+  struct stat st;
+  long long fd;
+
+  switch(op[1]){
+  case 'n':
+    return arg[0] != '\0';
+  case 'z':
+    return arg[0] == '\0';
+  case 't':
+    return ush_test_integer(t, arg, &fd) && isatty(fd);
+  case 'r':
+    return access(arg, R_OK) == 0;
+  case 'w':
+    return access(arg, W_OK) == 0;
+  case 'x':
+    return access(arg, X_OK) == 0;
+  case 'h':
+  case 'L':
+    return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+  }
+  if(stat(arg, &st) != 0){
+    return 0;
+  }
+  switch(op[1]){
+  case 'b':
+    return S_ISBLK(st.st_mode);
+  case 'c':
+    return S_ISCHR(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'g':
+    return (st.st_mode & S_ISGID) != 0;
+  case 'k':
+    return (st.st_mode & S_ISVTX) != 0;
+  case 'p':
+    return S_ISFIFO(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'S':
+    return S_ISSOCK(st.st_mode);
+  case 'u':
+    return (st.st_mode & S_ISUID) != 0;
+  default:
+    //-e
+    return 1;
+  }
+}
+
+/**
+   @brief Evaluate a binary primary.
+   @param t The evaluation.
+   @param a Left operand.
+   @param op The operator.
+   @param b Right operand.
+   @return Nonzero if true.
+ */
+int ush_test_binary(struct ush_test *t, const char *a, const char *op, const char *b)
+{
+  struct stat sa, sb;
+  long long x, y;
+
+  if(op[0] != '-'){
+    int cmp = strcmp(a, b);
+
+    return (op[0] == '=') ? cmp == 0 : (op[0] == '!') ? cmp != 0 : (op[0] == '<') ? cmp < 0 : cmp > 0;
+  }
+  if(strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0){
+    int has_a = (stat(a, &sa) == 0);
+    int has_b = (stat(b, &sb) == 0);
+
+    if(op[1] == 'e'){
+      return has_a && has_b && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+    if(op[1] == 'o'){
+      //a -ot b is b -nt a.
+      struct stat tmp = sa;
+      int has_tmp = has_a;
+
+      sa = sb;
+      has_a = has_b;
+      sb = tmp;
+      has_b = has_tmp;
+    }
+    return has_a && (!has_b || sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+                     (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec));
+  }
+  if(!ush_test_integer(t, a, &x) || !ush_test_integer(t, b, &y)){
+    return 0;
+  }
+  switch(op[1] * 256 + op[2]){
+  case 'e' * 256 + 'q':
+    return x == y;
+  case 'n' * 256 + 'e':
+    return x != y;
+  case 'l' * 256 + 't':
+    return x < y;
+  case 'l' * 256 + 'e':
+    return x <= y;
+  case 'g' * 256 + 't':
+    return x > y;
+  default:
+    return x >= y;
+  }
+}
+
+int ush_test_or(struct ush_test *t);
+
+/**
+   @brief Evaluate a primary: ( expression ), a unary or binary primary, or
+   a string (true if not empty).
+   @param t The evaluation.
+   @return Nonzero if true.
+ */
+int ush_test_primary(struct ush_test *t)
+{
+  char **args = t->args + t->pos;
+  int left = t->argc - t->pos;
+  int value;
+
+  if(left == 0){
+    return ush_test_error(t, NULL, "argument expected");
+  }
+  if(strcmp(args[0], "(") == 0){
+    t->pos++;
+    value = ush_test_or(t);
+    if(t->pos == t->argc || strcmp(t->args[t->pos], ")") != 0){
+      return ush_test_error(t, NULL, "`)' expected");
+    }
+    t->pos++;
+    return value;
+  }
+  if(left >= 3 && ush_test_binary_op(args[1])){
+    t->pos += 3;
+    return ush_test_binary(t, args[0], args[1], args[2]);
+  }
+  if(left >= 2 && ush_test_unary_op(args[0])){
+    t->pos += 2;
+    return ush_test_unary(t, args[0], args[1]);
+  }
+  t->pos++;
+  return args[0][0] != '\0';
+}
+
+/**
+   @brief Evaluate a negation: ! expression, or a primary.
+   @param t The evaluation.
+   @return Nonzero if true.
+ */
+int ush_test_not(struct ush_test *t)
+{
+  if(t->pos < t->argc && strcmp(t->args[t->pos], "!") == 0){
+    t->pos++;
+    return !ush_test_not(t);
+  }
+  return ush_test_primary(t);
+}
+
+/**
+   @brief Evaluate expressions joined by -a.
+   @param t The evaluation.
+   @return Nonzero if true.
+ */
+int ush_test_and(struct ush_test *t)
+{
+  int value = ush_test_not(t);
+
+  while(t->pos < t->argc && strcmp(t->args[t->pos], "-a") == 0){
+    t->pos++;
+    value = ush_test_not(t) && value;
+  }
+  return value;
+}
+
+/**
+   @brief Evaluate expressions joined by -o.
+   @param t The evaluation.
+   @return Nonzero if true.
+ */
+int ush_test_or(struct ush_test *t)
+{
+  int value = ush_test_and(t);
+
+  while(t->pos < t->argc && strcmp(t->args[t->pos], "-o") == 0){
+    t->pos++;
+    value = ush_test_and(t) || value;
+  }
+  return value;
+}
+
+/**
+   @brief Evaluate a test expression.  Up to four arguments, their number
+   decides how they are read, as POSIX lays down (so "test -n" or
+   "[ = = = ]" mean what they should); longer expressions are parsed with
+   precedence ( ) over ! over -a over -o.
+   @param t The evaluation.
+   @param args The arguments.
+   @param argc Their number.
+   @return Nonzero if true.
+ */
+int ush_test_eval(struct ush_test *t, char **args, int argc)
+{
+  int value;
+
+  switch(argc){
+  case 0:
+    return 0;
+  case 1:
+    return args[0][0] != '\0';
+  case 2:
+    if(strcmp(args[0], "!") == 0){
+      return args[1][0] == '\0';
+    }
+    if(ush_test_unary_op(args[0])){
+      return ush_test_unary(t, args[0], args[1]);
+    }
+    return ush_test_error(t, args[0], "unary operator expected");
+  case 3:
+    if(ush_test_binary_op(args[1])){
+      return ush_test_binary(t, args[0], args[1], args[2]);
+    }
+    if(strcmp(args[1], "-a") == 0 || strcmp(args[1], "-o") == 0){
+      return (args[1][1] == 'a') ? (args[0][0] && args[2][0]) : (args[0][0] || args[2][0]);
+    }
+    if(strcmp(args[0], "!") == 0){
+      return !ush_test_eval(t, args + 1, 2);
+    }
+    if(strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0){
+      return args[1][0] != '\0';
+    }
+    return ush_test_error(t, args[1], "binary operator expected");
+  case 4:
+    if(strcmp(args[0], "!") == 0){
+      return !ush_test_eval(t, args + 1, 3);
+    }
+    if(strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0){
+      return ush_test_eval(t, args + 1, 2);
+    }
+    break;
+  }
+  t->args = args;
+  t->argc = argc;
+  t->pos = 0;
+  value = ush_test_or(t);
+  if(t->pos < t->argc){
+    ush_test_error(t, t->args[t->pos], "unexpected argument");
+  }
+  return value;
+}
+
+/**
+   @brief Builtin command: test and [.
+   @param args List of args.  args[0] is "test" or "[" (then the last one
+   must be "]").  The rest is the expression.
+   @return Always returns 1, to continue executing; the status is 0 if the
+   expression is true, 1 if false and 2 on an error.
+ */
+int ush_test(char **args)
+{
+  struct ush_test t;
+  int argc = 0;
+  int value;
+
+  while(args[argc] != NULL){
+    argc++;
+  }
+  memset(&t, 0, sizeof(t));
+  t.name = args[0];
+  if(strcmp(args[0], "[") == 0){
+    if(strcmp(args[argc - 1], "]") != 0){
+      fprintf(stderr, "ush: [: missing `]'\n");
+      ush_last_status = 2;
+      return 1;
+    }
+    argc--;
+  }
+  value = ush_test_eval(&t, args + 1, argc - 1);
+  ush_last_status = t.failed ? 2 : !value;
+  return 1;
+}
+
+/**
+ * Buffer printf builds its output in.
+ */
+char *printf_buf = NULL;
+size_t printf_buf_capacity = 0;
+
+/**
+   @brief Append formatted text to the printf output.
+   @param len Length of the output so far, updated.
+   @param fmt printf() format.
+ */
+void ush_printf_add(size_t *len, const char *fmt, ...)
+{
+  size_t room = printf_buf_capacity - *len;
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(printf_buf + *len, room, fmt, ap);
+  va_end(ap);
+  if(n < 0){
+    return;
+  }
+  if((size_t)n >= room){
+    printf_buf = ush_grow_array(printf_buf, &printf_buf_capacity, *len + n + 1, 1);
+    va_start(ap, fmt);
+    vsnprintf(printf_buf + *len, n + 1, fmt, ap);
+    va_end(ap);
+  }
+  *len += n;
+}
+
+/**
+   @brief Decode a backslash escape, as found in printf's format and %b
+   arguments: \\ \a \b \f \n \r \t \v, and an octal byte (\ddd in the format,
+   \0ddd in %b).
+   @param r Points after the backslash; moved past the escape.
+   @param arg Nonzero for a %b argument.
+   @return The byte, or -1 for a sequence that is not an escape; the
+   backslash then stands for itself.
+ */
+int ush_printf_escape(const char **r, int arg)
+{
+  static const char from[] = "\\abfnrtv";
+  static const char to[] = "\\\a\b\f\n\r\t\v";
+  const char *p = *r;
+  const char *c;
+  int value = 0;
+
+  if(*p >= '0' && *p <= '7'){
+    if(arg && *p == '0'){
+      p++;
+    }
+    for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; i++){
+      value = value * 8 + (*p++ - '0');
+    }
+    *r = p;
+    return value & 0xff;
+  }
+  if(*p != '\0' && (c = strchr(from, *p)) != NULL){
+    *r = p + 1;
+    return to[c - from];
+  }
+  return -1;
+}
+
+/**
+   @brief Convert a numeric argument of printf.  A leading quote stands for
+   the value of the character after it.
+   @param arg The argument.
+   @param value Receives the value.
+   @param fvalue Receives it as a floating point number, if not NULL.
+ */
+void ush_printf_number(const char *arg, intmax_t *value, double *fvalue)
+{
+  char *end;
+
+  errno = 0;
+  if(arg[0] == '\'' || arg[0] == '"'){
+    *value = (unsigned char)arg[1];
+    if(fvalue != NULL){
+      *fvalue = *value;
+    }
+    return;
+  }
+  if(fvalue != NULL){
+    *fvalue = strtod(arg, &end);
+    *value = 0;
+  }
+  else if(arg[0] == '-'){
+    *value = strtoimax(arg, &end, 0);
+  }
+  else{
+    *value = (intmax_t)strtoumax(arg, &end, 0);
+  }
+  if(*arg != '\0' && (end == arg || *end != '\0' || errno == ERANGE)){
+    fprintf(stderr, "ush: printf: %s: %s\n", arg, (errno == ERANGE) ? strerror(ERANGE) : "invalid number");
+    ush_last_status = 1;
+  }
+}
+
+/**
+   @brief Take the next argument of printf.
+   @param next The next argument, advanced unless they are all used.
+   @return The argument, or "" when there are no more.
+ */
+const char* ush_printf_arg(char ***next)
+{
+  return (**next != NULL) ? *(*next)++ : "";
+}
+
+/**
+   @brief Do one conversion of printf.
+   @param f Points at the '%'.
+   @param next Next argument to convert, advanced past the ones used.
+   @param len Length of the output so far, updated.
+   @param stop Set when the output must end: after \c in a %b argument, or
+   an invalid conversion.
+   @return Where the format goes on.
+ */
+const char* ush_printf_convert(const char *f, char ***next, size_t *len, int *stop)
+{
+  char spec[64];
+  size_t n = 1;
+  const char *arg;
+  intmax_t value;
+  double fvalue;
+
+  spec[0] = '%';
+  if(*++f == '%'){
+    ush_printf_add(len, "%%");
+    return f + 1;
+  }
+  //Flags, width and precision; a * takes the number from the arguments.
+  while(*f != '\0' && strchr("-+ #0", *f) != NULL && n < 8){
+    spec[n++] = *f++;
+  }
+  for (int part = 0; part < 2; part++){
+    if(part == 1){
+      if(*f != '.'){
+        break;
+      }
+      spec[n++] = *f++;
+    }
+    if(*f == '*'){
+      ush_printf_number(ush_printf_arg(next), &value, NULL);
+      f++;
+      if(part == 1 && value < 0){
+        //A negative precision is taken as none.
+        n--;
+        continue;
+      }
+    }
+    else if(*f >= '0' && *f <= '9'){
+      for (value = 0; *f >= '0' && *f <= '9'; f++){
+        if(value <= INT_MAX){
+          value = value * 10 + (*f - '0');
+        }
+      }
+    }
+    else{
+      continue;
+    }
+    if(value > INT_MAX || value < -INT_MAX){
+      fprintf(stderr, "ush: printf: %s too large\n", (part == 0) ? "field width" : "precision");
+      ush_last_status = 1;
+      *stop = 1;
+      return f;
+    }
+    n += snprintf(spec + n, 24, "%d", (int)value);
+  }
+
+  switch(*f){
+  case 'd':
+  case 'i':
+    ush_printf_number(ush_printf_arg(next), &value, NULL);
+    spec[n++] = 'j';
+    spec[n++] = *f;
+    spec[n] = '\0';
+    ush_printf_add(len, spec, value);
+    break;
+  case 'o':
+  case 'u':
+  case 'x':
+  case 'X':
+    ush_printf_number(ush_printf_arg(next), &value, NULL);
+    spec[n++] = 'j';
+    spec[n++] = *f;
+    spec[n] = '\0';
+    ush_printf_add(len, spec, (uintmax_t)value);
+    break;
+  case 'a':
+  case 'A':
+  case 'e':
+  case 'E':
+  case 'f':
+  case 'F':
+  case 'g':
+  case 'G':
+    ush_printf_number(ush_printf_arg(next), &value, &fvalue);
+    spec[n++] = *f;
+    spec[n] = '\0';
+    ush_printf_add(len, spec, fvalue);
+    break;
+  case 'c':
+    arg = ush_printf_arg(next);
+    spec[n++] = 'c';
+    spec[n] = '\0';
+    if(arg[0] != '\0'){
+      ush_printf_add(len, spec, arg[0]);
+    }
+    break;
+  case 's':
+    spec[n++] = 's';
+    spec[n] = '\0';
+    ush_printf_add(len, spec, ush_printf_arg(next));
+    break;
+  case 'b':{
+    //The argument's escapes are expanded, \c ending the output.
+    const char *r = ush_printf_arg(next);
+    char *out = ush_arena_alloc(&cmd_arena, strlen(r) + 1);
+    size_t out_len = 0;
+
+    while(*r != '\0'){
+      int c;
+
+      if(*r != '\\'){
+        out[out_len++] = *r++;
+        continue;
+      }
+      if(*++r == 'c'){
+        *stop = 1;
+        break;
+      }
+      c = ush_printf_escape(&r, 1);
+      out[out_len++] = (c < 0) ? '\\' : c;
+    }
+    out[out_len] = '\0';
+    spec[n++] = 's';
+    spec[n] = '\0';
+    ush_printf_add(len, spec, out);
+    break;
+  }
+  default:
+    if(*f != '\0'){
+      fprintf(stderr, "ush: printf: %c: invalid directive\n", *f);
+    }
+    else{
+      fprintf(stderr, "ush: printf: missing format character\n");
+    }
+    ush_last_status = 1;
+    *stop = 1;
+    return f;
+  }
+  return f + 1;
+}
+
+/**
+   @brief Builtin command: printf.
+   @param args List of args.  args[0] is "printf", args[1] the format, the
+   rest the arguments it converts.  The format is used again as long as some
+   are left; missing ones count as empty strings (or zero).
+   @return Always returns 1, to continue executing.
+ */
+int ush_printf(char **args)
+{
+  char **next = args + 2;
+  char **first;
+  size_t len = 0;
+  int stop = 0;
+
+  if(args[1] == NULL){
+    fprintf(stderr, "ush: printf: usage: printf format [arguments]\n");
+    ush_last_status = 2;
+    return 1;
+  }
+  printf_buf = ush_grow_array(printf_buf, &printf_buf_capacity, 1, 1);
+  do{
+    first = next;
+    for (const char *f = args[1]; *f != '\0' && !stop; ){
+      if(*f == '\\'){
+        int c;
+
+        f++;
+        c = ush_printf_escape(&f, 0);
+        ush_printf_add(&len, "%c", (c < 0) ? '\\' : c);
+      }
+      else if(*f == '%'){
+        f = ush_printf_convert(f, &next, &len, &stop);
+      }
+      else{
+        size_t run = strcspn(f, "\\%");
+
+        ush_printf_add(&len, "%.*s", (int)run, f);
+        f += run;
+      }
+    }
+  } while(!stop && *next != NULL && next != first);
+  //Valid until the output is flushed, right after the builtin returns.
+  ush_out_str(printf_buf, len);
+  return 1;
+}
+
+/**
+ * Buffer the read builtin reads a line into.
+ */
+char *read_buf = NULL;
+size_t read_buf_capacity = 0;
+
+#define USH_READ_BLOCK 512
+
+/**
+   @brief Read a line from the shell's stdin for the read builtin, without
+   taking anything after it.  A seekable input is read in blocks and moved
+   back to just after the newline; anything else (a pipe, a terminal) has to
+   be read a byte at a time.
+   @param len Length of what read_buf already holds; the line is appended,
+   and len updated to leave out its newline.
+   @return 1 if a newline ended the line, 0 at end of input, -1 on error.
+ */
+int ush_read_input(size_t *len)
+{
+  int seekable = (lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0);
+
+  for (;;){
+    size_t want = seekable ? USH_READ_BLOCK : 1;
+    char *newline;
+    ssize_t n;
+
+    read_buf = ush_grow_array(read_buf, &read_buf_capacity, *len + want + 1, 1);
+    n = read(STDIN_FILENO, read_buf + *len, want);
+    //Ctrl-C ends the read.
+    if(n < 0 && errno == EINTR && !ush_interrupted){
+      continue;
+    }
+    if(n <= 0){
+      read_buf[*len] = '\0';
+      return (n < 0) ? -1 : 0;
+    }
+    if((newline = memchr(read_buf + *len, '\n', n)) != NULL){
+      if(seekable){
+        lseek(STDIN_FILENO, newline + 1 - (read_buf + *len + n), SEEK_CUR);
+      }
+      *len = newline - read_buf;
+      read_buf[*len] = '\0';
+      return 1;
+    }
+    *len += n;
+  }
+}
+
+/**
+   @brief Check whether a character is IFS white space.
+   @param ifs The value of IFS.
+   @param c The character.
+   @return Nonzero if it is.
+ */
+int ush_ifs_space(const char *ifs, char c)
+{
+  return c != '\0' && strchr(ifs, c) != NULL && (c == ' ' || c == '\t' || c == '\n');
+}
+
+/**
+   @brief Builtin command: read a line into variables.
+   @param args List of args.  args[0] is "read".  With -r backslashes are
+   kept; otherwise a backslash quotes the next character and one at the end
+   of the line continues it on the next.  The rest are the variable names
+   (REPLY if there are none): the line is split into fields at $IFS (default
+   space, tab and newline), one per name, the last one getting the rest.
+   @return Always returns 1, to continue executing; the status is 1 at end
+   of input.
+ */
+int ush_read(char **args)
+{
+  static char *reply[] = { "REPLY", NULL };
+  const char *ifs = ush_var_get("IFS");
+  char **names;
+  char *field;
+  const char *r;
+  size_t len = 0;
+  int raw = 0;
+  int ret;
+  int i;
+
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++){
+    if(strcmp(args[i], "--") == 0){
+      i++;
+      break;
+    }
+    if(strcmp(args[i], "-r") != 0){
+      fprintf(stderr, "ush: read: usage: read [-r] [name...]\n");
+      ush_last_status = 2;
+      return 1;
+    }
+    raw = 1;
+  }
+  names = (args[i] != NULL) ? args + i : reply;
+  for (i = 0; names[i] != NULL; i++){
+    if(ush_var_name_len(names[i]) != strlen(names[i])){
+      fprintf(stderr, "ush: read: `%s': not a valid identifier\n", names[i]);
+      ush_last_status = 1;
+      return 1;
+    }
+  }
+  if(ifs == NULL){
+    ifs = " \t\n";
+  }
+
+  for (;;){
+    size_t backslashes = 0;
+
+    ret = ush_read_input(&len);
+    while(backslashes < len && read_buf[len - 1 - backslashes] == '\\'){
+      backslashes++;
+    }
+    if(raw || ret != 1 || backslashes % 2 == 0){
+      break;
+    }
+    //An escaped newline: the line goes on.
+    len--;
+  }
+  if(ret < 0 && ush_interrupted){
+    ush_last_status = 130;
+    return 1;
+  }
+  if(ret < 0){
+    fprintf(stderr, "ush: read: %s\n", strerror(errno));
+    ush_last_status = 1;
+    return 1;
+  }
+
+  field = ush_arena_alloc(&cmd_arena, len + 1);
+  r = read_buf;
+  while(ush_ifs_space(ifs, *r)){
+    r++;
+  }
+  for (i = 0; names[i] != NULL; i++){
+    int last = (names[i + 1] == NULL);
+    size_t field_len = 0;
+    size_t keep = 0;
+
+    while(*r != '\0'){
+      if(!raw && *r == '\\' && r[1] != '\0'){
+        field[field_len++] = r[1];
+        r += 2;
+        keep = field_len;
+        continue;
+      }
+      if(strchr(ifs, *r) != NULL){
+        if(!last){
+          break;
+        }
+        //The last field takes the rest, less trailing IFS white space.
+        if(!ush_ifs_space(ifs, *r)){
+          keep = field_len + 1;
+        }
+        field[field_len++] = *r++;
+        continue;
+      }
+      field[field_len++] = *r++;
+      keep = field_len;
+    }
+    field[last ? keep : field_len] = '\0';
+    ush_var_set(names[i], field);
+
+    //Past the delimiter: white space around at most one other IFS character.
+    while(ush_ifs_space(ifs, *r)){
+      r++;
+    }
+    if(*r != '\0' && strchr(ifs, *r) != NULL && !ush_ifs_space(ifs, *r)){
+      for (r++; ush_ifs_space(ifs, *r); r++)
+        ;
+    }
+  }
+  ush_last_status = (ret == 1) ? 0 : 1;
+  return 1;
+}
+
+/**
+ * Logical working directory, kept by the shell itself: cd resolves "." and
+ * ".." against it textually (symlinks are not followed back out), and pwd
+ * just copies it out instead of walking up the tree with getcwd().  $PWD and
+ * $OLDPWD are kept in step.
+ */
+char *cwd_path = NULL;
+size_t cwd_len = 0;
+size_t cwd_capacity = 0;
+char *cwd_scratch = NULL;
+size_t cwd_scratch_capacity = 0;
+
+/**
+   @brief Resolve a directory against the logical working directory.
+   @param dir Directory, absolute or relative; dir_len bytes are used.
+   @param dir_len Length of dir.
+   @param len Receives the length of the result.
+   @return Canonical absolute path (no ".", ".." or repeated '/'), in a
+   buffer reused by the next call.
+ */
+char* ush_cwd_resolve(const char *dir, size_t dir_len, size_t *len)
+{
+  size_t n = 0;
+  size_t needed = cwd_len + dir_len + 3;
+  const char *p = dir;
+  const char *end = dir + dir_len;
+
+  cwd_scratch = ush_grow_array(cwd_scratch, &cwd_scratch_capacity, needed, 1);
+  if(dir_len == 0 || dir[0] != '/'){
+    memcpy(cwd_scratch, cwd_path, cwd_len);
+    n = cwd_len;
+  }
+  while(p < end){
+    const char *slash = memchr(p, '/', end - p);
+    size_t part = (slash != NULL ? slash : end) - p;
+
+    if(part == 0 || (part == 1 && p[0] == '.')){
+      //Nothing to add.
+    }
+    else if(part == 2 && p[0] == '.' && p[1] == '.'){
+      while(n > 0 && cwd_scratch[--n] != '/')
+        ;
+    }
+    else{
+      cwd_scratch[n++] = '/';
+      memcpy(cwd_scratch + n, p, part);
+      n += part;
+    }
+    p += part + 1;
+  }
+  if(n == 0){
+    cwd_scratch[n++] = '/';
+  }
+  cwd_scratch[n] = '\0';
+  *len = n;
+  return cwd_scratch;
+}
+
+/**
+   @brief Make path the logical working directory and $PWD.
+   @param path Canonical absolute path.
+   @param len Its length.
+ */
+void ush_cwd_store(const char *path, size_t len)
+{
+  cwd_path = ush_grow_array(cwd_path, &cwd_capacity, len + 1, 1);
+  memmove(cwd_path, path, len);
+  cwd_path[len] = '\0';
+  cwd_len = len;
+  ush_var_set_exported(ush_var_set("PWD", cwd_path), 1);
+}
+
+/**
+   @brief Set up the logical working directory at startup: an inherited
+   $PWD is kept if it names the current directory, otherwise getcwd() is used.
+ */
+void ush_cwd_init()
+{
+  const char *pwd = ush_var_get("PWD");
+  struct stat dot, st;
+  char buf[PATH_MAX];
+  size_t len;
+
+  if(pwd != NULL && pwd[0] == '/' && stat(pwd, &st) == 0 && stat(".", &dot) == 0
+     && st.st_dev == dot.st_dev && st.st_ino == dot.st_ino){
+    pwd = ush_cwd_resolve(pwd, strlen(pwd), &len);
+  }
+  else if((pwd = getcwd(buf, sizeof(buf))) != NULL){
+    len = strlen(pwd);
+  }
+  else{
+    //Removed directory or path too long; "cd" still works from "/".
+    pwd = "/";
+    len = 1;
+  }
+  ush_cwd_store(pwd, len);
+}
+
+/**
+   @brief Change to a directory given the way cd got it.
+   @param dir Argument of cd.
+   @param shown Set when the new directory should be printed (CDPATH match).
+   @return 0 on success, -1 with errno set.
+ */
+int ush_cwd_change(const char *dir, int *shown)
+{
+  const char *cdpath = ush_var_get("CDPATH");
+  size_t dir_len = strlen(dir);
+  size_t len;
+  char *path;
+
+  *shown = 0;
+  //CDPATH applies to names not starting with "/", "." or "..".
+  if(cdpath != NULL && dir[0] != '/'
+     && !(dir[0] == '.' && (dir[1] == '\0' || dir[1] == '/'
+                            || (dir[1] == '.' && (dir[2] == '\0' || dir[2] == '/'))))){
+    for (const char *p = cdpath; ; ){
+      const char *colon = strchrnul(p, ':');
+      size_t prefix = colon - p;
+      char *cand = ush_arena_alloc(&cmd_arena, prefix + dir_len + 2);
+
+      if(prefix > 0){
+        memcpy(cand, p, prefix);
+        cand[prefix] = '/';
+        memcpy(cand + prefix + 1, dir, dir_len + 1);
+        path = ush_cwd_resolve(cand, prefix + 1 + dir_len, &len);
+        if(chdir(path) == 0){
+          *shown = 1;
+          ush_cwd_store(path, len);
+          return 0;
+        }
+      }
+      if(*colon == '\0'){
+        break;
+      }
+      p = colon + 1;
+    }
+  }
+  path = ush_cwd_resolve(dir, dir_len, &len);
+  if(chdir(path) != 0){
+    return -1;
+  }
+  ush_cwd_store(path, len);
+  return 0;
+}
+
+/**
+   @brief Builtin command: change directory.
+   @param args List of args.  args[0] is "cd".  args[1] is the directory:
+   $HOME if left out, $OLDPWD for "-"; relative names are also looked for
+   in the directories of $CDPATH.
+   @return Always returns 1, to continue executing.
+ */
+int ush_cd(char **args)
+{
+  const char *dir = args[1];
+  char *old;
+  int dash = 0;
+  int shown;
+
+  if(dir == NULL && (dir = ush_var_get("HOME")) == NULL){
+    fprintf(stderr, "ush: cd: HOME not set\n");
+    ush_last_status = 1;
+    return 1;
+  }
+  if(strcmp(dir, "-") == 0){
+    if((dir = ush_var_get("OLDPWD")) == NULL){
+      fprintf(stderr, "ush: cd: OLDPWD not set\n");
+      ush_last_status = 1;
+      return 1;
+    }
+    //Copied, as setting OLDPWD below replaces the value.
+    dir = ush_arena_strndup(&cmd_arena, dir, strlen(dir));
+    dash = 1;
+  }
+  old = ush_arena_strndup(&cmd_arena, cwd_path, cwd_len);
+  if(ush_cwd_change(dir, &shown) != 0){
+    fprintf(stderr, "ush: cd: %s: %s\n", dir, strerror(errno));
+    ush_last_status = 1;
+    return 1;
+  }
+  ush_var_set_exported(ush_var_set("OLDPWD", old), 1);
+  if(shown || dash){
+    ush_out_str(cwd_path, cwd_len);
+    ush_out_str("\n", 1);
+  }
+  return 1;
+}
+
+/**
+   @brief Builtin command: current directory.
+   @param args List of args.  args[0] is "pwd".  "-P" prints the physical
+   directory (symlinks resolved) instead of the logical one.
+   @return Always returns 1, to continue executing.
+ */
+int ush_pwd(char **args)
+{
+  if(args[1] != NULL && strcmp(args[1], "-P") == 0){
+    char buf[PATH_MAX];
+
+    if(getcwd(buf, sizeof(buf)) == NULL){
+      perror("ush: pwd");
+      ush_last_status = 1;
+      return 1;
+    }
+    ush_out_puts(buf);
+  }
+  else{
+    ush_out_str(cwd_path, cwd_len);
+  }
+  ush_out_str("\n", 1);
+  return 1;
+}
+
+/**
+ * Persistent history: $USH_HISTFILE, or ~/.ush_history (an empty
+ * USH_HISTFILE turns it off).  Every command is appended with a single
+ * write(), so concurrent shells interleave whole lines.  At startup the file
+ * is mapped rather than read and only its tail is scanned to fill the ring;
+ * the index of line offsets used by searches is built on the first search and
+ * extended as the file grows.  The line editor steps through the file from
+ * its end instead, one line at a time from where it last was (cursor_back,
+ * cursor_start), so browsing never indexes it.  The file keeps the last $USH_HISTFILESIZE lines
+ * (default USH_HISTFILE_DEFAULT_SIZE), counting USH_HISTFILE_LINE_BYTES per
+ * line: whether it is due to be cut back is told at startup from its size
+ * alone, once it is a quarter over, so startup only ever scans the lines the
+ * ring is filled with.  Cutting it back touches only the kept tail.
+ */
+#define USH_HISTFILE_DEFAULT_SIZE 10000
+#define USH_HISTFILE_LINE_BYTES 64
+
+struct ush_histfile {
+  int fd;
+  char *map;
+  size_t map_size;
+  size_t *offsets;
+  size_t num_lines;
+  size_t offsets_capacity;
+  size_t indexed;
+  size_t cursor_back;
+  size_t cursor_start;
+};
+
+struct ush_histfile histfile = { -1, NULL, 0, NULL, 0, 0, 0, 0, 0 };
+
+/**
+   @brief Find where the last lines of a buffer start.
+   @param buf The buffer of newline terminated lines.
+   @param size Size of the buffer.
+   @param count Number of lines wanted.
+   @param found Receives the number of lines found (at most count).
+   @return Offset of the first of those lines.
+ */
+size_t ush_history_tail(const char *buf, size_t size, size_t count, size_t *found)
+{
+  size_t pos = size;
+
+  *found = 0;
+  //Skip the newline ending the last line, then stop at the one before each line.
+  if(pos > 0 && buf[pos - 1] == '\n'){
+    pos--;
+  }
+  while(pos > 0 && *found < count){
+    const char *nl = memrchr(buf, '\n', pos);
+
+    (*found)++;
+    if(nl == NULL){
+      return 0;
+    }
+    pos = nl - buf;
+    if(*found == count){
+      return pos + 1;
+    }
+  }
+  return pos;
+}
+
+/**
+   @brief Map the history file, or map it again after it has grown.
+   @return 0 on success, -1 if the file cannot be mapped.
+ */
+int ush_histfile_map()
+{
+  struct stat sb;
+  char *map;
+
+  if(fstat(histfile.fd, &sb) != 0){
+    return -1;
+  }
+  if((size_t)sb.st_size == histfile.map_size){
+    return 0;
+  }
+  histfile.cursor_back = 0;
+  if(histfile.map != NULL){
+    munmap(histfile.map, histfile.map_size);
+    histfile.map = NULL;
+    histfile.map_size = 0;
+  }
+  if(sb.st_size == 0){
+    histfile.indexed = histfile.num_lines = 0;
+    return 0;
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, histfile.fd, 0);
+  if(map == MAP_FAILED){
+    return -1;
+  }
+  if((size_t)sb.st_size < histfile.indexed){
+    //Cut back by another shell: index it again.
+    histfile.indexed = histfile.num_lines = 0;
+  }
+  histfile.map = map;
+  histfile.map_size = sb.st_size;
+  return 0;
+}
+
+/**
+   @brief Keep only the last lines of the history file.
+   The tail is written to a new file that replaces the old one.
+   @param path The history file.
+   @param start Offset of the first line kept.
+   @return 0 on success, -1 on failure.
+ */
+int ush_histfile_trim(const char *path, size_t start)
+{
+  size_t len = strlen(path);
+  char *tmp = ush_malloc(len + 5);
+  int fd;
+  int ret = -1;
+
+  memcpy(tmp, path, len);
+  memcpy(tmp + len, ".new", 5);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd >= 0){
+    if(ush_write_all(fd, histfile.map + start, histfile.map_size - start) == 0 && close(fd) == 0){
+      ret = rename(tmp, path);
+    }
+    else{
+      close(fd);
+    }
+    if(ret != 0){
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+  return ret;
+}
+
+/**
+   @brief Open the history file and load its last lines into the ring.
+ */
+void ush_histfile_open()
+{
+  const char *name = ush_var_get("USH_HISTFILE");
+  const char *limit = ush_var_get("USH_HISTFILESIZE");
+  size_t max_lines = (limit != NULL && atol(limit) > 0) ? (size_t)atol(limit) : USH_HISTFILE_DEFAULT_SIZE;
+  size_t max_bytes = max_lines * USH_HISTFILE_LINE_BYTES;
+  char *path;
+  size_t start, found;
+
+  if(name != NULL){
+    if(*name == '\0'){
+      return;
+    }
+    path = ush_strdup(name);
+  }
+  else{
+    const char *home = ush_var_get("HOME");
+    size_t len;
+
+    if(home == NULL){
+      return;
+    }
+    len = strlen(home);
+    path = ush_malloc(len + sizeof("/.ush_history"));
+    memcpy(path, home, len);
+    memcpy(path + len, "/.ush_history", sizeof("/.ush_history"));
+  }
+
+  histfile.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if(histfile.fd < 0 || ush_histfile_map() != 0){
+    fprintf(stderr, "ush: %s: %s\n", path, strerror(errno));
+    if(histfile.fd >= 0){
+      close(histfile.fd);
+      histfile.fd = -1;
+    }
+    free(path);
+    return;
+  }
+
+  if(histfile.map_size > max_bytes + max_bytes / 4){
+    //The last max_lines lines, as far as they fit in max_bytes.
+    size_t skip = histfile.map_size - max_bytes;
+
+    start = skip + ush_history_tail(histfile.map + skip, max_bytes, max_lines, &found);
+    if(start == skip && histfile.map[skip - 1] != '\n'){
+      //Do not keep the end of a line cut in two.
+      const char *nl = memchr(histfile.map + skip, '\n', max_bytes);
+
+      start = (nl != NULL) ? (size_t)(nl - histfile.map) + 1 : histfile.map_size;
+    }
+    if(ush_histfile_trim(path, start) == 0){
+      int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+
+      if(fd >= 0){
+        close(histfile.fd);
+        histfile.fd = fd;
+        ush_histfile_map();
+      }
+    }
+  }
+  free(path);
+
+  start = ush_history_tail(histfile.map, histfile.map_size, history_size, &found);
+  while(start < histfile.map_size){
+    const char *nl = memchr(histfile.map + start, '\n', histfile.map_size - start);
+    size_t len = (nl != NULL) ? (size_t)(nl - histfile.map) - start : histfile.map_size - start;
+
+    ush_history_store(histfile.map + start, len);
+    start += len + 1;
+  }
+}
+
+/**
+   @brief Append a line stored by ush_history_store() to the history file.
+   @param slot The slot holding the line.
+   @param len Length of the line.
+ */
+void ush_histfile_append(struct ush_history_slot *slot, size_t len)
+{
+  if(histfile.fd < 0){
+    return;
+  }
+  slot->line[len] = '\n';
+  if(write(histfile.fd, slot->line, len + 1) != (ssize_t)(len + 1)){
+    perror("ush: history");
+  }
+  slot->line[len] = '\0';
+}
+
+/**
+   @brief Index the lines of the history file that have not been indexed yet.
+ */
+void ush_histfile_index()
+{
+  if(ush_histfile_map() != 0){
+    return;
+  }
+  while(histfile.indexed < histfile.map_size){
+    const char *nl = memchr(histfile.map + histfile.indexed, '\n', histfile.map_size - histfile.indexed);
+
+    if(nl == NULL){
+      //A line still being written by another shell.
+      break;
+    }
+    histfile.offsets = ush_grow_array(histfile.offsets, &histfile.offsets_capacity, histfile.num_lines + 1, sizeof(size_t));
+    histfile.offsets[histfile.num_lines++] = histfile.indexed;
+    histfile.indexed = nl - histfile.map + 1;
+  }
+}
+
+/**
+   @brief Check whether a history line matches a search pattern.
+   @param line The line (not NUL terminated).
+   @param len Length of the line.
+   @param pattern The pattern; a leading '^' anchors it to the start of the line.
+   @return Nonzero on a match.
+ */
+int ush_history_match(const char *line, size_t len, const char *pattern)
+{
+  if(*pattern == '^'){
+    size_t plen = strlen(pattern + 1);
+    return plen <= len && memcmp(line, pattern + 1, plen) == 0;
+  }
+  return memmem(line, len, pattern, strlen(pattern)) != NULL;
+}
+
+/**
+   @brief Add a numbered line to the builtin output.
+   @param num Number of the line.
+   @param line The line (not NUL terminated); it must stay valid until the output is flushed.
+   @param len Length of the line.
+ */
+void ush_history_out(size_t num, const char *line, size_t len)
+{
+  ush_out_printf("%5zu  ", num);
+  ush_out_str(line, len);
+  ush_out_str("\n", 1);
+}
+
+/**
+   @brief Print the history lines matching a pattern, oldest first.
+   Searches the history file when there is one, else this session's ring.
+   @param pattern The pattern (see ush_history_match()).
+ */
+void ush_history_search(const char *pattern)
+{
+  if(histfile.fd >= 0){
+    ush_histfile_index();
+    for (size_t i = 0; i < histfile.num_lines; i++){
+      const char *line = histfile.map + histfile.offsets[i];
+      size_t end = (i + 1 < histfile.num_lines) ? histfile.offsets[i + 1] : histfile.indexed;
+
+      if(ush_history_match(line, end - histfile.offsets[i] - 1, pattern)){
+        ush_history_out(i + 1, line, end - histfile.offsets[i] - 1);
+      }
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < history_filled; i++){
+    struct ush_history_slot *slot = &history_str[(history_pos + history_size - history_filled + i) % history_size];
+    size_t len = strlen(slot->line);
+
+    if(ush_history_match(slot->line, len, pattern)){
+      ush_history_out(history_count - history_filled + i + 1, slot->line, len);
+    }
+  }
+}
+
+/**
+   @brief Get a line back from the history, counting from the latest one.
+   Comes from the history file when there is one, as last mapped by
+   ush_histfile_map(), else this session's ring.
+   @param back 1 for the latest line, 2 for the one before...
+   @param len Receives the length of the line.
+   @return The line (not NUL terminated), or NULL if the history is shorter.
+ */
+const char* ush_history_back(size_t back, size_t *len)
+{
+  if(histfile.fd >= 0){
+    const char *nl;
+
+    if(back == 0 || histfile.map == NULL){
+      return NULL;
+    }
+    if(histfile.cursor_back == 0){
+      //Before the latest line: a line still being written by another shell is left out.
+      nl = memrchr(histfile.map, '\n', histfile.map_size);
+      histfile.cursor_start = (nl != NULL) ? (size_t)(nl - histfile.map) + 1 : 0;
+    }
+    while(histfile.cursor_back < back){
+      if(histfile.cursor_start == 0){
+        return NULL;
+      }
+      nl = memrchr(histfile.map, '\n', histfile.cursor_start - 1);
+      histfile.cursor_start = (nl != NULL) ? (size_t)(nl - histfile.map) + 1 : 0;
+      histfile.cursor_back++;
+    }
+    while(histfile.cursor_back > back){
+      nl = memchr(histfile.map + histfile.cursor_start, '\n', histfile.map_size - histfile.cursor_start);
+      histfile.cursor_start = nl - histfile.map + 1;
+      histfile.cursor_back--;
+    }
+    nl = memchr(histfile.map + histfile.cursor_start, '\n', histfile.map_size - histfile.cursor_start);
+    *len = nl - histfile.map - histfile.cursor_start;
+    return histfile.map + histfile.cursor_start;
+  }
+  if(back == 0 || back > history_filled){
+    return NULL;
+  }
+  *len = strlen(history_str[(history_pos + history_size - back) % history_size].line);
+  return history_str[(history_pos + history_size - back) % history_size].line;
+}
+
+/**
+   @brief Builtin command: shows a list of the commands entered since the start of session..
+   "history N" shows the last N only; "history -s pattern" shows the saved
+   commands containing pattern instead.
+   @param args List of args.  args[0] is "history".
+   @return Always returns 1, to continue executing.
+ */
+int ush_history(char **args)
+{
+  size_t count = history_filled;
+
+  if(args[1] != NULL && strcmp(args[1], "-s") == 0){
+    if(args[2] == NULL){
+      fprintf(stderr, "ush: history: -s: pattern expected\n");
+      ush_last_status = 2;
+      return 1;
+    }
+    ush_history_search(args[2]);
+    return 1;
+  }
+  if(args[1] != NULL){
+    char *end;
+    long n = strtol(args[1], &end, 10);
+
+    if(*end != '\0' || end == args[1] || n < 0){
+      fprintf(stderr, "ush: history: %s: numeric argument required\n", args[1]);
+      ush_last_status = 2;
+      return 1;
+    }
+    if((size_t)n < count){
+      count = n;
+    }
+  }
+
+  for (size_t i = history_filled - count; i < history_filled; i++){
+    struct ush_history_slot *slot = &history_str[(history_pos + history_size - history_filled + i) % history_size];
+
+    ush_history_out(history_count - history_filled + i + 1, slot->line, strlen(slot->line));
+  }
+  return 1;
+}
+
+/**
+ * Command location cache (the "hash" builtin).
+ * Maps a command name to the absolute path found on $PATH, so each external
+ * command is searched for once instead of execvp() trying every directory.
+ */
+#define USH_HASH_BUCKETS 256
+
+struct ush_hash_entry {
+  char *name;
+  char *path;
+  unsigned long hits;
+  struct ush_hash_entry *next;
+};
+
+struct ush_hash_entry *hash_table[USH_HASH_BUCKETS];
+char *hash_path_value = NULL;
+
+/**
+   @brief Remove every entry from the command location cache.
+ */
+void ush_hash_clear()
+{
+  for (size_t i = 0; i < USH_HASH_BUCKETS; i++){
+    struct ush_hash_entry *entry = hash_table[i];
+
+    while(entry != NULL){
+      struct ush_hash_entry *next = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      entry = next;
+    }
+    hash_table[i] = NULL;
+  }
+}
+
+/**
+   @brief Find the cache slot holding a command name.
+   @param name Command name.
+   @return Pointer to the link pointing at the entry (or at NULL if absent).
+ */
+struct ush_hash_entry** ush_hash_slot(const char *name)
+{
+  struct ush_hash_entry **link = &hash_table[ush_strhash(name) % USH_HASH_BUCKETS];
+
+  while(*link != NULL && strcmp((*link)->name, name) != 0){
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/**
+   @brief Set the cached location of a command, replacing any previous one.
+   @param name Command name.
+   @param path Absolute path of the program.
+   @return The cache entry.
+ */
+struct ush_hash_entry* ush_hash_set(const char *name, const char *path)
+{
+  struct ush_hash_entry **link = ush_hash_slot(name);
+  struct ush_hash_entry *entry = *link;
+
+  if(entry == NULL){
+    entry = (struct ush_hash_entry*)ush_malloc(sizeof(struct ush_hash_entry));
+    entry->name = ush_strdup(name);
+    entry->next = NULL;
+    *link = entry;
+  }
+  else{
+    free(entry->path);
+  }
+  entry->path = ush_strdup(path);
+  entry->hits = 0;
+  return entry;
+}
+
+/**
+   @brief Drop a single command from the cache.
+   @param name Command name.
+ */
+void ush_hash_forget(const char *name)
+{
+  struct ush_hash_entry **link = ush_hash_slot(name);
+  struct ush_hash_entry *entry = *link;
+
+  if(entry != NULL){
+    *link = entry->next;
+    free(entry->name);
+    free(entry->path);
+    free(entry);
+  }
+}
+
+/**
+   @brief Search the directories of $PATH for an executable.
+   @param name Command name (without any '/').
+   @param buf Buffer receiving the full path.
+   @param size Size of buf.
+   @return 1 if found, 0 otherwise.
+ */
+int ush_path_search(const char *name, char *buf, size_t size)
+{
+  const char *path = ush_var_get("PATH");
+  const char *dir;
+  const char *end;
+  size_t name_len = strlen(name);
+
+  if(path == NULL){
+    path = "/bin:/usr/bin";
+  }
+  for (dir = path; ; dir = end + 1){
+    const char *prefix = dir;
+    size_t dir_len;
+
+    end = strchrnul(dir, ':');
+    dir_len = end - dir;
+
+    //An empty PATH element stands for the current directory.
+    if(dir_len == 0){
+      prefix = ".";
+      dir_len = 1;
+    }
+    if(dir_len + name_len + 2 <= size){
+      struct stat sb;
+
+      memcpy(buf, prefix, dir_len);
+      buf[dir_len] = '/';
+      memcpy(buf + dir_len + 1, name, name_len + 1);
+      if(access(buf, X_OK) == 0 && stat(buf, &sb) == 0 && S_ISREG(sb.st_mode)){
+        return 1;
+      }
+    }
+    if(*end == '\0'){
+      return 0;
+    }
+  }
+}
+
+/**
+   @brief Empty the cache if $PATH is not what it was when it was filled.
+   @param path The value of $PATH ("" when unset).
+ */
+void ush_hash_check_path(const char *path)
+{
+  if(hash_path_value == NULL || strcmp(hash_path_value, path) != 0){
+    ush_hash_clear();
+    free(hash_path_value);
+    hash_path_value = ush_strdup(path);
+  }
+}
+
+//Drops the commands that changed on $PATH since the last call.
+void ush_path_index_events();
+
+/**
+   @brief Resolve a command name to the program that should be executed.
+   Names containing a '/' are used as given; everything else is looked up in
+   the cache, which is emptied whenever $PATH changes.
+   @param name Command name (args[0]).
+   @return Path to execute, or NULL if the command was not found.
+ */
+const char* ush_find_command(const char *name)
+{
+  const char *path = ush_var_get("PATH");
+  struct ush_hash_entry *entry;
+  char buf[4096];
+
+  if(strchr(name, '/') != NULL){
+    return name;
+  }
+  if(path == NULL){
+    path = "";
+  }
+  ush_hash_check_path(path);
+  ush_path_index_events();
+
+  entry = *ush_hash_slot(name);
+  if(entry == NULL){
+    if(!ush_path_search(name, buf, sizeof(buf))){
+      return NULL;
+    }
+    entry = ush_hash_set(name, buf);
+  }
+  entry->hits++;
+  return entry->path;
+}
+
+/**
+   @brief Builtin command: inspect or change the command location cache.
+   @param args List of args.  args[0] is "hash".  "-r" clears the cache,
+   "-p path name" sets an entry, other arguments are looked up and remembered.
+   With no arguments the cache is listed.
+   @return Always returns 1, to continue executing.
+ */
+int ush_hash(char **args)
+{
+  if(args[1] == NULL){
+    int empty = 1;
+
+    for (size_t i = 0; i < USH_HASH_BUCKETS; i++){
+      for (struct ush_hash_entry *entry = hash_table[i]; entry != NULL; entry = entry->next){
+        if(empty){
+          ush_out_puts("hits\tcommand\n");
+          empty = 0;
+        }
+        ush_out_printf("%4lu\t%s\n", entry->hits, entry->path);
+      }
+    }
+    if(empty){
+      ush_out_puts("hash: hash table empty\n");
+    }
+    return 1;
+  }
+
+  if(strcmp(args[1], "-r") == 0){
+    ush_hash_clear();
+    return 1;
+  }
+
+  if(strcmp(args[1], "-p") == 0){
+    if(args[2] == NULL || args[3] == NULL){
+      fprintf(stderr, "ush: usage: hash -p path name\n");
+      ush_last_status = 2;
+      return 1;
+    }
+    //Make sure the cache agrees with the current $PATH before adding to it.
+    const char *path = ush_var_get("PATH");
+
+    ush_hash_check_path((path != NULL) ? path : "");
+    ush_hash_set(args[3], args[2]);
+    return 1;
+  }
+
+  for (int i = 1; args[i] != NULL; i++){
+    if(ush_find_command(args[i]) == NULL){
+      fprintf(stderr, "ush: hash: %s: not found\n", args[i]);
+      ush_last_status = 1;
+    }
+    else if(strchr(args[i], '/') == NULL){
+      ush_hash_slot(args[i])[0]->hits = 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Process creation backends, selectable with the -b startup option.
+ */
+enum ush_backend { USH_BACKEND_SPAWN, USH_BACKEND_VFORK, USH_BACKEND_FORK, USH_BACKEND_ZYGOTE };
+
+char *backend_str[] = { "spawn", "vfork", "fork", "zygote" };
+
+int ush_backend = USH_BACKEND_SPAWN;
+
+/**
+   @brief Convert a status returned by waitpid() to a shell exit status.
+   @param status Status from waitpid().
+   @return Exit code, or 128 + signal number if the process was killed.
+ */
+int ush_wait_status(int status)
+{
+  if(WIFEXITED(status)){
+    return WEXITSTATUS(status);
+  }
+  if(WIFSIGNALED(status)){
+    return 128 + WTERMSIG(status);
+  }
+  return 1;
+}
+
+/**
+ * Signal mask children start with.  The shell itself keeps SIGCHLD blocked so
+ * that it can be read from ush_sigchld_fd.
+ */
+sigset_t ush_child_sigmask;
+
+/**
+ * Job control, when the shell reads commands from a terminal.  The shell
+ * runs in a process group of its own and every job in another, which holds
+ * the terminal while it runs in the foreground, so Ctrl-C, Ctrl-\ and Ctrl-Z
+ * reach the job and not the shell: a job that stops can be continued with
+ * fg or bg, and the shell, with its history and caches, lives on.  The shell
+ * ignores the stop signals and catches SIGINT, which it gets when Ctrl-C is
+ * typed while it runs something itself (a loop of builtins, parallel...): it
+ * only sets ush_interrupted, and what is left of the command line is not
+ * run.  A foreground job killed by SIGINT has the same effect.  Children get
+ * the default dispositions back.
+ */
+int ush_job_control = 0;
+int ush_tty_fd = -1;
+pid_t ush_shell_pgid = 0;
+pid_t ush_orig_pgid = 0;
+struct termios ush_shell_tmodes;
+sigset_t ush_job_sigs;
+
+/**
+ * Process group of the children being started, set by ush_job_new() and
+ * ush_job_add_process(): pgid -1 keeps the shell's, 0 makes the child the
+ * leader of a new one.  With foreground set, the child takes the terminal
+ * before it execs, so it never runs in the background by mistake.
+ */
+struct ush_spawn_group {
+  pid_t pgid;
+  int foreground;
+};
+
+struct ush_spawn_group spawn_group = { -1, 0 };
+
+/**
+   @brief Signal handler for SIGINT: note it for the command being run.
+   @param sig The signal.
+ */
+void ush_sigint(int sig)
+{
+  ush_interrupted = 1;
+}
+
+/**
+   @brief Turn job control on, if the shell can have the terminal.
+   Started in the background, the shell waits until it is brought to the
+   foreground.
+ */
+void ush_job_control_init()
+{
+  struct sigaction sa;
+
+  if(!isatty(STDIN_FILENO) || (ush_tty_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10)) < 0){
+    return;
+  }
+  while(tcgetpgrp(ush_tty_fd) != (ush_orig_pgid = getpgrp())){
+    kill(-ush_orig_pgid, SIGTTIN);
+  }
+
+  sigemptyset(&ush_job_sigs);
+  sigaddset(&ush_job_sigs, SIGINT);
+  sigaddset(&ush_job_sigs, SIGQUIT);
+  sigaddset(&ush_job_sigs, SIGTSTP);
+  sigaddset(&ush_job_sigs, SIGTTIN);
+  sigaddset(&ush_job_sigs, SIGTTOU);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  for (int sig = 1; sig < NSIG; sig++){
+    if(sig != SIGINT && sigismember(&ush_job_sigs, sig)){
+      sigaction(sig, &sa, NULL);
+    }
+  }
+  //No SA_RESTART: a builtin waiting for input gives up.
+  sa.sa_handler = ush_sigint;
+  sigaction(SIGINT, &sa, NULL);
+
+  //Fails harmlessly if the shell already leads its group (or its session).
+  setpgid(0, 0);
+  ush_shell_pgid = getpgrp();
+  tcsetpgrp(ush_tty_fd, ush_shell_pgid);
+  tcgetattr(ush_tty_fd, &ush_shell_tmodes);
+  ush_job_control = 1;
+}
+
+/**
+   @brief Give the terminal back to the process group that had it before
+   the shell, as the shell exits.
+ */
+void ush_job_control_end()
+{
+  if(ush_job_control && ush_orig_pgid != ush_shell_pgid){
+    tcsetpgrp(ush_tty_fd, ush_orig_pgid);
+  }
+}
+
+/**
+   @brief Restore the signal dispositions job control changed (runs in a
+   child).
+ */
+void ush_job_sigs_default()
+{
+  if(ush_job_control){
+    for (int sig = 1; sig < NSIG; sig++){
+      if(sigismember(&ush_job_sigs, sig)){
+        signal(sig, SIG_DFL);
+      }
+    }
+  }
+}
+
+/**
+   @brief Put a child in the process group of its job, and give it the
+   terminal if the job is in the foreground (runs in the child, which
+   still ignores SIGTTOU).
+ */
+void ush_child_pgroup()
+{
+  if(spawn_group.pgid >= 0){
+    setpgid(0, spawn_group.pgid);
+    if(spawn_group.foreground){
+      tcsetpgrp(ush_tty_fd, getpgrp());
+    }
+  }
+}
+
+/**
+   @brief Install the standard descriptors of a child (runs in the child).
+   @param fds Descriptors to install as 0, 1 and 2 (-1 keeps the shell's), or NULL.
+ */
+void ush_child_fds(const int *fds)
+{
+  if(fds == NULL){
+    return;
+  }
+  for (int i = 0; i < 3; i++){
+    if(fds[i] >= 0 && fds[i] != i){
+      dup2(fds[i], i);
+    }
+  }
+}
+
+/**
+   @brief Prepare a child before it execs (runs in the child).
+   Puts it in its job's process group, installs its standard descriptors
+   and restores the normal signal mask and dispositions.
+   @param fds Descriptors to install as 0, 1 and 2 (-1 keeps the shell's), or NULL.
+ */
+void ush_child_setup(const int *fds)
+{
+  ush_child_pgroup();
+  ush_job_sigs_default();
+  sigprocmask(SIG_SETMASK, &ush_child_sigmask, NULL);
+  ush_child_fds(fds);
+}
+
+/**
+   @brief Start a program with posix_spawn().
+   @param path Program to execute.
+   @param args Null terminated list of arguments (including program).
+   @param fds Descriptors for the child's stdin/stdout/stderr, or NULL.
+   @param err Set to the errno value describing why the program could not be started.
+   @return Pid of the child, or -1 on failure.
+ */
+pid_t ush_spawn_posix(const char *path, char **args, const int *fds, int *err)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_t *actionsp = NULL;
+  posix_spawnattr_t attr;
+  short flags = POSIX_SPAWN_SETSIGMASK;
+  pid_t pid;
+
+  if(fds != NULL || spawn_group.foreground){
+    posix_spawn_file_actions_init(&actions);
+    if(spawn_group.foreground){
+      posix_spawn_file_actions_addtcsetpgrp_np(&actions, ush_tty_fd);
+    }
+    for (int i = 0; fds != NULL && i < 3; i++){
+      if(fds[i] >= 0 && fds[i] != i){
+        posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+      }
+    }
+    actionsp = &actions;
+  }
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &ush_child_sigmask);
+  if(spawn_group.pgid >= 0){
+    posix_spawnattr_setpgroup(&attr, spawn_group.pgid);
+    flags |= POSIX_SPAWN_SETPGROUP;
+  }
+  if(ush_job_control){
+    posix_spawnattr_setsigdefault(&attr, &ush_job_sigs);
+    flags |= POSIX_SPAWN_SETSIGDEF;
+  }
+  posix_spawnattr_setflags(&attr, flags);
+  *err = posix_spawn(&pid, path, actionsp, &attr, args, ush_envp());
+  posix_spawnattr_destroy(&attr);
+  if(actionsp != NULL){
+    posix_spawn_file_actions_destroy(actionsp);
+  }
+  return (*err == 0) ? pid : -1;
+}
+
+/**
+   @brief Start a program with vfork() and execve().
+   The child shares our memory until it execs, so a failed exec is reported
+   back through a shared variable instead of being printed by the child.
+   @param path Program to execute.
+   @param args Null terminated list of arguments (including program).
+   @param fds Descriptors for the child's stdin/stdout/stderr, or NULL.
+   @param err Set to the errno value describing why the program could not be started.
+   @return Pid of the child, or -1 on failure.
+ */
+pid_t ush_spawn_vfork(const char *path, char **args, const int *fds, int *err)
+{
+  volatile int exec_errno = 0;
+  char **envp = ush_envp();
+  pid_t pid = vfork();
+
+  if(pid == 0){
+    //Child Process
+    ush_child_setup(fds);
+    execve(path, args, envp);
+    exec_errno = errno;
+    _exit(127);
+  }
+  else if(pid < 0){
+    *err = errno;
+    return -1;
+  }
+  if(exec_errno != 0){
+    //Child never became the program, reap it here.
+    waitpid(pid, NULL, 0);
+    *err = exec_errno;
+    return -1;
+  }
+  *err = 0;
+  return pid;
+}
+
+/**
+   @brief Start a program with fork() and execve().
+   @param path Program to execute.
+   @param args Null terminated list of arguments (including program).
+   @param fds Descriptors for the child's stdin/stdout/stderr, or NULL.
+   @param err Set to the errno value describing why the program could not be started.
+   @return Pid of the child, or -1 on failure.
+ */
+pid_t ush_spawn_fork(const char *path, char **args, const int *fds, int *err)
+{
+  char **envp = ush_envp();
+  pid_t pid = fork();
+
+  if(pid == 0){
+    //Child Process
+    ush_child_setup(fds);
+    execve(path, args, envp);
+    //As the other backends report it; _exit() leaves the shell's stdio alone.
+    fprintf(stderr, "ush: %s: %s\n", args[0], strerror(errno));
+    _exit(127);
+  }
+  *err = (pid < 0) ? errno : 0;
+  return pid;
+}
+
+/**
+ * Zygote backend.  A helper forked at startup, while the shell is still
+ * small, creates the children instead of the shell, so the cost of creating
+ * one does not grow with the shell's heap.  Requests go over a unix stream
+ * socket: a struct ush_zygote_request, then the path, the arguments and the
+ * environment as NUL terminated strings, with the descriptors for the
+ * child's stdin, stdout, stderr and working directory attached as SCM_RIGHTS.  The helper
+ * creates the child with clone(CLONE_PARENT | CLONE_VM | CLONE_VFORK), so it
+ * is a child of the shell (which waits for it as usual), and replies with its
+ * pid and, if the exec failed, the errno.  The request names the child's
+ * process group, as with the other backends.  The helper stays in the
+ * shell's group but keeps the job control signals blocked, so Ctrl-C never
+ * takes it down with a job.  Processes forked from the shell (builtins in a
+ * pipeline) do not use the helper: their children would not be theirs.
+ */
+#define USH_ZYGOTE_STACK_SIZE (64 * 1024)
+
+struct ush_zygote_request {
+  uint32_t size;
+  uint32_t argc;
+  uint32_t envc;
+  int32_t pgid;
+  int32_t foreground;
+};
+
+struct ush_zygote_reply {
+  int32_t pid;
+  int32_t err;
+};
+
+struct ush_zygote_exec {
+  const char *path;
+  char **argv;
+  char **envp;
+  const int *fds;
+  pid_t pgid;
+  int foreground;
+  volatile int err;
+};
+
+int zygote_fd = -1;
+sigset_t zygote_sigmask;
+char *zygote_buf = NULL;
+size_t zygote_buf_capacity = 0;
+
+/**
+   @brief Body of a child created by the zygote: install its descriptors and exec.
+   @param arg The struct ush_zygote_exec (shared with the zygote until the exec).
+   @return Does not return.
+ */
+int ush_zygote_child(void *arg)
+{
+  struct ush_zygote_exec *exec = arg;
+
+  if(exec->pgid >= 0){
+    setpgid(0, exec->pgid);
+    //The helper's stdin is the shell's: the terminal, under job control.
+    if(exec->foreground){
+      tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+  }
+  sigprocmask(SIG_SETMASK, &zygote_sigmask, NULL);
+  if(fchdir(exec->fds[3]) != 0){
+    exec->err = errno;
+    _exit(127);
+  }
+  for (int i = 0; i < 3; i++){
+    dup2(exec->fds[i], i);
+  }
+  execve(exec->path, exec->argv, exec->envp);
+  exec->err = errno;
+  _exit(127);
+}
+
+/**
+   @brief Receive exactly len bytes, and any descriptors sent with them.
+   @param fd The socket.
+   @param buf Where the bytes go.
+   @param len Number of bytes.
+   @param fds Receives the four descriptors, or NULL if none are expected.
+   @return 0 on success, -1 on error or end of file.
+ */
+int ush_zygote_recv(int fd, char *buf, size_t len, int *fds)
+{
+  char control[CMSG_SPACE(4 * sizeof(int))];
+
+  while(len > 0){
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(fds != NULL){
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+    }
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if(n <= 0){
+      if(n < 0 && errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    if(fds != NULL){
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+      if(cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(4 * sizeof(int))){
+        memcpy(fds, CMSG_DATA(cmsg), 4 * sizeof(int));
+        fds = NULL;
+      }
+    }
+    buf += n;
+    len -= n;
+  }
+  return (fds == NULL) ? 0 : -1;
+}
+
+/**
+   @brief Main loop of the zygote: serve launch requests until the shell goes away.
+   @param fd The zygote's end of the socket.
+ */
+void ush_zygote_main(int fd)
+{
+  char *stack = mmap(NULL, USH_ZYGOTE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  char **vec = NULL;
+  size_t vec_capacity = 0;
+  char *buf = NULL;
+  size_t buf_capacity = 0;
+  sigset_t block;
+
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGQUIT);
+  sigaddset(&block, SIGTSTP);
+  sigaddset(&block, SIGTTIN);
+  sigaddset(&block, SIGTTOU);
+  sigprocmask(SIG_BLOCK, &block, &zygote_sigmask);
+
+  //Keep 0-2 taken, so received descriptors never land on them, and let the
+  //children inherit nothing else of the shell's.
+  for (int i = 0; i < 3; i++){
+    if(fcntl(i, F_GETFD) < 0){
+      open("/dev/null", O_RDWR);
+    }
+  }
+  if(fd != 3){
+    dup2(fd, 3);
+    fd = 3;
+  }
+  close_range(4, ~0U, 0);
+
+  for (;;){
+    struct ush_zygote_request request;
+    struct ush_zygote_reply reply;
+    struct ush_zygote_exec exec;
+    int fds[4];
+    char *p;
+
+    if(ush_zygote_recv(fd, (char*)&request, sizeof(request), fds) < 0){
+      _exit(0);
+    }
+    buf = ush_grow_array(buf, &buf_capacity, request.size, 1);
+    vec = ush_grow_array(vec, &vec_capacity, request.argc + request.envc + 2, sizeof(char*));
+    if(ush_zygote_recv(fd, buf, request.size, NULL) < 0){
+      _exit(0);
+    }
+
+    p = buf;
+    exec.path = p;
+    p += strlen(p) + 1;
+    for (uint32_t i = 0; i < request.argc + request.envc; i++){
+      vec[i + (i >= request.argc)] = p;
+      p += strlen(p) + 1;
+    }
+    vec[request.argc] = NULL;
+    vec[request.argc + request.envc + 1] = NULL;
+    exec.argv = vec;
+    exec.envp = vec + request.argc + 1;
+    exec.fds = fds;
+    exec.pgid = request.pgid;
+    exec.foreground = request.foreground;
+    exec.err = 0;
+
+    reply.pid = clone(ush_zygote_child, stack + USH_ZYGOTE_STACK_SIZE,
+                      CLONE_PARENT | CLONE_VM | CLONE_VFORK | SIGCHLD, &exec);
+    reply.err = (reply.pid < 0) ? errno : exec.err;
+    for (int i = 0; i < 4; i++){
+      close(fds[i]);
+    }
+    if(ush_write_all(fd, (char*)&reply, sizeof(reply)) < 0){
+      _exit(0);
+    }
+  }
+}
+
+/**
+   @brief Start the zygote.  Called at startup, before the shell's heap grows.
+   @return 0 on success, -1 on failure (the fork backend is used instead).
+ */
+int ush_zygote_start()
+{
+  int sv[2];
+  pid_t pid;
+
+  if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0){
+    perror("ush: zygote");
+    return -1;
+  }
+  pid = fork();
+  if(pid < 0){
+    perror("ush: zygote");
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  if(pid == 0){
+    close(sv[0]);
+    ush_zygote_main(sv[1]);
+  }
+  close(sv[1]);
+  zygote_fd = sv[0];
+  return 0;
+}
+
+/**
+   @brief Start a program through the zygote.
+   @param path Program to execute.
+   @param args Null terminated list of arguments (including program).
+   @param fds Descriptors for the child's stdin/stdout/stderr, or NULL.
+   @param err Set to the errno value describing why the program could not be
+   started (ENOSYS if the zygote is not available).
+   @return Pid of the child, or -1 on failure.
+ */
+pid_t ush_spawn_zygote(const char *path, char **args, const int *fds, int *err)
+{
+  struct ush_zygote_request request;
+  struct ush_zygote_reply reply;
+  char **envp = ush_envp();
+  int child_fds[4];
+  char control[CMSG_SPACE(sizeof(child_fds))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  size_t size = strlen(path) + 1;
+  char *p;
+
+  if(zygote_fd < 0){
+    *err = ENOSYS;
+    return -1;
+  }
+  request.argc = request.envc = 0;
+  request.pgid = spawn_group.pgid;
+  request.foreground = spawn_group.foreground;
+  for (char **arg = args; *arg != NULL; arg++, request.argc++){
+    size += strlen(*arg) + 1;
+  }
+  for (char **env = envp; *env != NULL; env++, request.envc++){
+    size += strlen(*env) + 1;
+  }
+  request.size = size;
+
+  zygote_buf = ush_grow_array(zygote_buf, &zygote_buf_capacity, sizeof(request) + size, 1);
+  memcpy(zygote_buf, &request, sizeof(request));
+  p = zygote_buf + sizeof(request);
+  p = stpcpy(p, path) + 1;
+  for (char **arg = args; *arg != NULL; arg++){
+    p = stpcpy(p, *arg) + 1;
+  }
+  for (char **env = envp; *env != NULL; env++){
+    p = stpcpy(p, *env) + 1;
+  }
+
+  //Descriptors left at -1 are the shell's own, as they are right now.
+  for (int i = 0; i < 3; i++){
+    child_fds[i] = (fds != NULL && fds[i] >= 0) ? fds[i] : i;
+  }
+  //The child starts in the shell's working directory, not the zygote's.
+  if((child_fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0){
+    *err = ENOSYS;
+    return -1;
+  }
+  iov.iov_base = zygote_buf;
+  iov.iov_len = sizeof(request);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(child_fds));
+  memcpy(CMSG_DATA(cmsg), child_fds, sizeof(child_fds));
+
+  if(sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) != sizeof(request)){
+    if(errno == EBADF){
+      //A closed standard descriptor can't be sent: do without the zygote once.
+      *err = ENOSYS;
+      close(child_fds[3]);
+      return -1;
+    }
+  }
+  else if(ush_write_all(zygote_fd, zygote_buf + sizeof(request), size) == 0
+          && ush_zygote_recv(zygote_fd, (char*)&reply, sizeof(reply), NULL) == 0){
+    close(child_fds[3]);
+    if(reply.pid < 0){
+      *err = reply.err;
+      return -1;
+    }
+    if(reply.err != 0){
+      //Child never became the program, reap it here.
+      waitpid(reply.pid, NULL, 0);
+      *err = reply.err;
+      return -1;
+    }
+    *err = 0;
+    return reply.pid;
+  }
+
+  //The zygote has gone: fall back to fork() from now on.
+  fprintf(stderr, "ush: zygote: %s\n", strerror(errno));
+  close(child_fds[3]);
+  close(zygote_fd);
+  zygote_fd = -1;
+  *err = ENOSYS;
+  return -1;
+}
+
+/**
+   @brief Start a program using the selected backend.
+   Falls back to fork() when the cheaper backend cannot create a process at all.
+   @param path Program to execute.
+   @param args Null terminated list of arguments (including program).
+   @param fds Descriptors for the child's stdin/stdout/stderr, or NULL.
+   @param err Set to the errno value describing why the program could not be started.
+   @return Pid of the child, or -1 on failure.
+ */
+pid_t ush_spawn_path(const char *path, char **args, const int *fds, int *err)
+{
+  pid_t pid;
+
+  switch(ush_backend){
+  case USH_BACKEND_SPAWN:
+    pid = ush_spawn_posix(path, args, fds, err);
+    break;
+  case USH_BACKEND_VFORK:
+    pid = ush_spawn_vfork(path, args, fds, err);
+    break;
+  case USH_BACKEND_ZYGOTE:
+    pid = ush_spawn_zygote(path, args, fds, err);
+    break;
+  default:
+    pid = ush_spawn_fork(path, args, fds, err);
+    break;
+  }
+
+  if(pid < 0 && ush_backend != USH_BACKEND_FORK && (*err == ENOSYS || *err == EAGAIN || *err == ENOMEM)){
+    pid = ush_spawn_fork(path, args, fds, err);
+  }
+  return pid;
+}
+
+/**
+   @brief Locate and start a program.
+   A cached location that has disappeared is forgotten and searched for again.
+   @param args Null terminated list of arguments (including program).
+   @param fds Descriptors for the child's stdin/stdout/stderr (-1 keeps the
+   shell's), or NULL to inherit all three.
+   @return Pid of the child, or -1 if it could not be started (error already reported).
+ */
+pid_t ush_spawn(char **args, const int *fds)
+{
+  USH_TRACE_BEGIN(start);
+  const char *path = ush_find_command(args[0]);
+  pid_t pid;
+  int err = ENOENT;
+
+  USH_TRACE_END(USH_TR_LOOKUP, start);
+
+  if(path == NULL){
+    fprintf(stderr, "ush: %s: command not found\n", args[0]);
+    return -1;
+  }
+
+  //Don't let the child's output overtake what we have buffered.
+  fflush(stdout);
+  USH_TRACE_BEGIN(spawn_start);
+  pid = ush_spawn_path(path, args, fds, &err);
+  USH_TRACE_END(USH_TR_SPAWN, spawn_start);
+  if(pid < 0 && err == ENOENT && path != args[0]){
+    ush_hash_forget(args[0]);
+    path = ush_find_command(args[0]);
+    if(path == NULL){
+      fprintf(stderr, "ush: %s: command not found\n", args[0]);
+      return -1;
+    }
+    pid = ush_spawn_path(path, args, fds, &err);
+  }
+  if(pid < 0){
+    fprintf(stderr, "ush: %s: %s\n", args[0], strerror(err));
+  }
+  return pid;
+}
+
+/**
+ * Job table.  Every child the shell starts belongs to a job (one per
+ * pipeline).  Children are only ever reaped through ush_job_update(), either
+ * while waiting for a foreground job or when ush_sigchld_fd reports SIGCHLD,
+ * so finished background jobs are collected without the shell polling for them.
+ * Under job control each job has a process group (pgid, led by its first
+ * process); a foreground job holds the terminal until it finishes or stops,
+ * and a stopped one keeps its terminal modes for when it is continued.
+ * Released job structures are kept on a free list and reused.
+ */
+enum ush_job_state { USH_JOB_RUNNING, USH_JOB_STOPPED, USH_JOB_DONE };
+
+struct ush_process {
+  pid_t pid;
+  int status;
+  int state;
+  char name[16];
+  struct timespec start;
+};
+
+struct ush_job {
+  int id;
+  uint64_t pipeline;
+  int state;
+  int reported_state;
+  int background;
+  int foreground;
+  pid_t pgid;
+  struct termios tmodes;
+  int has_tmodes;
+  struct timespec start;
+  char *text;
+  size_t text_capacity;
+  struct ush_process *procs;
+  size_t num_procs;
+  size_t proc_capacity;
+  struct ush_job *next_free;
+};
+
+struct ush_job **job_table = NULL;
+size_t job_table_size = 0;
+struct ush_job *job_free_list = NULL;
+int current_job = 0;
+int ush_sigchld_fd = -1;
+
+/**
+ * Resource accounting: while a command is being timed ("time", or every
+ * foreground command with "set -o timing"), each child reaped for a
+ * foreground job adds its wait4() usage and wall time, and the shell's own
+ * share (builtins run in the shell) is taken with getrusage() around the
+ * command.  The report goes to stderr once the command is done.  Only the
+ * first USH_TIMING_PROCS children are listed one by one; all are counted in
+ * the total.
+ */
+#define USH_TIMING_PROCS 16
+
+struct ush_timed_proc {
+  char name[16];
+  double real;
+  struct rusage usage;
+};
+
+struct ush_timing {
+  int active;
+  struct timespec start;
+  struct rusage self;
+  struct ush_timed_proc procs[USH_TIMING_PROCS];
+  size_t count;
+  struct ush_timed_proc total;
+};
+
+struct ush_timing timing;
+int ush_opt_timing = 0;
+
+/**
+   @brief Seconds from one monotonic time to another.
+   @param from Earlier time.
+   @param to Later time.
+   @return Difference in seconds.
+ */
+double ush_elapsed(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+   @brief Seconds in a struct timeval.
+   @param tv The time.
+   @return Seconds.
+ */
+double ush_tv_seconds(const struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+   @brief Add one resource usage record to another.
+   @param sum Record added to; ru_maxrss keeps the maximum.
+   @param usage Record to add.
+ */
+void ush_rusage_add(struct rusage *sum, const struct rusage *usage)
+{
+  timeradd(&sum->ru_utime, &usage->ru_utime, &sum->ru_utime);
+  timeradd(&sum->ru_stime, &usage->ru_stime, &sum->ru_stime);
+  if(usage->ru_maxrss > sum->ru_maxrss){
+    sum->ru_maxrss = usage->ru_maxrss;
+  }
+  sum->ru_minflt += usage->ru_minflt;
+  sum->ru_majflt += usage->ru_majflt;
+  sum->ru_nvcsw += usage->ru_nvcsw;
+  sum->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/**
+   @brief Account for a finished child of a timed command.
+   @param name Name of its program.
+   @param real Its wall time.
+   @param usage Its resource usage from wait4().
+ */
+void ush_timing_record(const char *name, double real, const struct rusage *usage)
+{
+  if(timing.count < USH_TIMING_PROCS){
+    struct ush_timed_proc *proc = &timing.procs[timing.count];
+
+    memcpy(proc->name, name, sizeof(proc->name));
+    proc->real = real;
+    proc->usage = *usage;
+  }
+  timing.count++;
+  ush_rusage_add(&timing.total.usage, usage);
+}
+
+/**
+   @brief Start timing a command.
+   @return Nonzero if timing started, zero if a command is already being timed.
+ */
+int ush_timing_begin()
+{
+  if(timing.active){
+    return 0;
+  }
+  memset(&timing, 0, sizeof(timing));
+  timing.active = 1;
+  getrusage(RUSAGE_SELF, &timing.self);
+  clock_gettime(CLOCK_MONOTONIC, &timing.start);
+  return 1;
+}
+
+/**
+   @brief Print one line of a timing report.
+   @param proc The record.
+ */
+void ush_timing_print(const struct ush_timed_proc *proc)
+{
+  const struct rusage *ru = &proc->usage;
+
+  fprintf(stderr, "%-12s real %8.3fs  user %8.3fs  sys %8.3fs  rss %7ldk  faults %ld/%ld  cs %ld/%ld\n",
+          proc->name, proc->real, ush_tv_seconds(&ru->ru_utime), ush_tv_seconds(&ru->ru_stime),
+          ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt, ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/**
+   @brief Finish timing a command and print the report.
+   Faults are major/minor, context switches (cs) voluntary/involuntary; rss
+   is the largest maximum resident set size among them.
+ */
+void ush_timing_end()
+{
+  struct timespec now;
+  struct rusage self;
+  struct ush_timed_proc shell;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  getrusage(RUSAGE_SELF, &self);
+  timing.active = 0;
+
+  //The shell's own share since the command started.
+  memset(&shell, 0, sizeof(shell));
+  strcpy(shell.name, "(ush)");
+  shell.real = ush_elapsed(&timing.start, &now);
+  timersub(&self.ru_utime, &timing.self.ru_utime, &shell.usage.ru_utime);
+  timersub(&self.ru_stime, &timing.self.ru_stime, &shell.usage.ru_stime);
+  shell.usage.ru_maxrss = self.ru_maxrss;
+  shell.usage.ru_minflt = self.ru_minflt - timing.self.ru_minflt;
+  shell.usage.ru_majflt = self.ru_majflt - timing.self.ru_majflt;
+  shell.usage.ru_nvcsw = self.ru_nvcsw - timing.self.ru_nvcsw;
+  shell.usage.ru_nivcsw = self.ru_nivcsw - timing.self.ru_nivcsw;
+
+  if(timing.count == 0){
+    //Nothing but the shell ran.
+    strcpy(shell.name, "total");
+    ush_timing_print(&shell);
+    return;
+  }
+  for (size_t i = 0; i < timing.count && i < USH_TIMING_PROCS; i++){
+    ush_timing_print(&timing.procs[i]);
+  }
+  if(timing.count > USH_TIMING_PROCS){
+    fprintf(stderr, "%-12s (%zu more processes)\n", "...", timing.count - USH_TIMING_PROCS);
+  }
+  ush_timing_print(&shell);
+  strcpy(timing.total.name, "total");
+  timing.total.real = shell.real;
+  ush_rusage_add(&timing.total.usage, &shell.usage);
+  ush_timing_print(&timing.total);
+}
+
+/**
+ * Execution log.  With $USH_LOG set at startup every command run adds one
+ * JSON object, on a line of its own, to a file (appended to) or, for
+ * "unix:PATH", a stream socket, so the logs of many shells can be gathered
+ * and searched for the slowest steps.  A child gets a record when it is
+ * reaped, with its program, pid, job, pipeline, exit status, wall time and
+ * wait4() usage; a builtin run in the shell gets one with its status and
+ * duration.  Every record has the time it was made, the host and the shell's
+ * pid.
+ *
+ * Records are formatted into log_buf and handed to a writer process, forked
+ * at startup like the zygote, through a non-blocking pipe: before each line
+ * is read, and whenever USH_LOG_FLUSH_SIZE has gathered.  Only the writer
+ * waits for the file or socket, so a slow disk or collector never holds up
+ * the prompt.  When more than USH_LOG_MAX_BUFFER is waiting for the writer,
+ * records are dropped and counted, and a "dropped" record says how many.
+ */
+#define USH_LOG_FLUSH_SIZE 16384
+#define USH_LOG_MAX_BUFFER (1 << 20)
+
+char *log_buf = NULL;
+size_t log_len = 0;
+size_t log_capacity = 0;
+uint64_t log_dropped = 0;
+uint64_t log_pipeline = 0;
+pid_t log_writer = -1;
+pid_t log_shell;
+char log_host[HOST_NAME_MAX + 1];
+
+/**
+   @brief Main loop of the log writer: copy what the shell sends to the log
+   until the shell goes away.
+   @param in Read end of the pipe from the shell.
+   @param out The log file or socket.
+ */
+void ush_log_writer_main(int in, int out)
+{
+  char buf[65536];
+  sigset_t block;
+
+  //Ctrl-C and hangups are for the shell; the writer still gets its last records.
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGQUIT);
+  sigaddset(&block, SIGTSTP);
+  sigaddset(&block, SIGTTIN);
+  sigaddset(&block, SIGTTOU);
+  sigaddset(&block, SIGHUP);
+  sigprocmask(SIG_BLOCK, &block, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  //Keep the pipe and the log as 3 and 4, and nothing else of the shell's.
+  in = fcntl(in, F_DUPFD, 5);
+  out = fcntl(out, F_DUPFD, in + 1);
+  dup2(in, 3);
+  dup2(out, 4);
+  close_range(5, ~0U, 0);
+
+  for (;;){
+    ssize_t n = read(3, buf, sizeof(buf));
+
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n <= 0){
+      _exit(0);
+    }
+    //A log that cannot be written loses the records, nothing more.
+    ush_write_all(4, buf, n);
+  }
+}
+
+/**
+   @brief Open the log named by $USH_LOG and start the writer.  Called at
+   startup, before the shell's heap grows.
+   @param dest A file name, or "unix:" and the path of a socket.
+   @return 0 on success, -1 on failure (error already reported; nothing is logged).
+ */
+int ush_log_start(const char *dest)
+{
+  int pipefd[2];
+  int out;
+  pid_t pid;
+
+  if(strncmp(dest, "unix:", 5) == 0){
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(dest + 5) >= sizeof(addr.sun_path)){
+      fprintf(stderr, "ush: USH_LOG: %s: %s\n", dest + 5, strerror(ENAMETOOLONG));
+      return -1;
+    }
+    strcpy(addr.sun_path, dest + 5);
+    out = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(out >= 0 && connect(out, (struct sockaddr*)&addr, sizeof(addr)) != 0){
+      int err = errno;
+
+      close(out);
+      out = -1;
+      errno = err;
+    }
+  }
+  else{
+    out = open(dest, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  }
+  if(out < 0){
+    fprintf(stderr, "ush: USH_LOG: %s: %s\n", dest, strerror(errno));
+    return -1;
+  }
+  if(pipe2(pipefd, O_CLOEXEC) != 0){
+    perror("ush: USH_LOG");
+    close(out);
+    return -1;
+  }
+  pid = fork();
+  if(pid < 0){
+    perror("ush: USH_LOG");
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(out);
+    return -1;
+  }
+  if(pid == 0){
+    close(pipefd[1]);
+    ush_log_writer_main(pipefd[0], out);
+  }
+  close(pipefd[0]);
+  close(out);
+
+  //Room for a burst of records while the writer catches up.
+  fcntl(pipefd[1], F_SETPIPE_SZ, USH_LOG_MAX_BUFFER);
+  fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+  if(gethostname(log_host, sizeof(log_host) - 1) != 0){
+    strcpy(log_host, "localhost");
+  }
+  log_buf = ush_grow_array(log_buf, &log_capacity, 2 * USH_LOG_FLUSH_SIZE, 1);
+  log_writer = pid;
+  log_shell = getpid();
+  ush_log_fd = pipefd[1];
+  return 0;
+}
+
+/**
+   @brief Hand the buffered records to the writer, as much as the pipe takes.
+ */
+void ush_log_flush()
+{
+  size_t done = 0;
+
+  while(done < log_len){
+    ssize_t n = write(ush_log_fd, log_buf + done, log_len - done);
+
+    if(n < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      if(errno != EAGAIN){
+        //The writer has gone away: stop logging.
+        close(ush_log_fd);
+        ush_log_fd = -1;
+        done = log_len;
+      }
+      break;
+    }
+    done += n;
+  }
+  memmove(log_buf, log_buf + done, log_len - done);
+  log_len -= done;
+}
+
+/**
+   @brief Add formatted text to the log buffer.
+   @param format Format string for printf.
+ */
+void ush_log_printf(const char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap, format);
+  n = vsnprintf(log_buf + log_len, log_capacity - log_len, format, ap);
+  va_end(ap);
+  if((size_t)n >= log_capacity - log_len){
+    log_buf = ush_grow_array(log_buf, &log_capacity, log_len + n + 1, 1);
+    va_start(ap, format);
+    vsnprintf(log_buf + log_len, log_capacity - log_len, format, ap);
+    va_end(ap);
+  }
+  log_len += n;
+}
+
+/**
+   @brief Add a string to the log buffer as a JSON string.
+   @param s The string.
+ */
+void ush_log_string(const char *s)
+{
+  log_buf = ush_grow_array(log_buf, &log_capacity, log_len + 6 * strlen(s) + 3, 1);
+  log_buf[log_len++] = '"';
+  for (; *s != '\0'; s++){
+    unsigned char c = *s;
+
+    if(c == '"' || c == '\\'){
+      log_buf[log_len++] = '\\';
+      log_buf[log_len++] = c;
+    }
+    else if(c < 0x20){
+      log_len += sprintf(log_buf + log_len, "\\u%04x", c);
+    }
+    else{
+      log_buf[log_len++] = c;
+    }
+  }
+  log_buf[log_len++] = '"';
+}
+
+/**
+   @brief Start a record with the fields every record has.
+   @param now When it is made.
+ */
+void ush_log_header(const struct timespec *now)
+{
+  ush_log_printf("{\"time\":%lld.%06ld,\"host\":", (long long)now->tv_sec, now->tv_nsec / 1000);
+  ush_log_string(log_host);
+  ush_log_printf(",\"shell\":%d", (int)log_shell);
+}
+
+/**
+   @brief Start a record, first saying how many were dropped if any were.
+   @return Nonzero if the record is to be written, zero if it is dropped.
+ */
+int ush_log_begin()
+{
+  struct timespec now;
+
+  if(log_len >= USH_LOG_MAX_BUFFER){
+    ush_log_flush();
+    if(log_len >= USH_LOG_MAX_BUFFER){
+      log_dropped++;
+      return 0;
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  if(log_dropped > 0){
+    ush_log_header(&now);
+    ush_log_printf(",\"dropped\":%" PRIu64 "}\n", log_dropped);
+    log_dropped = 0;
+  }
+  ush_log_header(&now);
+  return 1;
+}
+
+/**
+   @brief End a record, and pass the buffer on once enough has gathered.
+ */
+void ush_log_finish()
+{
+  ush_log_printf("}\n");
+  if(log_len >= USH_LOG_FLUSH_SIZE){
+    ush_log_flush();
+  }
+}
+
+/**
+   @brief Log a child that has terminated.
+   @param job Its job.
+   @param proc The child.
+   @param real Its wall time.
+   @param usage Its resource usage from wait4().
+ */
+void ush_log_process(const struct ush_job *job, const struct ush_process *proc, double real,
+                     const struct rusage *usage)
+{
+  if(!ush_log_begin()){
+    return;
+  }
+  ush_log_printf(",\"pipeline\":%" PRIu64 ",\"job\":%d,\"pid\":%d,\"argv0\":", job->pipeline, job->id, (int)proc->pid);
+  ush_log_string(proc->name);
+  ush_log_printf(",\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss\":%ld,"
+                 "\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld",
+                 ush_wait_status(proc->status), real, ush_tv_seconds(&usage->ru_utime),
+                 ush_tv_seconds(&usage->ru_stime), usage->ru_maxrss, usage->ru_minflt,
+                 usage->ru_majflt, usage->ru_nvcsw, usage->ru_nivcsw);
+  ush_log_finish();
+}
+
+/**
+   @brief Log a builtin that has run in the shell.
+   @param name Its name.
+   @param start When it started (ush_trace_clock()).
+ */
+void ush_log_builtin(const char *name, uint64_t start)
+{
+  double real = (ush_trace_clock() - start) / 1e9;
+
+  if(ush_log_fd < 0 || !ush_log_begin()){
+    return;
+  }
+  ush_log_printf(",\"pipeline\":%" PRIu64 ",\"builtin\":true,\"argv0\":", log_pipeline);
+  ush_log_string(name);
+  ush_log_printf(",\"status\":%d,\"real\":%.6f", ush_last_status, real);
+  ush_log_finish();
+}
+
+/**
+   @brief Write out the rest of the log and wait for the writer to finish
+   with it.  Called when the shell exits.
+ */
+void ush_log_end()
+{
+  if(ush_log_fd < 0){
+    return;
+  }
+  //Nobody is waiting for a prompt any more.
+  fcntl(ush_log_fd, F_SETFL, 0);
+  ush_log_flush();
+  if(log_dropped > 0 && ush_log_fd >= 0){
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ush_log_header(&now);
+    ush_log_printf(",\"dropped\":%" PRIu64 "}\n", log_dropped);
+    ush_log_flush();
+  }
+  if(ush_log_fd >= 0){
+    close(ush_log_fd);
+    ush_log_fd = -1;
+  }
+  waitpid(log_writer, NULL, 0);
+}
+
+/**
+   @brief Create a job and give it the lowest free job number.
+   @param text Command line of the job, for listings.
+   @param background Nonzero if the shell does not wait for it.
+   @return The job.
+ */
+struct ush_job* ush_job_new(const char *text, int background)
+{
+  struct ush_job *job = job_free_list;
+  size_t text_size = strlen(text) + 1;
+  size_t slot;
+
+  if(job != NULL){
+    job_free_list = job->next_free;
+  }
+  else{
+    job = (struct ush_job*)ush_malloc(sizeof(struct ush_job));
+    job->text = NULL;
+    job->text_capacity = 0;
+    job->procs = NULL;
+    job->proc_capacity = 0;
+  }
+  if(job->text_capacity < text_size){
+    job->text = ush_realloc(job->text, text_size);
+    job->text_capacity = text_size;
+  }
+  memcpy(job->text, text, text_size);
+  job->pipeline = log_pipeline;
+  if(timing.active || ush_log_fd >= 0){
+    //Before its children are started, which may take as long as they run.
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+  }
+  job->num_procs = 0;
+  job->state = job->reported_state = USH_JOB_RUNNING;
+  job->background = background;
+  job->foreground = ush_job_control && !background;
+  job->pgid = 0;
+  job->has_tmodes = 0;
+  //Its children will start a process group of their own.
+  spawn_group.pgid = ush_job_control ? 0 : -1;
+  spawn_group.foreground = job->foreground;
+
+  for (slot = 0; slot < job_table_size && job_table[slot] != NULL; slot++)
+    ;
+  if(slot == job_table_size){
+    size_t old_size = job_table_size;
+
+    job_table = ush_grow_array(job_table, &job_table_size, slot + 1, sizeof(struct ush_job*));
+    memset(job_table + old_size, 0, (job_table_size - old_size) * sizeof(struct ush_job*));
+  }
+  job_table[slot] = job;
+  job->id = slot + 1;
+  return job;
+}
+
+/**
+   @brief Record a child as part of a job.
+   @param job The job.
+   @param pid Pid of the child.
+   @param name Name of its program, for timing reports.
+ */
+void ush_job_add_process(struct ush_job *job, pid_t pid, const char *name)
+{
+  struct ush_process *proc;
+
+  job->procs = ush_grow_array(job->procs, &job->proc_capacity, job->num_procs + 1, sizeof(struct ush_process));
+  proc = &job->procs[job->num_procs++];
+  proc->pid = pid;
+  proc->status = 0;
+  proc->state = USH_JOB_RUNNING;
+  strncpy(proc->name, name, sizeof(proc->name) - 1);
+  proc->name[sizeof(proc->name) - 1] = '\0';
+  proc->start = job->start;
+  if(ush_job_control){
+    //The child has done the same, unless it has not run yet.
+    if(job->pgid == 0){
+      job->pgid = pid;
+    }
+    setpgid(pid, job->pgid);
+    if(job->foreground && job->num_procs == 1){
+      tcsetpgrp(ush_tty_fd, job->pgid);
+    }
+    spawn_group.pgid = job->pgid;
+  }
+}
+
+/**
+   @brief Give the terminal to a job that goes on in the foreground, with
+   the modes it had when it stopped.
+   @param job The job.
+ */
+void ush_job_terminal(struct ush_job *job)
+{
+  job->background = 0;
+  if(!ush_job_control || job->pgid == 0){
+    return;
+  }
+  job->foreground = 1;
+  if(job->has_tmodes){
+    tcsetattr(ush_tty_fd, TCSADRAIN, &job->tmodes);
+  }
+  tcsetpgrp(ush_tty_fd, job->pgid);
+}
+
+/**
+   @brief Remove a job from the table and keep its memory for reuse.
+   @param job The job.
+ */
+void ush_job_release(struct ush_job *job)
+{
+  job_table[job->id - 1] = NULL;
+  if(current_job == job->id){
+    current_job = 0;
+    for (size_t i = job_table_size; i > 0; i--){
+      if(job_table[i - 1] != NULL && job_table[i - 1]->background){
+        current_job = i;
+        break;
+      }
+    }
+  }
+  job->next_free = job_free_list;
+  job_free_list = job;
+}
+
+/**
+   @brief Exit status of a job: that of its last process.
+   @param job The job.
+   @return Shell exit status.
+ */
+int ush_job_status(struct ush_job *job)
+{
+  if(job->num_procs == 0){
+    return 127;
+  }
+  return ush_wait_status(job->procs[job->num_procs - 1].status);
+}
+
+/**
+   @brief Record a status change reported by wait4().
+   @param pid The child.
+   @param status Its wait status.
+   @param usage Its resource usage, if it has terminated.
+ */
+void ush_job_update(pid_t pid, int status, const struct rusage *usage)
+{
+  for (size_t i = 0; i < job_table_size; i++){
+    struct ush_job *job = job_table[i];
+
+    if(job == NULL){
+      continue;
+    }
+    for (size_t j = 0; j < job->num_procs; j++){
+      struct ush_process *proc = &job->procs[j];
+      int stopped = 0;
+      int running = 0;
+
+      if(proc->pid != pid){
+        continue;
+      }
+      if(WIFSTOPPED(status)){
+        proc->state = USH_JOB_STOPPED;
+        proc->status = status;
+      }
+      else if(WIFCONTINUED(status)){
+        proc->state = USH_JOB_RUNNING;
+      }
+      else{
+        proc->state = USH_JOB_DONE;
+        proc->status = status;
+        if((timing.active && !job->background) || ush_log_fd >= 0){
+          struct timespec now;
+          double real;
+
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          real = ush_elapsed(&proc->start, &now);
+          if(timing.active && !job->background){
+            ush_timing_record(proc->name, real, usage);
+          }
+          if(ush_log_fd >= 0){
+            ush_log_process(job, proc, real, usage);
+          }
+        }
+      }
+
+      for (size_t k = 0; k < job->num_procs; k++){
+        stopped += (job->procs[k].state == USH_JOB_STOPPED);
+        running += (job->procs[k].state == USH_JOB_RUNNING);
+      }
+      job->state = stopped ? USH_JOB_STOPPED : (running ? USH_JOB_RUNNING : USH_JOB_DONE);
+      return;
+    }
+  }
+}
+
+/**
+   @brief Reap every child that has changed state, without blocking.
+ */
+void ush_reap_children()
+{
+  struct signalfd_siginfo info;
+  struct rusage usage;
+  pid_t pid;
+  int status;
+
+  //Drain the notifications; wait4() below finds every child regardless.
+  while(ush_sigchld_fd >= 0 && read(ush_sigchld_fd, &info, sizeof(info)) == sizeof(info))
+    ;
+  while((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0){
+    ush_job_update(pid, status, &usage);
+  }
+}
+
+/**
+   @brief Print a line describing a job.
+   @param job The job.
+ */
+void ush_job_print(struct ush_job *job)
+{
+  char state[32];
+
+  if(job->state == USH_JOB_RUNNING){
+    strcpy(state, "Running");
+  }
+  else if(job->state == USH_JOB_STOPPED){
+    strcpy(state, "Stopped");
+  }
+  else if(ush_job_status(job) == 0){
+    strcpy(state, "Done");
+  }
+  else{
+    snprintf(state, sizeof(state), "Exit %d", ush_job_status(job));
+  }
+  ush_out_printf("[%d]%c  %-24s%s\n", job->id, (job->id == current_job) ? '+' : ' ', state, job->text);
+}
+
+/**
+   @brief Report background jobs that have finished or stopped, and forget
+   the finished ones.
+ */
+void ush_notify_jobs()
+{
+  for (size_t i = 0; i < job_table_size; i++){
+    struct ush_job *job = job_table[i];
+
+    if(job == NULL || !job->background || job->state == job->reported_state){
+      continue;
+    }
+    ush_job_print(job);
+    job->reported_state = job->state;
+    if(job->state == USH_JOB_DONE){
+      ush_job_release(job);
+    }
+  }
+  ush_out_flush();
+}
+
+/**
+   @brief Wait for a job to finish or stop.
+   A finished job is released; a stopped one stays in the table as a
+   background job.
+   @param job The job.
+   @return Exit status of the job (128 + signal if it stopped).
+ */
+int ush_job_wait(struct ush_job *job)
+{
+  struct rusage usage;
+  int status = 0;
+  USH_TRACE_BEGIN(start);
+
+  while(job->state == USH_JOB_RUNNING){
+    pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+
+    if(pid > 0){
+      ush_job_update(pid, status, &usage);
+    }
+    else if(errno != EINTR){
+      //No children left: nothing more will be reported for this job.
+      for (size_t i = 0; i < job->num_procs; i++){
+        job->procs[i].state = USH_JOB_DONE;
+      }
+      job->state = USH_JOB_DONE;
+    }
+  }
+  USH_TRACE_END(USH_TR_WAIT, start);
+
+  if(job->foreground){
+    //Back to the shell, with its own modes if the job has left its own.
+    job->foreground = 0;
+    tcsetpgrp(ush_tty_fd, ush_shell_pgid);
+    if(job->state == USH_JOB_STOPPED){
+      job->has_tmodes = (tcgetattr(ush_tty_fd, &job->tmodes) == 0);
+      tcsetattr(ush_tty_fd, TCSADRAIN, &ush_shell_tmodes);
+    }
+    for (size_t i = 0; i < job->num_procs; i++){
+      if(job->procs[i].state == USH_JOB_DONE && WIFSIGNALED(job->procs[i].status) && WTERMSIG(job->procs[i].status) == SIGINT){
+        //As if Ctrl-C had been typed at the shell.
+        ush_interrupted = 1;
+      }
+    }
+  }
+  if(job->state == USH_JOB_STOPPED){
+    job->background = 1;
+    job->reported_state = USH_JOB_STOPPED;
+    current_job = job->id;
+    ush_out_str("\n", 1);
+    ush_job_print(job);
+    ush_out_flush();
+    for (size_t i = 0; i < job->num_procs; i++){
+      if(job->procs[i].state == USH_JOB_STOPPED){
+        return 128 + WSTOPSIG(job->procs[i].status);
+      }
+    }
+    return 128 + SIGTSTP;
+  }
+
+  status = ush_job_status(job);
+  ush_job_release(job);
+  return status;
+}
+
+/**
+   @brief Continue a stopped job.
+   @param job The job.
+ */
+void ush_job_continue(struct ush_job *job)
+{
+  if(job->state != USH_JOB_STOPPED){
+    return;
+  }
+  if(job->pgid > 0){
+    killpg(job->pgid, SIGCONT);
+  }
+  for (size_t i = 0; i < job->num_procs; i++){
+    if(job->procs[i].state == USH_JOB_STOPPED){
+      if(job->pgid <= 0){
+        kill(job->procs[i].pid, SIGCONT);
+      }
+      job->procs[i].state = USH_JOB_RUNNING;
+    }
+  }
+  job->state = job->reported_state = USH_JOB_RUNNING;
+}
+
+/**
+   @brief Find the job named by a job specification.
+   @param spec "%n", "n", "%%", "%+" or NULL for the current job.
+   @param name Builtin name, for error messages.
+   @return The job, or NULL (error already reported).
+ */
+struct ush_job* ush_job_lookup(const char *spec, const char *name)
+{
+  long id = current_job;
+
+  if(spec != NULL && strcmp(spec, "%%") != 0 && strcmp(spec, "%+") != 0){
+    const char *digits = spec + (spec[0] == '%');
+    char *end;
+
+    id = strtol(digits, &end, 10);
+    if(*end != '\0' || end == digits){
+      id = 0;
+    }
+  }
+  if(id <= 0 || (size_t)id > job_table_size || job_table[id - 1] == NULL || !job_table[id - 1]->background){
+    fprintf(stderr, "ush: %s: %s: no such job\n", name, spec ? spec : "current");
+    return NULL;
+  }
+  return job_table[id - 1];
+}
+
+/**
+   @brief Builtin command: list background jobs.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int ush_jobs(char **args)
+{
+  for (size_t i = 0; i < job_table_size; i++){
+    struct ush_job *job = job_table[i];
+
+    if(job != NULL && job->background){
+      ush_job_print(job);
+      job->reported_state = job->state;
+      //Finished jobs have been reported now.
+      if(job->state == USH_JOB_DONE){
+        ush_job_release(job);
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+   @brief Builtin command: continue a job in the foreground and wait for it.
+   @param args List of args.  args[0] is "fg".  args[1] is the job (default: current).
+   @return Always returns 1, to continue executing.
+ */
+int ush_fg(char **args)
+{
+  struct ush_job *job = ush_job_lookup(args[1], "fg");
+
+  if(job == NULL){
+    ush_last_status = 1;
+    return 1;
+  }
+  ush_out_printf("%s\n", job->text);
+  ush_out_flush();
+  //The terminal first, so that it does not wake up in the background.
+  ush_job_terminal(job);
+  ush_job_continue(job);
+  ush_last_status = ush_job_wait(job);
+  return 1;
+}
+
+/**
+   @brief Builtin command: continue a stopped job in the background.
+   @param args List of args.  args[0] is "bg".  args[1] is the job (default: current).
+   @return Always returns 1, to continue executing.
+ */
+int ush_bg(char **args)
+{
+  struct ush_job *job = ush_job_lookup(args[1], "bg");
+
+  if(job == NULL){
+    ush_last_status = 1;
+    return 1;
+  }
+  ush_job_continue(job);
+  ush_out_printf("[%d]+ %s &\n", job->id, job->text);
+  return 1;
+}
+
+/**
+   @brief Builtin command: wait for background jobs.
+   @param args List of args.  args[0] is "wait".  Further args name jobs
+   (%n) or pids; without them every running background job is waited for.
+   @return Always returns 1, to continue executing.
+ */
+int ush_wait(char **args)
+{
+  ush_last_status = 0;
+  if(args[1] == NULL){
+    for (size_t i = 0; i < job_table_size; i++){
+      struct ush_job *job = job_table[i];
+
+      if(job != NULL && job->background && job->state != USH_JOB_STOPPED){
+        ush_last_status = ush_job_wait(job);
+      }
+    }
+    return 1;
+  }
+
+  for (int i = 1; args[i] != NULL; i++){
+    struct ush_job *job = NULL;
+
+    if(args[i][0] == '%'){
+      job = ush_job_lookup(args[i], "wait");
+    }
+    else{
+      pid_t pid = atoi(args[i]);
+
+      for (size_t j = 0; j < job_table_size && job == NULL; j++){
+        for (size_t k = 0; job_table[j] != NULL && k < job_table[j]->num_procs; k++){
+          if(job_table[j]->procs[k].pid == pid){
+            job = job_table[j];
+          }
+        }
+      }
+      if(job == NULL){
+        fprintf(stderr, "ush: wait: pid %s is not a child of this shell\n", args[i]);
+      }
+    }
+    ush_last_status = (job != NULL) ? ush_job_wait(job) : 127;
+  }
+  return 1;
+}
+
+/**
+  @brief Launch a program and wait for it to terminate.
+  @param args Null terminated list of arguments (including program).
+  @param fds Descriptors for the child's stdin/stdout/stderr, or NULL to inherit.
+  @return Always returns 1, to continue execution.
+ */
+int ush_launch(char **args, const int *fds)
+{
+  struct ush_job *job = ush_job_new(args[0], 0);
+  pid_t pid = ush_spawn(args, fds);
+
+  if(pid < 0){
+    ush_job_release(job);
+    ush_last_status = 127;
+  }
+  else{
+    //Parent Process
+    //Waiting for this child (not just any child) to terminate.
+    ush_job_add_process(job, pid, args[0]);
+    ush_last_status = ush_job_wait(job);
+  }
+  return 1;
+}
+
+/**
+   @brief Number of history slots asked for by $HISTSIZE.
+   @return Its value, at most USH_MAX_HISTORY_COUNT, or the default when it
+   is unset or not a positive number.
+ */
+size_t ush_histsize()
+{
+  const char *value = ush_var_get("HISTSIZE");
+  long size = (value != NULL) ? atol(value) : 0;
+
+  if(size <= 0){
+    return USH_DEFAULT_HISTORY_COUNT;
+  }
+  return (size > USH_MAX_HISTORY_COUNT) ? USH_MAX_HISTORY_COUNT : (size_t)size;
+}
+
+/**
+ * @brief Adds input to history.  The ring follows $HISTSIZE from here,
+ * before the line runs, so a HISTSIZE given to one command only never
+ * touches it.
+ * @param line The input string
+ */
+void add_to_history_util(char *line)
+{
+  size_t len = strlen(line);
+  size_t size = ush_histsize();
+
+  if(size != history_size){
+    ush_history_resize(size);
+  }
+
+  if(ush_opt_ignoredups && ush_digest_find(ush_strhash(line))->count != 0){
+    return;
+  }
+  ush_histfile_append(ush_history_store(line, len), len);
+}
+
+/**
+   @brief Calls shell built-in or launch program. Used to execute internal and external commands.
+   @param args Null terminated list of arguments.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_execute(char **args)
+{
+  if(args[0] == NULL){
+    //Empty Command
+    return 1;
+  }
+
+  const struct ush_builtin *builtin = ush_find_builtin(args[0]);
+
+  if(builtin != NULL){
+    //Command entered is Internal Command
+    return ush_call_builtin(builtin, args);
+  }
+  //Command entered is External Command
+  return ush_launch(args, NULL);
+}
+
+/**
+ * Buffered line reader over a file descriptor.  Lines are returned in place in
+ * the reader's buffer, and the reader knows whether a complete line is already
+ * buffered, so the shell only waits on the descriptor when it has to.
+ */
+#define USH_READ_CHUNK 4096
+
+#define USH_SCRIPT_READ_CHUNK 65536
+
+struct ush_reader {
+  int fd;
+  char *buf;
+  size_t capacity;
+  size_t start;
+  size_t end;
+  int eof;
+  size_t chunk;
+  size_t mapped;
+};
+
+struct ush_reader stdin_reader = { 0, NULL, 0, 0, 0, 0, USH_READ_CHUNK, 0 };
+
+/**
+ * @brief Wait until a descriptor is readable, reaping children meanwhile.
+ * Background jobs are collected as soon as SIGCHLD arrives instead of being
+ * polled for.
+ * @param fd The descriptor.
+ */
+void ush_wait_input(int fd)
+{
+  struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { ush_sigchld_fd, POLLIN, 0 } };
+
+  for (;;){
+    if(poll(pfd, (ush_sigchld_fd >= 0) ? 2 : 1, -1) < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return;
+    }
+    if(ush_sigchld_fd >= 0 && (pfd[1].revents & POLLIN)){
+      ush_reap_children();
+    }
+    if(pfd[0].revents != 0){
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Read a line from a reader.
+ * @param reader The reader.
+ * @return The line without its newline, valid until the next call, or NULL at
+ * end of input.
+ */
+char* ush_reader_line(struct ush_reader *reader)
+{
+  for (;;){
+    char *start = reader->buf + reader->start;
+    char *newline = (reader->end > reader->start) ? memchr(start, '\n', reader->end - reader->start) : NULL;
+    ssize_t n;
+
+    if(newline != NULL){
+      *newline = '\0';
+      reader->start = newline + 1 - reader->buf;
+      return start;
+    }
+    if(reader->eof){
+      if(reader->start == reader->end){
+        return NULL;
+      }
+      //Last line without a newline.
+      reader->buf[reader->end] = '\0';
+      reader->start = reader->end;
+      return start;
+    }
+
+    if(reader->start > 0){
+      memmove(reader->buf, start, reader->end - reader->start);
+      reader->end -= reader->start;
+      reader->start = 0;
+    }
+    if(reader->capacity - reader->end < reader->chunk + 1){
+      reader->capacity = (reader->capacity == 0) ? 2 * reader->chunk : 2 * reader->capacity;
+      reader->buf = ush_realloc(reader->buf, reader->capacity);
+    }
+
+    if(ush_interactive){
+      ush_wait_input(reader->fd);
+    }
+    n = read(reader->fd, reader->buf + reader->end, reader->capacity - reader->end - 1);
+    if(n > 0){
+      reader->end += n;
+    }
+    else if(n == 0 || errno != EINTR){
+      reader->eof = 1;
+    }
+  }
+}
+
+/**
+ * @brief Make a reader serve the lines of a string.
+ * @param reader The reader.
+ * @param str The string; it is modified in place and must stay valid.
+ */
+void ush_reader_string(struct ush_reader *reader, char *str)
+{
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = -1;
+  reader->buf = str;
+  reader->end = strlen(str);
+  reader->capacity = reader->end + 1;
+  reader->eof = 1;
+}
+
+/**
+ * @brief Make a reader serve the lines of a file, mapped into memory at once.
+ * The file is mapped privately just below an anonymous page, so lines can be
+ * terminated in place, even the last one, without reading or copying the
+ * file.  Files that cannot be mapped are read in large chunks instead.
+ * @param reader The reader.
+ * @param path The file.
+ * @return 0 on success, -1 on failure (errno set).
+ */
+int ush_reader_file(struct ush_reader *reader, const char *path)
+{
+  struct stat sb;
+  long page = sysconf(_SC_PAGESIZE);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = fd;
+  reader->chunk = USH_SCRIPT_READ_CHUNK;
+  if(fd < 0){
+    return -1;
+  }
+  if(fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0){
+    size_t size = sb.st_size;
+    size_t span = (size + page) & ~(size_t)(page - 1);
+    char *base = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(base != MAP_FAILED){
+      if(mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED){
+        close(fd);
+        reader->fd = -1;
+        reader->buf = base;
+        reader->end = size;
+        reader->capacity = span;
+        reader->mapped = span;
+        reader->eof = 1;
+        return 0;
+      }
+      munmap(base, span);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Release what a reader holds (the stdin reader is never closed).
+ * @param reader The reader.
+ */
+void ush_reader_close(struct ush_reader *reader)
+{
+  if(reader->mapped){
+    munmap(reader->buf, reader->mapped);
+  }
+  if(reader->fd >= 0){
+    close(reader->fd);
+  }
+}
+
+#define USH_TOK_DELIM " \t\r\a"
+
+/**
+ * Kinds of token produced by the lexer.
+ */
+enum ush_token_kind {
+  USH_TOK_WORD, USH_TOK_PIPE, USH_TOK_AMP,
+  //Separators of lists.
+  USH_TOK_SEMI, USH_TOK_AND_IF, USH_TOK_OR_IF, USH_TOK_NEWLINE,
+  //Around the name of a function being defined.
+  USH_TOK_LPAREN, USH_TOK_RPAREN,
+  //Redirections.
+  USH_TOK_IN, USH_TOK_OUT, USH_TOK_APPEND, USH_TOK_ERR_OUT, USH_TOK_ERR_APPEND,
+  USH_TOK_ERR_TO_OUT, USH_TOK_HERESTRING
+};
+
+/**
+ * Operators recognised outside quotes.  Longer operators must come before
+ * their prefixes.  An operator also ends the word in front of it, except for
+ * the ones starting with a file descriptor number, which must start a word.
+ */
+struct ush_operator {
+  const char *text;
+  int kind;
+};
+
+const struct ush_operator operators[] = {
+  { "<<<",  USH_TOK_HERESTRING },
+  { "2>&1", USH_TOK_ERR_TO_OUT },
+  { "2>>",  USH_TOK_ERR_APPEND },
+  { "2>",   USH_TOK_ERR_OUT },
+  { ">>",   USH_TOK_APPEND },
+  { "&&",   USH_TOK_AND_IF },
+  { "||",   USH_TOK_OR_IF },
+  { "|",    USH_TOK_PIPE },
+  { "&",    USH_TOK_AMP },
+  { ";",    USH_TOK_SEMI },
+  { "\n",   USH_TOK_NEWLINE },
+  { "(",    USH_TOK_LPAREN },
+  { ")",    USH_TOK_RPAREN },
+  { ">",    USH_TOK_OUT },
+  { "<",    USH_TOK_IN },
+};
+
+#define USH_NUM_OPERATORS (sizeof(operators) / sizeof(operators[0]))
+
+/**
+ * A token: where it lies in the line buffer and what it is.
+ */
+struct ush_token {
+  size_t offset;
+  size_t length;
+  int kind;
+};
+
+/**
+ * Lexer state.  Everything the lexer needs lives here (no hidden statics like
+ * strtok), so separate lexers may run at the same time; the token array is
+ * grown on demand and reused for every line.  open_quote is the quote (the
+ * backslash, or ')' for a command substitution) left open at the end of the
+ * last line lexed, if any: the command goes on on the next line.
+ */
+struct ush_lexer {
+  struct ush_token *tokens;
+  size_t count;
+  size_t capacity;
+  char open_quote;
+};
+
+struct ush_lexer session_lexer;
+
+/**
+   @brief Check for an operator at a position in the line.
+   @param str Position in the line.
+   @param in_word Nonzero if str is inside a word rather than at its start.
+   @return The operator found there, or NULL.
+ */
+const struct ush_operator* ush_match_operator(const char *str, int in_word)
+{
+  //Most characters start no operator.
+  if(*str == '\0' || strchr("<>2&|;\n()", *str) == NULL){
+    return NULL;
+  }
+  for (size_t i = 0; i < USH_NUM_OPERATORS; i++){
+    size_t len = strlen(operators[i].text);
+
+    if(in_word && operators[i].text[0] >= '0' && operators[i].text[0] <= '9'){
+      continue;
+    }
+    if(strncmp(str, operators[i].text, len) == 0){
+      return &operators[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+   @brief Printable form of a token kind, for error messages.
+   @param kind Token kind.
+   @return The operator text, or "newline" for a newline or the end of the line.
+ */
+const char* ush_token_text(int kind)
+{
+  for (size_t i = 0; i < USH_NUM_OPERATORS; i++){
+    if(operators[i].kind == kind && kind != USH_TOK_NEWLINE){
+      return operators[i].text;
+    }
+  }
+  return "newline";
+}
+
+/**
+   @brief Append a token to the lexer's token array.
+   @param lexer The lexer.
+   @param offset Offset of the token in the line.
+   @param length Length of the token.
+   @param kind Kind of the token.
+ */
+void ush_push_token(struct ush_lexer *lexer, size_t offset, size_t length, int kind)
+{
+  lexer->tokens = ush_grow_array(lexer->tokens, &lexer->capacity, lexer->count + 1, sizeof(struct ush_token));
+  lexer->tokens[lexer->count].offset = offset;
+  lexer->tokens[lexer->count].length = length;
+  lexer->tokens[lexer->count].kind = kind;
+  lexer->count++;
+}
+
+/**
+   @brief Check for the start of a command substitution.
+   @param r Position in a word.
+   @return Nonzero if a $( or a backquote starts there.
+ */
+int ush_subst_start(const char *r)
+{
+  return *r == '`' || (*r == '$' && r[1] == '(');
+}
+
+/**
+   @brief Find the end of a quoted part of a word, or of a command substitution.
+   Command substitutions may hold quotes and command substitutions of their
+   own, including inside double quotes; $( ... ) ends at the ) that balances it.
+   @param r Points at the opening ', ", ` or $(.
+   @return Position just past the closing character, or NULL if the text
+   ends first.
+ */
+const char* ush_skip_quoted(const char *r)
+{
+  int depth = 0;
+
+  if(*r == '\''){
+    r = strchr(r + 1, '\'');
+    return (r != NULL) ? r + 1 : NULL;
+  }
+  if(*r == '"' || *r == '`'){
+    char quote = *r++;
+
+    while(*r != quote){
+      if(*r == '\0'){
+        return NULL;
+      }
+      if(*r == '\\' && r[1] != '\0'){
+        r += 2;
+      }
+      else if(quote == '"' && ush_subst_start(r)){
+        if((r = ush_skip_quoted(r)) == NULL){
+          return NULL;
+        }
+      }
+      else{
+        r++;
+      }
+    }
+    return r + 1;
+  }
+  for (r += 2; *r != ')' || depth > 0; ){
+    if(*r == '\0'){
+      return NULL;
+    }
+    if(*r == '\\' && r[1] != '\0'){
+      r += 2;
+    }
+    else if(*r == '\'' || *r == '"' || ush_subst_start(r)){
+      if((r = ush_skip_quoted(r)) == NULL){
+        return NULL;
+      }
+    }
+    else{
+      depth += (*r == '(') - (*r == ')');
+      r++;
+    }
+  }
+  return r + 1;
+}
+
+/**
+   @brief Tokenize a line.
+   The line is not modified: each word token covers its raw text, quotes and
+   backslashes included, and is only dequoted (and later expanded) when the
+   command runs; see ush_expand_word().  The lexer checks that the quotes are
+   balanced.  Single quotes keep everything literally; inside double quotes a
+   backslash only escapes $ ` " \ and newline; elsewhere it escapes any
+   character.  A command substitution, $( ... ) or ` ... `, is part of the
+   word it is in, whatever it holds.  Newlines (of a command that goes on
+   over several lines) are tokens of their own.
+   @param lexer Lexer whose token array receives the tokens.
+   @param line The input line.
+   @return Number of tokens, or -1 if a quote or a command substitution is
+   left open or the line ends with a backslash (see open_quote).
+ */
+long ush_lex(struct ush_lexer *lexer, const char *line)
+{
+  const struct ush_operator *op;
+  const char *r = line;
+
+  lexer->count = 0;
+  lexer->open_quote = '\0';
+  for (;;){
+    const char *start;
+
+    while(*r != '\0' && strchr(USH_TOK_DELIM, *r) != NULL){
+      r++;
+    }
+    if(*r == '\0'){
+      return lexer->count;
+    }
+    if((op = ush_match_operator(r, 0)) != NULL){
+      ush_push_token(lexer, r - line, strlen(op->text), op->kind);
+      r += strlen(op->text);
+      continue;
+    }
+
+    start = r;
+    while(*r != '\0' && strchr(USH_TOK_DELIM, *r) == NULL && ush_match_operator(r, 1) == NULL){
+      if(*r == '\'' || *r == '"' || ush_subst_start(r)){
+        const char *end = ush_skip_quoted(r);
+
+        if(end == NULL){
+          lexer->open_quote = (*r == '$') ? ')' : *r;
+          return -1;
+        }
+        r = end;
+        continue;
+      }
+      else if(*r == '\\'){
+        if(r[1] == '\0'){
+          lexer->open_quote = '\\';
+          return -1;
+        }
+        r++;
+      }
+      r++;
+    }
+    ush_push_token(lexer, start - line, r - start, USH_TOK_WORD);
+  }
+}
+
+/**
+ * Positional parameters: $1, $2... are argv[0], argv[1]... (null
+ * terminated); $0 is the name of the script, or of the shell.  A function
+ * call has its own for the time it runs.
+ */
+struct ush_params {
+  char **argv;
+  size_t argc;
+};
+
+char *ush_no_params[] = { NULL };
+struct ush_params params = { ush_no_params, 0 };
+char *ush_arg0 = "ush";
+
+/**
+   @brief Get a positional parameter.
+   @param n Its number.
+   @return Its value, or NULL if it is not set.
+ */
+const char* ush_param(size_t n)
+{
+  if(n == 0){
+    return ush_arg0;
+  }
+  return (n <= params.argc) ? params.argv[n - 1] : NULL;
+}
+
+/**
+ * Scratch buffer words are expanded in before being copied to an arena.
+ * split_ranges holds the parts of it that come from unquoted command
+ * substitutions, as (offset, length) pairs: only those are split into fields
+ * (see ush_expand_fields()).  word_quoted is set when the word has quotes of
+ * its own, so it stands for an argument even if it expands to nothing.
+ */
+char *word_buf = NULL;
+size_t word_buf_capacity = 0;
+size_t *split_ranges = NULL;
+size_t split_count = 0;
+size_t split_capacity = 0;
+int word_quoted = 0;
+
+//Command substitution runs commands, which come further on.
+char* ush_substitute(const char *text, size_t *len);
+
+/**
+   @brief Append text to the word being expanded.
+   @param len Length of the word so far, updated.
+   @param str The text.
+   @param n Its length.
+ */
+void ush_word_append(size_t *len, const char *str, size_t n)
+{
+  word_buf = ush_grow_array(word_buf, &word_buf_capacity, *len + n + 1, 1);
+  memcpy(word_buf + *len, str, n);
+  *len += n;
+}
+
+/**
+   @brief Append quoted text to the word being expanded.
+   @param len Length of the word so far, updated.
+   @param str The text.
+   @param n Its length.
+   @param pattern Nonzero when building a glob pattern: pattern characters
+   are then escaped, so they only match themselves.
+ */
+void ush_word_append_quoted(size_t *len, const char *str, size_t n, int pattern)
+{
+  if(!pattern){
+    ush_word_append(len, str, n);
+    return;
+  }
+  for (size_t i = 0; i < n; i++){
+    if(strchr("*?[]\\", str[i]) != NULL){
+      ush_word_append(len, "\\", 1);
+    }
+    ush_word_append(len, str + i, 1);
+  }
+}
+
+/**
+   @brief Expand a parameter reference: $NAME, ${NAME}, $? or $$, or a
+   positional parameter: $0 to $9, ${N}, $# (their count), $@ or $* (all of
+   them, separated by spaces).
+   @param r Points at the '$'; moved past the reference.
+   @param len Length of the word so far, updated.
+   @param pattern Nonzero to escape pattern characters in the value (when
+   building a glob pattern from a quoted reference).
+ */
+void ush_expand_dollar(const char **r, size_t *len, int pattern)
+{
+  const char *p = *r + 1;
+  const char *value = NULL;
+  char num[24];
+  size_t name_len;
+
+  if(*p == '?' || *p == '$' || *p == '#'){
+    snprintf(num, sizeof(num), "%d", (*p == '?') ? ush_last_status : (*p == '$') ? (int)getpid() : (int)params.argc);
+    value = num;
+    p++;
+  }
+  else if(*p >= '0' && *p <= '9'){
+    value = ush_param(*p - '0');
+    p++;
+  }
+  else if(*p == '@' || *p == '*'){
+    for (size_t i = 0; i < params.argc; i++){
+      if(i > 0){
+        ush_word_append(len, " ", 1);
+      }
+      ush_word_append_quoted(len, params.argv[i], strlen(params.argv[i]), pattern);
+    }
+    p++;
+  }
+  else if(p[0] == '{' && p[1] >= '0' && p[1] <= '9' && p[1 + strspn(p + 1, "0123456789")] == '}'){
+    value = ush_param(strtoul(p + 1, NULL, 10));
+    p += strspn(p + 1, "0123456789") + 2;
+  }
+  else{
+    int braced = (*p == '{');
+    char name[256];
+
+    name_len = ush_var_name_len(p + braced);
+    if(name_len == 0 || name_len >= sizeof(name) || (braced && p[1 + name_len] != '}')){
+      //Not a reference: keep the '$'.
+      ush_word_append(len, "$", 1);
+      (*r)++;
+      return;
+    }
+    memcpy(name, p + braced, name_len);
+    name[name_len] = '\0';
+    value = ush_var_get(name);
+    p += braced + name_len + braced;
+  }
+  if(value != NULL){
+    ush_word_append_quoted(len, value, strlen(value), pattern);
+  }
+  *r = p;
+}
+
+/**
+   @brief Expand a command substitution: run the commands and put their
+   output, without its trailing newlines, in the word.
+   The commands expand words of their own, so the word so far is set aside
+   while they run.
+   @param r Points at the $( or backquote; moved past the substitution.
+   @param len Length of the word so far, updated.
+   @param quoted Nonzero inside double quotes; otherwise the output is to be
+   split into fields.
+   @param pattern Nonzero to escape pattern characters in the output (when
+   building a glob pattern).
+ */
+void ush_expand_subst(const char **r, size_t *len, int quoted, int pattern)
+{
+  const char *start = *r;
+  const char *end = ush_skip_quoted(start);
+  char *prefix = ush_arena_strndup(&cmd_arena, word_buf ? word_buf : "", *len);
+  size_t num_ranges = split_count;
+  size_t *ranges = ush_arena_alloc(&cmd_arena, (num_ranges + 1) * sizeof(size_t));
+  int has_quotes = word_quoted;
+  char *text;
+  char *output;
+  size_t n = 0;
+
+  if(num_ranges > 0){
+    memcpy(ranges, split_ranges, num_ranges * sizeof(size_t));
+  }
+  if(*start == '`'){
+    //Inside backquotes a backslash only escapes $ ` and itself.
+    text = ush_arena_alloc(&cmd_arena, end - start - 1);
+    for (const char *p = start + 1; p < end - 1; p++){
+      if(*p == '\\' && strchr("$`\\", p[1]) != NULL){
+        p++;
+      }
+      text[n++] = *p;
+    }
+    text[n] = '\0';
+  }
+  else{
+    text = ush_arena_strndup(&cmd_arena, start + 2, end - start - 3);
+  }
+  output = ush_substitute(text, &n);
+
+  word_buf = ush_grow_array(word_buf, &word_buf_capacity, *len + 1, 1);
+  memcpy(word_buf, prefix, *len);
+  split_ranges = ush_grow_array(split_ranges, &split_capacity, num_ranges + 2, sizeof(size_t));
+  if(num_ranges > 0){
+    memcpy(split_ranges, ranges, num_ranges * sizeof(size_t));
+  }
+  split_count = num_ranges;
+  word_quoted = has_quotes;
+  if(!quoted && !pattern){
+    split_ranges[split_count++] = *len;
+    split_ranges[split_count++] = n;
+  }
+  ush_word_append_quoted(len, output, n, pattern);
+  *r = end;
+}
+
+/**
+   @brief Turn the raw text of a word into the argument it stands for.
+   Quotes and backslashes are removed, $ references expanded, except inside
+   single quotes, and command substitutions replaced by the output of their
+   commands.  Expansions are not split into several words here; see
+   ush_expand_fields().
+   @param arena Arena the result is allocated from, when it differs from raw.
+   @param raw The word as written, with balanced quotes (see ush_lex()).
+   @param pattern Nonzero to build a glob pattern instead: quoted pattern
+   characters are then kept escaped with a backslash.
+   @return The argument; raw itself when there is nothing to remove or expand.
+ */
+char* ush_expand(struct ush_arena *arena, const char *raw, int pattern)
+{
+  const char *r = raw;
+  size_t len = 0;
+
+  split_count = 0;
+  word_quoted = 0;
+  if(strpbrk(raw, "'\"\\$`") == NULL){
+    return (char*)raw;
+  }
+  while(*r != '\0'){
+    const char *start = r;
+
+    if(*r == '\''){
+      word_quoted = 1;
+      for (start = ++r; *r != '\''; r++)
+        ;
+      ush_word_append_quoted(&len, start, r - start, pattern);
+      r++;
+    }
+    else if(*r == '"'){
+      word_quoted = 1;
+      for (r++; *r != '"'; ){
+        if(ush_subst_start(r)){
+          ush_expand_subst(&r, &len, 1, pattern);
+          continue;
+        }
+        if(*r == '$'){
+          ush_expand_dollar(&r, &len, pattern);
+          continue;
+        }
+        if(*r == '\\' && strchr("$`\"\\\n", r[1]) != NULL){
+          r++;
+        }
+        ush_word_append_quoted(&len, r++, 1, pattern);
+      }
+      r++;
+    }
+    else if(ush_subst_start(r)){
+      ush_expand_subst(&r, &len, 0, pattern);
+    }
+    else if(*r == '$'){
+      ush_expand_dollar(&r, &len, 0);
+    }
+    else if(*r == '\\' && r[1] != '\0'){
+      r++;
+      if(*r == '\n'){
+        //Line continuation.
+        r++;
+      }
+      else{
+        ush_word_append_quoted(&len, r++, 1, pattern);
+      }
+    }
+    else{
+      for (r++; *r != '\0' && strchr("'\"\\$`", *r) == NULL; r++)
+        ;
+      ush_word_append(&len, start, r - start);
+    }
+  }
+  return ush_arena_strndup(arena, word_buf ? word_buf : "", len);
+}
+
+/**
+   @brief Turn the raw text of a word into the argument it stands for.
+   @param arena Arena the result is allocated from, when it differs from raw.
+   @param raw The word as written (see ush_expand()).
+   @return The argument.
+ */
+char* ush_expand_word(struct ush_arena *arena, const char *raw)
+{
+  return ush_expand(arena, raw, 0);
+}
+
+/**
+   @brief Check whether a word is subject to filename expansion.
+   @param raw The word as written.
+   @return Nonzero if it contains an unquoted *, ? or [...].
+ */
+int ush_word_is_pattern(const char *raw)
+{
+  if(strpbrk(raw, "*?[") == NULL){
+    return 0;
+  }
+  for (const char *r = raw; *r != '\0'; r++){
+    if(*r == '\'' || *r == '"' || ush_subst_start(r)){
+      //What a command substitution prints is not a pattern either.
+      r = ush_skip_quoted(r) - 1;
+    }
+    else if(*r == '\\' && r[1] != '\0'){
+      r++;
+    }
+    else if(*r == '*' || *r == '?' || (*r == '[' && strchr(r + 1, ']') != NULL)){
+      //A [ that opens no bracket expression stands for itself (the "[" command).
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * A redirection: the operator's token kind and the raw word after it (NULL for 2>&1).
+ */
+struct ush_redirect {
+  int kind;
+  char *target;
+};
+
+/**
+ * Kinds of command.  A simple command is words and redirections; the others
+ * are compound commands made of lists, and may be redirected as a whole:
+ *   if cond; then body; [elif ...;] [else orelse;] fi   (an elif is an if in orelse)
+ *   while cond; do body; done      until cond; do body; done
+ *   for name [in words]; do body; done                  (no words: "$@")
+ *   { body; }
+ * A function definition, name() compound, has the compound as its body.
+ */
+enum ush_command_kind {
+  USH_CMD_SIMPLE, USH_CMD_IF, USH_CMD_WHILE, USH_CMD_UNTIL, USH_CMD_FOR, USH_CMD_GROUP, USH_CMD_FUNCDEF
+};
+
+struct ush_list;
+
+/**
+ * A command.  The words of a simple command are kept as written, the first
+ * num_assigns of them being NAME=value assignments; ush_command_argv()
+ * expands the others.  name is the variable of a for loop, whose words are
+ * the values, or the name of a function; a definition also keeps its text
+ * (see ush_define_function()).
+ */
+struct ush_command {
+  int kind;
+  char **words;
+  size_t num_assigns;
+  struct ush_redirect *redirects;
+  size_t num_redirects;
+  char *name;
+  struct ush_list *cond;
+  struct ush_list *body;
+  struct ush_list *orelse;
+  char *text;
+};
+
+/**
+ * How a pipeline of a list follows the one before it: always (after ";",
+ * "&", a newline or as the first one), only if that succeeded ("&&"), or
+ * only if it failed ("||").
+ */
+enum ush_connector { USH_LIST_SEQ, USH_LIST_AND, USH_LIST_OR };
+
+/**
+ * Commands connected by pipes.
+ */
+struct ush_pipeline {
+  struct ush_command *commands;
+  size_t count;
+  int background;
+  int timed;
+  int connector;
+  char *text;
+};
+
+/**
+ * Pipelines separated by ";", "&", "&&", "||" and newlines: what a line
+ * parses to, and the parts of compound commands.
+ */
+struct ush_list {
+  struct ush_pipeline *pipelines;
+  size_t count;
+};
+
+/**
+   @brief Report a syntax error at a token.
+   @param kind Kind of the unexpected token.
+ */
+void ush_syntax_error(int kind)
+{
+  fprintf(stderr, "ush: syntax error near unexpected token `%s'\n", ush_token_text(kind));
+}
+
+/**
+ * Parse cache.  Parsed lines live in their own arena, keyed by the hash of
+ * their text, so a line that comes round again (a script run in a loop, a
+ * repeated command) is looked up instead of being lexed and parsed again.
+ * The executor only ever reads the parsed form; loop bodies run from it
+ * without being parsed again.  The cache is dropped as a whole once it
+ * outgrows its limit, between commands, when nothing parsed is in use.
+ */
+#define USH_AST_BUCKETS 256
+#define USH_AST_CACHE_LIMIT (1 << 20)
+
+struct ush_ast_entry {
+  unsigned long hash;
+  char *source;
+  struct ush_list *list;
+  struct ush_ast_entry *next;
+};
+
+struct ush_ast_entry *ast_cache[USH_AST_BUCKETS];
+
+/**
+   @brief Drop the parse cache if it has grown past its limit.
+   Only call this when no parsed pipeline is running.
+ */
+void ush_ast_cache_trim()
+{
+  if(ast_arena.in_use <= USH_AST_CACHE_LIMIT){
+    return;
+  }
+  ush_arena_reset(&ast_arena);
+  memset(ast_cache, 0, sizeof(ast_cache));
+  ast_cache_entries = 0;
+}
+
+/**
+ * Growable stack the parser collects the items of a list, pipeline or
+ * command on, before copying them to the arena in one piece.  A nested
+ * construct pushes above the items of the one around it and pops back
+ * before that goes on, so the items of each stay together.
+ */
+struct ush_scratch {
+  char *buf;
+  size_t len;
+  size_t capacity;
+};
+
+struct ush_scratch parse_pipelines, parse_commands, parse_words, parse_redirects;
+
+/**
+   @brief Push an item on a scratch stack.
+   @param st The stack.
+   @param item The item.
+   @param size Its size.
+ */
+void ush_scratch_push(struct ush_scratch *st, const void *item, size_t size)
+{
+  st->buf = ush_grow_array(st->buf, &st->capacity, st->len + size, 1);
+  memcpy(st->buf + st->len, item, size);
+  st->len += size;
+}
+
+/**
+   @brief Pop the items pushed since a point and copy them to an arena.
+   @param st The stack.
+   @param base Length of the stack before they were pushed.
+   @param arena The arena.
+   @return The copy.
+ */
+void* ush_scratch_pop(struct ush_scratch *st, size_t base, struct ush_arena *arena)
+{
+  void *copy = ush_arena_alloc(arena, st->len - base);
+
+  memcpy(copy, st->buf + base, st->len - base);
+  st->len = base;
+  return copy;
+}
+
+/**
+ * Parser state: a recursive descent over the tokens of the line.  depth
+ * counts the compound commands open at the current token.
+ */
+struct ush_parser {
+  const char *line;
+  struct ush_token *tokens;
+  size_t count;
+  size_t pos;
+  struct ush_arena *arena;
+  int depth;
+  int failed;
+  int incomplete;
+};
+
+/**
+   @brief Kind of the current token.
+   @param p The parser.
+   @return The kind, or -1 at the end of the line.
+ */
+int ush_parser_peek(struct ush_parser *p)
+{
+  return (p->pos < p->count) ? p->tokens[p->pos].kind : -1;
+}
+
+/**
+   @brief Check whether the current token is a given word.
+   @param p The parser.
+   @param word The word, typically reserved ("if", "done"...).
+   @return Nonzero if it is.
+ */
+int ush_parser_word(struct ush_parser *p, const char *word)
+{
+  struct ush_token *token = &p->tokens[p->pos];
+
+  return p->pos < p->count && token->kind == USH_TOK_WORD && strlen(word) == token->length
+    && memcmp(p->line + token->offset, word, token->length) == 0;
+}
+
+/**
+   @brief Check whether the current token is a reserved word that ends a list.
+   @param p The parser.
+   @return Nonzero if it is.
+ */
+int ush_parser_closer(struct ush_parser *p)
+{
+  static const char *closers[] = { "then", "elif", "else", "fi", "do", "done", "}" };
+
+  for (size_t i = 0; i < sizeof(closers) / sizeof(closers[0]); i++){
+    if(ush_parser_word(p, closers[i])){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Check whether the current token starts a compound command.
+   @param p The parser.
+   @return Nonzero if it does.
+ */
+int ush_parser_compound(struct ush_parser *p)
+{
+  return ush_parser_word(p, "if") || ush_parser_word(p, "while") || ush_parser_word(p, "until")
+    || ush_parser_word(p, "for") || ush_parser_word(p, "{");
+}
+
+/**
+   @brief Give up at the current token.
+   At the end of the line the command is incomplete: it goes on on the next
+   line, unless that never comes.  Anywhere else it is a syntax error.
+   @param p The parser.
+   @return -1.
+ */
+int ush_parser_fail(struct ush_parser *p)
+{
+  struct ush_token *token = &p->tokens[p->pos];
+
+  if(p->failed){
+    return -1;
+  }
+  p->failed = 1;
+  if(p->pos == p->count){
+    //After |, && or || any line may finish it; an open compound needs its closing words.
+    int kind = (p->pos > 0) ? p->tokens[p->pos - 1].kind : -1;
+
+    p->incomplete = 1 + ((kind == USH_TOK_PIPE || kind == USH_TOK_AND_IF || kind == USH_TOK_OR_IF) ? 0 : p->depth);
+  }
+  else if(token->kind == USH_TOK_WORD){
+    fprintf(stderr, "ush: syntax error near unexpected token `%.*s'\n", (int)token->length, p->line + token->offset);
+  }
+  else{
+    ush_syntax_error(token->kind);
+  }
+  return -1;
+}
+
+/**
+   @brief Skip newline tokens.
+   @param p The parser.
+ */
+void ush_parser_newlines(struct ush_parser *p)
+{
+  while(ush_parser_peek(p) == USH_TOK_NEWLINE){
+    p->pos++;
+  }
+}
+
+/**
+   @brief Consume a reserved word that must come next.
+   @param p The parser.
+   @param word The word.
+   @return 0 on success, -1 on failure.
+ */
+int ush_parser_expect(struct ush_parser *p, const char *word)
+{
+  if(!ush_parser_word(p, word)){
+    return ush_parser_fail(p);
+  }
+  p->pos++;
+  return 0;
+}
+
+/**
+   @brief Make a list of a single command.
+   @param arena Arena to allocate from.
+   @param command The command, copied.
+   @return The list.
+ */
+struct ush_list* ush_list_of(struct ush_arena *arena, const struct ush_command *command)
+{
+  struct ush_list *list = ush_arena_alloc(arena, sizeof(struct ush_list));
+  struct ush_pipeline *pipeline = ush_arena_alloc(arena, sizeof(struct ush_pipeline));
+
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->commands = ush_arena_alloc(arena, sizeof(struct ush_command));
+  *pipeline->commands = *command;
+  pipeline->count = 1;
+  pipeline->text = "";
+  list->pipelines = pipeline;
+  list->count = 1;
+  return list;
+}
+
+int ush_parse_command(struct ush_parser *p, struct ush_command *command);
+
+/**
+   @brief Parse a list, up to the end of the line or a reserved word ending it.
+   @param p The parser.
+   @return The list, or NULL on failure.
+ */
+struct ush_list* ush_parse_list(struct ush_parser *p)
+{
+  size_t base = parse_pipelines.len;
+  int connector = USH_LIST_SEQ;
+  struct ush_list *list;
+
+  ush_parser_newlines(p);
+  while(p->pos < p->count && !ush_parser_closer(p)){
+    struct ush_pipeline pipeline;
+    struct ush_command command;
+    size_t commands_base = parse_commands.len;
+    size_t start = p->tokens[p->pos].offset;
+    struct ush_token *last;
+    int kind;
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.connector = connector;
+    //A leading "time" is a keyword timing the whole pipeline.
+    if(ush_parser_word(p, "time") && p->pos + 1 < p->count && p->tokens[p->pos + 1].kind == USH_TOK_WORD){
+      pipeline.timed = 1;
+      p->pos++;
+    }
+    for (;;){
+      if(ush_parse_command(p, &command) < 0){
+        return NULL;
+      }
+      ush_scratch_push(&parse_commands, &command, sizeof(command));
+      if(ush_parser_peek(p) != USH_TOK_PIPE){
+        break;
+      }
+      p->pos++;
+      ush_parser_newlines(p);
+    }
+    pipeline.count = (parse_commands.len - commands_base) / sizeof(struct ush_command);
+    pipeline.commands = ush_scratch_pop(&parse_commands, commands_base, p->arena);
+    last = &p->tokens[p->pos - 1];
+    pipeline.text = ush_arena_strndup(p->arena, p->line + start, last->offset + last->length - start);
+
+    kind = ush_parser_peek(p);
+    connector = (kind == USH_TOK_AND_IF) ? USH_LIST_AND : (kind == USH_TOK_OR_IF) ? USH_LIST_OR : USH_LIST_SEQ;
+    pipeline.background = (kind == USH_TOK_AMP);
+    ush_scratch_push(&parse_pipelines, &pipeline, sizeof(pipeline));
+    if(kind == USH_TOK_AND_IF || kind == USH_TOK_OR_IF){
+      //Another pipeline must follow.
+      p->pos++;
+      ush_parser_newlines(p);
+      if(p->pos == p->count || ush_parser_closer(p)){
+        ush_parser_fail(p);
+        return NULL;
+      }
+    }
+    else if(kind == USH_TOK_SEMI || kind == USH_TOK_AMP || kind == USH_TOK_NEWLINE){
+      p->pos++;
+      ush_parser_newlines(p);
+    }
+    else if(kind != -1 && !ush_parser_closer(p)){
+      ush_parser_fail(p);
+      return NULL;
+    }
+  }
+
+  list = ush_arena_alloc(p->arena, sizeof(struct ush_list));
+  list->count = (parse_pipelines.len - base) / sizeof(struct ush_pipeline);
+  list->pipelines = ush_scratch_pop(&parse_pipelines, base, p->arena);
+  return list;
+}
+
+/**
+   @brief Parse the list inside a compound command, which may not be empty.
+   @param p The parser.
+   @return The list, or NULL on failure.
+ */
+struct ush_list* ush_parse_body(struct ush_parser *p)
+{
+  struct ush_list *list = ush_parse_list(p);
+
+  if(list != NULL && list->count == 0){
+    ush_parser_fail(p);
+    return NULL;
+  }
+  return list;
+}
+
+/**
+   @brief Parse a redirection operator and its target.
+   @param p The parser, at the operator.
+   @return 0 on success, -1 on failure.
+ */
+int ush_parse_redirect(struct ush_parser *p)
+{
+  struct ush_redirect redirect;
+  struct ush_token *token = &p->tokens[p->pos++];
+
+  redirect.kind = token->kind;
+  redirect.target = NULL;
+  if(token->kind != USH_TOK_ERR_TO_OUT){
+    if(ush_parser_peek(p) != USH_TOK_WORD){
+      return ush_parser_fail(p);
+    }
+    token = &p->tokens[p->pos++];
+    redirect.target = ush_arena_strndup(p->arena, p->line + token->offset, token->length);
+  }
+  ush_scratch_push(&parse_redirects, &redirect, sizeof(redirect));
+  return 0;
+}
+
+/**
+   @brief Parse a simple command: words and redirections.
+   @param p The parser.
+   @param command Receives the command.
+   @return 0 on success, -1 on failure.
+ */
+int ush_parse_simple(struct ush_parser *p, struct ush_command *command)
+{
+  size_t words_base = parse_words.len;
+  size_t redirects_base = parse_redirects.len;
+  size_t num_words = 0;
+  char *end = NULL;
+
+  for (;;){
+    int kind = ush_parser_peek(p);
+
+    if(kind == USH_TOK_WORD){
+      struct ush_token *token = &p->tokens[p->pos++];
+      size_t name_len = ush_var_name_len(p->line + token->offset);
+      char *word = ush_arena_strndup(p->arena, p->line + token->offset, token->length);
+
+      //Words of the form NAME=value in front of the command are assignments.
+      if(num_words == command->num_assigns &&
+         name_len > 0 && name_len < token->length && p->line[token->offset + name_len] == '='){
+        command->num_assigns++;
+      }
+      ush_scratch_push(&parse_words, &word, sizeof(char*));
+      num_words++;
+    }
+    else if(kind >= USH_TOK_IN){
+      if(ush_parse_redirect(p) < 0){
+        return -1;
+      }
+    }
+    else{
+      break;
+    }
+  }
+  if(num_words == 0 && parse_redirects.len == redirects_base){
+    return ush_parser_fail(p);
+  }
+  ush_scratch_push(&parse_words, &end, sizeof(char*));
+  command->words = ush_scratch_pop(&parse_words, words_base, p->arena);
+  command->num_redirects = (parse_redirects.len - redirects_base) / sizeof(struct ush_redirect);
+  command->redirects = ush_scratch_pop(&parse_redirects, redirects_base, p->arena);
+  return 0;
+}
+
+/**
+   @brief Parse the rest of an if (or elif) command, up to and including "fi".
+   @param p The parser, after the "if".
+   @param command Receives the command.
+   @return 0 on success, -1 on failure.
+ */
+int ush_parse_if(struct ush_parser *p, struct ush_command *command)
+{
+  command->kind = USH_CMD_IF;
+  if((command->cond = ush_parse_body(p)) == NULL || ush_parser_expect(p, "then") < 0
+     || (command->body = ush_parse_body(p)) == NULL){
+    return -1;
+  }
+  if(ush_parser_word(p, "elif")){
+    struct ush_command nested;
+
+    p->pos++;
+    memset(&nested, 0, sizeof(nested));
+    if(ush_parse_if(p, &nested) < 0){
+      return -1;
+    }
+    command->orelse = ush_list_of(p->arena, &nested);
+    return 0;
+  }
+  if(ush_parser_word(p, "else")){
+    p->pos++;
+    if((command->orelse = ush_parse_body(p)) == NULL){
+      return -1;
+    }
+  }
+  return ush_parser_expect(p, "fi");
+}
+
+/**
+   @brief Parse the rest of a for loop.
+   @param p The parser, after the "for".
+   @param command Receives the command.
+   @return 0 on success, -1 on failure.
+ */
+int ush_parse_for(struct ush_parser *p, struct ush_command *command)
+{
+  struct ush_token *token = &p->tokens[p->pos];
+
+  command->kind = USH_CMD_FOR;
+  if(ush_parser_peek(p) != USH_TOK_WORD || ush_var_name_len(p->line + token->offset) != token->length){
+    return ush_parser_fail(p);
+  }
+  command->name = ush_arena_strndup(p->arena, p->line + token->offset, token->length);
+  p->pos++;
+  ush_parser_newlines(p);
+  if(ush_parser_word(p, "in")){
+    size_t base = parse_words.len;
+    char *end = NULL;
+
+    for (p->pos++; ush_parser_peek(p) == USH_TOK_WORD; p->pos++){
+      char *word = ush_arena_strndup(p->arena, p->line + p->tokens[p->pos].offset, p->tokens[p->pos].length);
+
+      ush_scratch_push(&parse_words, &word, sizeof(char*));
+    }
+    ush_scratch_push(&parse_words, &end, sizeof(char*));
+    command->words = ush_scratch_pop(&parse_words, base, p->arena);
+    if(ush_parser_peek(p) != USH_TOK_SEMI && ush_parser_peek(p) != USH_TOK_NEWLINE){
+      return ush_parser_fail(p);
+    }
+    p->pos++;
+  }
+  else if(ush_parser_peek(p) == USH_TOK_SEMI){
+    p->pos++;
+  }
+  ush_parser_newlines(p);
+  if(ush_parser_expect(p, "do") < 0 || (command->body = ush_parse_body(p)) == NULL){
+    return -1;
+  }
+  return ush_parser_expect(p, "done");
+}
+
+/**
+   @brief Parse a function definition, name() compound-command.
+   @param p The parser, at the name.
+   @param command Receives the definition.
+   @return 0 on success, -1 on failure.
+ */
+int ush_parse_funcdef(struct ush_parser *p, struct ush_command *command)
+{
+  struct ush_token *name = &p->tokens[p->pos];
+  struct ush_command compound;
+  struct ush_token *last;
+
+  command->kind = USH_CMD_FUNCDEF;
+  command->name = ush_arena_strndup(p->arena, p->line + name->offset, name->length);
+  p->pos += 3;
+  ush_parser_newlines(p);
+  if(!ush_parser_compound(p)){
+    return ush_parser_fail(p);
+  }
+  if(ush_parse_command(p, &compound) < 0){
+    return -1;
+  }
+  command->body = ush_list_of(p->arena, &compound);
+  last = &p->tokens[p->pos - 1];
+  command->text = ush_arena_strndup(p->arena, p->line + name->offset, last->offset + last->length - name->offset);
+  return 0;
+}
+
+/**
+   @brief Parse a command: simple, compound (with its redirections) or a
+   function definition.  Reserved words are only recognised here, where a
+   command starts.
+   @param p The parser.
+   @param command Receives the command.
+   @return 0 on success, -1 on failure.
+ */
+int ush_parse_command(struct ush_parser *p, struct ush_command *command)
+{
+  size_t redirects_base = parse_redirects.len;
+  struct ush_token *token = &p->tokens[p->pos];
+  int ret;
+
+  memset(command, 0, sizeof(*command));
+  if(p->pos == p->count || ush_parser_closer(p)){
+    return ush_parser_fail(p);
+  }
+  if(!ush_parser_compound(p)){
+    if(token->kind == USH_TOK_WORD && p->pos + 2 < p->count && p->tokens[p->pos + 1].kind == USH_TOK_LPAREN
+       && p->tokens[p->pos + 2].kind == USH_TOK_RPAREN && ush_var_name_len(p->line + token->offset) == token->length){
+      return ush_parse_funcdef(p, command);
+    }
+    return ush_parse_simple(p, command);
+  }
+
+  p->depth++;
+  if(ush_parser_word(p, "if")){
+    p->pos++;
+    ret = ush_parse_if(p, command);
+  }
+  else if(ush_parser_word(p, "for")){
+    p->pos++;
+    ret = ush_parse_for(p, command);
+  }
+  else if(ush_parser_word(p, "{")){
+    p->pos++;
+    command->kind = USH_CMD_GROUP;
+    ret = ((command->body = ush_parse_body(p)) == NULL) ? -1 : ush_parser_expect(p, "}");
+  }
+  else{
+    command->kind = ush_parser_word(p, "while") ? USH_CMD_WHILE : USH_CMD_UNTIL;
+    p->pos++;
+    ret = ((command->cond = ush_parse_body(p)) == NULL || ush_parser_expect(p, "do") < 0
+           || (command->body = ush_parse_body(p)) == NULL) ? -1 : ush_parser_expect(p, "done");
+  }
+  if(ret < 0){
+    return -1;
+  }
+  p->depth--;
+
+  while(ush_parser_peek(p) >= USH_TOK_IN){
+    if(ush_parse_redirect(p) < 0){
+      return -1;
+    }
+  }
+  command->num_redirects = (parse_redirects.len - redirects_base) / sizeof(struct ush_redirect);
+  command->redirects = ush_scratch_pop(&parse_redirects, redirects_base, p->arena);
+  return 0;
+}
+
+/**
+ * @brief Parse a line (or several, joined by newlines) into a list.
+ * @param line The input.
+ * @param arena Arena everything is allocated from.
+ * @param incomplete Set to 0, or when the input stops in the middle of a
+ * command (an open quote or compound command, a trailing |, && or ||) to 1
+ * plus the number of closing words (fi, done, }) still missing.
+ * @return The list (with no pipelines for an empty line), or NULL on a
+ * syntax error (already reported) or incomplete input.
+ */
+struct ush_list* ush_parse(const char* line, struct ush_arena *arena, int *incomplete)
+{
+  struct ush_parser p;
+  struct ush_list *list;
+  long count;
+
+  USH_TRACE_BEGIN(start);
+  count = ush_lex(&session_lexer, line);
+  USH_TRACE_END(USH_TR_LEX, start);
+  *incomplete = 0;
+  if(count < 0){
+    *incomplete = 1;
+    return NULL;
+  }
+
+  memset(&p, 0, sizeof(p));
+  p.line = line;
+  p.tokens = session_lexer.tokens;
+  p.count = count;
+  p.arena = arena;
+  parse_pipelines.len = parse_commands.len = parse_words.len = parse_redirects.len = 0;
+  list = ush_parse_list(&p);
+  if(list != NULL && p.pos < p.count){
+    //A closing word with nothing to close.
+    ush_parser_fail(&p);
+    list = NULL;
+  }
+  *incomplete = p.incomplete;
+  return list;
+}
+
+/**
+ * @brief Parse a line, through the parse cache.
+ * @param line The input line.
+ * @param incomplete Set as by ush_parse().
+ * @return The cached list (valid until ush_ast_cache_trim() drops the
+ * cache), or NULL on a syntax error or incomplete input.  These are not
+ * cached.
+ */
+struct ush_list* ush_parse_line(const char* line, int *incomplete)
+{
+  unsigned long hash = ush_strhash(line);
+  struct ush_ast_entry **link = &ast_cache[hash % USH_AST_BUCKETS];
+  struct ush_ast_entry *entry;
+  struct ush_list *list;
+
+  for (entry = *link; entry != NULL; entry = entry->next){
+    if(entry->hash == hash && strcmp(entry->source, line) == 0){
+      ast_cache_hits++;
+      *incomplete = 0;
+      return entry->list;
+    }
+  }
+
+  ast_cache_misses++;
+  list = ush_parse(line, &ast_arena, incomplete);
+  if(list == NULL){
+    return NULL;
+  }
+  entry = ush_arena_alloc(&ast_arena, sizeof(struct ush_ast_entry));
+  entry->hash = hash;
+  entry->source = ush_arena_strndup(&ast_arena, line, strlen(line));
+  entry->list = list;
+  entry->next = *link;
+  *link = entry;
+  ast_cache_entries++;
+  return list;
+}
+
+/**
+ * Filename expansion.  A glob pattern is split at its slashes and walked one
+ * directory level at a time, each level listed with getdents64() and its
+ * entries matched with fnmatch().  Directories listed while expanding the
+ * arguments are cached for the rest of the command line, so several patterns
+ * in the same directory read it once.  The walk is a pull iterator: the
+ * arguments of builtins marked USH_BUILTIN_GLOBSTREAM are produced one by
+ * one straight from getdents64(), in directory order, without ever holding
+ * the whole expansion (or listing) in memory.  Ordinary expansions are
+ * sorted.  Cached listings are kept sorted by name, so "parallel -k" and
+ * "batch -k", which walk through the cache to keep the argument order, get
+ * the matches in the order the pattern expands to.  A pattern that matches
+ * nothing stands for itself.
+ */
+#define USH_DIRCACHE_BUCKETS 64
+#define USH_GLOB_BUF_SIZE 32768
+
+struct ush_dirname {
+  char *name;
+  unsigned char type;
+};
+
+struct ush_dircache {
+  char *path;
+  struct ush_dirname *names;
+  size_t count;
+  struct ush_dircache *next;
+};
+
+struct ush_dircache *dir_cache[USH_DIRCACHE_BUCKETS];
+
+struct ush_glob_level {
+  int fd;
+  char *buf;
+  size_t pos;
+  size_t len;
+  struct ush_dircache *dir;
+  size_t index;
+  size_t comp;
+  size_t path_len;
+};
+
+struct ush_glob_stream {
+  char **comps;
+  size_t num_comps;
+  int dir_only;
+  int cached;
+  struct ush_glob_level *levels;
+  size_t depth;
+  size_t levels_capacity;
+  char *path;
+  size_t path_len;
+  size_t path_capacity;
+  int pending;
+  size_t matched;
+  const char *literal;
+};
+
+/**
+ * Arguments whose patterns were left for a streaming builtin.
+ */
+struct ush_deferred_glob {
+  char **argv;
+  size_t first;
+  char **patterns;
+  size_t count;
+  struct ush_deferred_glob *next;
+};
+
+struct ush_deferred_glob *deferred_globs = NULL;
+
+/**
+ * Scratch argument vector, copied to the command arena once complete.  The
+ * arguments being built start at argv_top: the commands of a command
+ * substitution build theirs above those of the command it is in.
+ */
+char **argv_buf = NULL;
+size_t argv_buf_capacity = 0;
+size_t argv_top = 0;
+
+/**
+ * Scratch space for listing directories into the cache, and the walk used for
+ * ordinary expansions; both are kept between commands.
+ */
+char *dirent_buf = NULL;
+struct ush_dirname *dirnames_buf = NULL;
+size_t dirnames_buf_capacity = 0;
+struct ush_glob_stream glob_scratch;
+
+/**
+   @brief Forget the directories and patterns of the previous command line.
+ */
+void ush_glob_reset()
+{
+  memset(dir_cache, 0, sizeof(dir_cache));
+  deferred_globs = NULL;
+}
+
+/**
+   @brief Append an argument to the scratch argument vector.
+   @param argc Number of arguments so far, updated.
+   @param arg The argument.
+ */
+void ush_argv_push(size_t *argc, char *arg)
+{
+  argv_buf = ush_grow_array(argv_buf, &argv_buf_capacity, *argc + 1, sizeof(char*));
+  argv_buf[(*argc)++] = arg;
+}
+
+/**
+   @brief Record the pattern of a deferred argument.
+   @param deferred The command's deferred patterns.
+   @param slot Index of the argument in the argument vector.
+   @param pattern The pattern.
+   @return The (possibly moved) pattern array, one entry per argument from
+   the first deferred one on (NULL for arguments that are not patterns).
+ */
+char** ush_deferred_pattern(struct ush_deferred_glob *deferred, size_t slot, char *pattern)
+{
+  size_t count = slot - deferred->first + 1;
+  char **patterns = deferred->patterns;
+
+  if(count > deferred->count){
+    patterns = ush_arena_alloc(&cmd_arena, count * sizeof(char*));
+    memcpy(patterns, deferred->patterns, deferred->count * sizeof(char*));
+    memset(patterns + deferred->count, 0, (count - deferred->count) * sizeof(char*));
+    deferred->count = count;
+  }
+  patterns[slot - deferred->first] = pattern;
+  return patterns;
+}
+
+/**
+   @brief Get the pattern a streaming builtin should expand for an argument.
+   @param slot The argument's slot in the builtin's argument vector.
+   @return The pattern, or NULL if the argument is to be taken as it is.
+ */
+const char* ush_arg_pattern(char **slot)
+{
+  for (struct ush_deferred_glob *d = deferred_globs; d != NULL; d = d->next){
+    if(slot >= d->argv + d->first && slot < d->argv + d->first + d->count){
+      return d->patterns[slot - d->argv - d->first];
+    }
+  }
+  return NULL;
+}
+
+/**
+   @brief Check whether a pattern component contains unescaped pattern characters.
+   @param comp The component.
+   @return Nonzero if it does.
+ */
+int ush_glob_meta(const char *comp)
+{
+  for (; *comp != '\0'; comp++){
+    if(*comp == '\\' && comp[1] != '\0'){
+      comp++;
+    }
+    else if(*comp == '*' || *comp == '?' || *comp == '['){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Append to the path being built by a glob walk, keeping it NUL terminated.
+   @param st The walk.
+   @param str The text.
+   @param n Its length.
+ */
+void ush_glob_path(struct ush_glob_stream *st, const char *str, size_t n)
+{
+  st->path = ush_grow_array(st->path, &st->path_capacity, st->path_len + n + 1, 1);
+  memcpy(st->path + st->path_len, str, n);
+  st->path_len += n;
+  st->path[st->path_len] = '\0';
+}
+
+/**
+   @brief Read the next entry of a directory with getdents64().
+   @param fd The directory.
+   @param buf Buffer of USH_GLOB_BUF_SIZE bytes.
+   @param pos Position of the next entry in buf, updated.
+   @param len Number of bytes in buf, updated.
+   @param type Receives the entry's d_type.
+   @return The entry's name (valid until the buffer is refilled), or NULL at the end.
+ */
+const char* ush_read_dirent(int fd, char *buf, size_t *pos, size_t *len, unsigned char *type)
+{
+  struct dirent64 *ent;
+
+  if(*pos >= *len){
+    ssize_t n = getdents64(fd, buf, USH_GLOB_BUF_SIZE);
+
+    if(n <= 0){
+      return NULL;
+    }
+    *pos = 0;
+    *len = n;
+  }
+  ent = (struct dirent64*)(buf + *pos);
+  *pos += ent->d_reclen;
+  *type = ent->d_type;
+  return ent->d_name;
+}
+
+/**
+   @brief qsort() comparator for directory entries, by name.
+ */
+int ush_dirnamecmp(const void *a, const void *b)
+{
+  return strcmp(((const struct ush_dirname*)a)->name, ((const struct ush_dirname*)b)->name);
+}
+
+/**
+   @brief List a directory through the per-command cache.
+   @param path The directory ("" for the current one).
+   @return Its listing, sorted by name (empty if it cannot be read).
+ */
+struct ush_dircache* ush_dircache_get(const char *path)
+{
+  struct ush_dircache **link = &dir_cache[ush_strhash(path) % USH_DIRCACHE_BUCKETS];
+  struct ush_dircache *dir;
+  int fd;
+
+  for (dir = *link; dir != NULL; dir = dir->next){
+    if(strcmp(dir->path, path) == 0){
+      return dir;
+    }
+  }
+
+  dir = ush_arena_alloc(&cmd_arena, sizeof(struct ush_dircache));
+  dir->path = ush_arena_strndup(&cmd_arena, path, strlen(path));
+  dir->count = 0;
+  fd = openat(AT_FDCWD, (*path != '\0') ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd >= 0){
+    size_t pos = 0, len = 0;
+    unsigned char type;
+    const char *name;
+
+    if(dirent_buf == NULL){
+      dirent_buf = ush_malloc(USH_GLOB_BUF_SIZE);
+    }
+    while((name = ush_read_dirent(fd, dirent_buf, &pos, &len, &type)) != NULL){
+      dirnames_buf = ush_grow_array(dirnames_buf, &dirnames_buf_capacity, dir->count + 1, sizeof(struct ush_dirname));
+      dirnames_buf[dir->count].name = ush_arena_strndup(&cmd_arena, name, strlen(name));
+      dirnames_buf[dir->count].type = type;
+      dir->count++;
+    }
+    close(fd);
+  }
+  dir->names = ush_arena_alloc(&cmd_arena, dir->count * sizeof(struct ush_dirname) + 1);
+  memcpy(dir->names, dirnames_buf, dir->count * sizeof(struct ush_dirname));
+  qsort(dir->names, dir->count, sizeof(struct ush_dirname), ush_dirnamecmp);
+  dir->next = *link;
+  *link = dir;
+  return dir;
+}
+
+/**
+   @brief Move a glob walk into the directory now in st->path.
+   Literal components are appended to the path without listing anything;
+   the first component with pattern characters gets a new level, and a path
+   made only of literal components becomes a pending match if it exists.
+   @param st The walk.
+   @param comp Index of the next pattern component.
+ */
+void ush_glob_descend(struct ush_glob_stream *st, size_t comp)
+{
+  struct ush_glob_level *level;
+
+  for (; comp < st->num_comps && !ush_glob_meta(st->comps[comp]); comp++){
+    for (const char *c = st->comps[comp]; *c != '\0'; c++){
+      if(*c == '\\' && c[1] != '\0'){
+        c++;
+      }
+      ush_glob_path(st, c, 1);
+    }
+    if(comp + 1 < st->num_comps || st->dir_only){
+      ush_glob_path(st, "/", 1);
+    }
+  }
+  if(comp == st->num_comps){
+    struct stat sb;
+
+    st->pending = (st->dir_only ? stat(st->path, &sb) == 0 && S_ISDIR(sb.st_mode) : lstat(st->path, &sb) == 0);
+    return;
+  }
+
+  st->levels = ush_grow_array(st->levels, &st->levels_capacity, st->depth + 1, sizeof(struct ush_glob_level));
+  level = &st->levels[st->depth];
+  level->comp = comp;
+  level->path_len = st->path_len;
+  level->fd = -1;
+  level->buf = NULL;
+  level->pos = level->len = level->index = 0;
+  level->dir = NULL;
+  if(st->cached){
+    level->dir = ush_dircache_get(st->path);
+  }
+  else{
+    level->fd = openat(AT_FDCWD, (st->path_len > 0) ? st->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(level->fd < 0){
+      return;
+    }
+    level->buf = ush_malloc(USH_GLOB_BUF_SIZE);
+  }
+  st->depth++;
+}
+
+/**
+   @brief Start a glob walk.
+   @param st The walk: zeroed, or closed by ush_glob_close() without releasing.
+   @param pattern The pattern (quoted characters escaped with a backslash).
+   @param literal Returned as the only result if nothing matches (or NULL).
+   @param cached Nonzero to list directories through the per-command cache,
+   zero to read them as the walk goes.
+ */
+void ush_glob_open(struct ush_glob_stream *st, const char *pattern, const char *literal, int cached)
+{
+  char *copy = ush_arena_strndup(&cmd_arena, pattern, strlen(pattern));
+  size_t len = strlen(copy);
+  //Buffers left by an earlier walk (see ush_glob_close()) are reused.
+  struct ush_glob_level *levels = st->levels;
+  size_t levels_capacity = st->levels_capacity;
+  char *path = st->path;
+  size_t path_capacity = st->path_capacity;
+
+  memset(st, 0, sizeof(*st));
+  st->levels = levels;
+  st->levels_capacity = levels_capacity;
+  st->path = path;
+  st->path_capacity = path_capacity;
+  st->cached = cached;
+  st->literal = literal;
+  st->comps = ush_arena_alloc(&cmd_arena, (len / 2 + 2) * sizeof(char*));
+  st->dir_only = (len > 0 && copy[len - 1] == '/');
+  ush_glob_path(st, "", 0);
+  if(*copy == '/'){
+    ush_glob_path(st, "/", 1);
+  }
+  for (char *c = strtok(copy, "/"); c != NULL; c = strtok(NULL, "/")){
+    st->comps[st->num_comps++] = c;
+  }
+  if(st->num_comps > 0){
+    ush_glob_descend(st, 0);
+  }
+}
+
+/**
+   @brief Check whether a directory entry found by a glob walk is a directory.
+   @param st The walk; st->path is the entry's path.
+   @param type The entry's d_type.
+   @return Nonzero if it is a directory (or a link to one).
+ */
+int ush_glob_isdir(struct ush_glob_stream *st, unsigned char type)
+{
+  struct stat sb;
+
+  if(type == DT_DIR){
+    return 1;
+  }
+  if(type != DT_UNKNOWN && type != DT_LNK){
+    return 0;
+  }
+  return stat(st->path, &sb) == 0 && S_ISDIR(sb.st_mode);
+}
+
+/**
+   @brief Get the next match of a glob walk.
+   @param st The walk.
+   @return The matching path (valid until the next call), or NULL when done.
+ */
+const char* ush_glob_next(struct ush_glob_stream *st)
+{
+  for (;;){
+    struct ush_glob_level *level;
+    const char *name;
+    unsigned char type;
+
+    if(st->pending){
+      st->pending = 0;
+      st->matched++;
+      return st->path;
+    }
+    if(st->depth == 0){
+      if(st->matched == 0 && st->literal != NULL){
+        const char *literal = st->literal;
+
+        st->literal = NULL;
+        return literal;
+      }
+      return NULL;
+    }
+
+    level = &st->levels[st->depth - 1];
+    if(level->dir != NULL){
+      name = (level->index < level->dir->count) ? level->dir->names[level->index].name : NULL;
+      type = (name != NULL) ? level->dir->names[level->index++].type : 0;
+    }
+    else{
+      name = ush_read_dirent(level->fd, level->buf, &level->pos, &level->len, &type);
+    }
+    if(name == NULL){
+      if(level->fd >= 0){
+        close(level->fd);
+        free(level->buf);
+      }
+      st->depth--;
+      continue;
+    }
+    if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))){
+      continue;
+    }
+    if(fnmatch(st->comps[level->comp], name, FNM_PERIOD) != 0){
+      continue;
+    }
+
+    st->path_len = level->path_len;
+    ush_glob_path(st, name, strlen(name));
+    if(level->comp + 1 == st->num_comps && !st->dir_only){
+      st->matched++;
+      return st->path;
+    }
+    if(!ush_glob_isdir(st, type)){
+      continue;
+    }
+    ush_glob_path(st, "/", 1);
+    if(level->comp + 1 == st->num_comps){
+      st->matched++;
+      return st->path;
+    }
+    ush_glob_descend(st, level->comp + 1);
+  }
+}
+
+/**
+   @brief Stop a glob walk.
+   @param st The walk.
+   @param release Nonzero to free its buffers, zero to keep them for the next walk.
+ */
+void ush_glob_close(struct ush_glob_stream *st, int release)
+{
+  while(st->depth > 0){
+    struct ush_glob_level *level = &st->levels[--st->depth];
+
+    if(level->fd >= 0){
+      close(level->fd);
+      free(level->buf);
+    }
+  }
+  if(release){
+    free(st->levels);
+    free(st->path);
+    memset(st, 0, sizeof(*st));
+  }
+}
+
+/**
+   @brief qsort() comparator for arguments.
+ */
+int ush_argcmp(const void *a, const void *b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+   @brief Expand a pattern into the scratch argument vector, sorted.
+   @param pattern The pattern.
+   @param argc Number of arguments so far, updated.
+   @return Number of matches added.
+ */
+size_t ush_glob(const char *pattern, size_t *argc)
+{
+  struct ush_glob_stream *st = &glob_scratch;
+  size_t start = *argc;
+  const char *match;
+
+  ush_glob_open(st, pattern, NULL, 1);
+  while((match = ush_glob_next(st)) != NULL){
+    ush_argv_push(argc, ush_arena_strndup(&cmd_arena, match, strlen(match)));
+  }
+  ush_glob_close(st, 0);
+  qsort(argv_buf + start, *argc - start, sizeof(char*), ush_argcmp);
+  return *argc - start;
+}
+
+/**
+   @brief Expand a word holding command substitutions into the scratch
+   argument vector.  What unquoted substitutions print is split into fields
+   at $IFS characters (default space, tab and newline), as by read: runs of
+   IFS white space separate fields, and each other IFS character ends one.
+   The rest of the word is kept as it is.
+   @param raw The word as written.
+   @param argc Number of arguments so far, updated.
+ */
+void ush_expand_fields(const char *raw, size_t *argc)
+{
+  char *word = ush_expand_word(&cmd_arena, raw);
+  const char *ifs = ush_var_get("IFS");
+  size_t len = strlen(word);
+  size_t start = 0;
+  size_t range = 0;
+  size_t fields = 0;
+  int in_field = 0;
+  int hard = 0;
+
+  if(ifs == NULL){
+    ifs = " \t\n";
+  }
+  for (size_t i = 0; i < len; i++){
+    while(range < split_count && i >= split_ranges[range] + split_ranges[range + 1]){
+      range += 2;
+    }
+    if(range >= split_count || i < split_ranges[range] || strchr(ifs, word[i]) == NULL){
+      if(!in_field){
+        start = i;
+        in_field = 1;
+      }
+      continue;
+    }
+    if(in_field){
+      ush_argv_push(argc, ush_arena_strndup(&cmd_arena, word + start, i - start));
+      fields++;
+      in_field = 0;
+      hard = !ush_ifs_space(ifs, word[i]);
+    }
+    else if(!ush_ifs_space(ifs, word[i])){
+      //Two of them in a row (or one at the start) delimit an empty field.
+      if(hard || fields == 0){
+        ush_argv_push(argc, "");
+        fields++;
+      }
+      hard = 1;
+    }
+  }
+  if(in_field){
+    ush_argv_push(argc, ush_arena_strndup(&cmd_arena, word + start, len - start));
+  }
+  else if(fields == 0 && word_quoted){
+    ush_argv_push(argc, "");
+  }
+}
+
+/**
+   @brief Turn a glob pattern back into the text it matches literally.
+   @param pattern The pattern, changed in place.
+   @return pattern.
+ */
+char* ush_pattern_literal(char *pattern)
+{
+  char *w = pattern;
+
+  for (const char *r = pattern; *r != '\0'; r++){
+    if(*r == '\\' && r[1] != '\0'){
+      r++;
+    }
+    *w++ = *r;
+  }
+  *w = '\0';
+  return pattern;
+}
+
+/**
+   @brief Expand the words of a command into its argument vector.
+   @param command The command.
+   @return Null terminated argv, from the command arena.
+ */
+char** ush_command_argv(struct ush_command *command)
+{
+  char **words = command->words + command->num_assigns;
+  const struct ush_builtin *builtin = NULL;
+  struct ush_deferred_glob *deferred = NULL;
+  int streaming = 0;
+  size_t base = argv_top;
+  size_t argc = base;
+  char **argv;
+
+  for (size_t i = 0; words[i] != NULL; i++){
+    argv_top = argc;
+    if(strcmp(words[i], "$@") == 0 || strcmp(words[i], "\"$@\"") == 0){
+      //Each positional parameter is an argument of its own.
+      for (size_t j = 0; j < params.argc; j++){
+        ush_argv_push(&argc, params.argv[j]);
+      }
+      continue;
+    }
+    if(strchr(words[i], '`') != NULL || strstr(words[i], "$(") != NULL){
+      //Expanded once only: the commands must not run twice.
+      if(!ush_word_is_pattern(words[i])){
+        ush_expand_fields(words[i], &argc);
+      }
+      else{
+        char *pattern = ush_expand(&cmd_arena, words[i], 1);
+
+        if(ush_glob(pattern, &argc) == 0){
+          ush_argv_push(&argc, ush_pattern_literal(pattern));
+        }
+      }
+      continue;
+    }
+
+    char *arg = ush_expand_word(&cmd_arena, words[i]);
+
+    if(ush_word_is_pattern(words[i])){
+      char *pattern = ush_expand(&cmd_arena, words[i], 1);
+
+      if(streaming){
+        //Left for the builtin to stream; remember the pattern for its slot.
+        if(deferred == NULL){
+          deferred = ush_arena_alloc(&cmd_arena, sizeof(struct ush_deferred_glob));
+          deferred->patterns = ush_arena_alloc(&cmd_arena, sizeof(char*));
+          deferred->count = 0;
+          deferred->first = argc - base;
+        }
+        ush_argv_push(&argc, arg);
+        deferred->patterns = ush_deferred_pattern(deferred, argc - 1 - base, pattern);
+        continue;
+      }
+      if(ush_glob(pattern, &argc) > 0){
+        continue;
+      }
+    }
+    ush_argv_push(&argc, arg);
+    if(i == 0){
+      builtin = ush_find_builtin(arg);
+    }
+    else if(builtin != NULL && (builtin->flags & USH_BUILTIN_GLOBSTREAM) && strcmp(arg, ":::") == 0){
+      streaming = 1;
+    }
+  }
+
+  argv_top = base;
+  argc -= base;
+  argv = ush_arena_alloc(&cmd_arena, (argc + 1) * sizeof(char*));
+  memcpy(argv, argv_buf + base, argc * sizeof(char*));
+  argv[argc] = NULL;
+  if(deferred != NULL){
+    deferred->argv = argv;
+    deferred->next = deferred_globs;
+    deferred_globs = deferred;
+  }
+  return argv;
+}
+
+/**
+ * A variable as it was before a temporary assignment.
+ */
+struct ush_saved_var {
+  char *name;
+  char *value;
+  int exported;
+};
+
+/**
+   @brief Perform the assignments of a command.
+   @param command The command.
+   @param saved NULL to make the assignments for good; otherwise they are
+   exported for the command only, and saved (num_assigns slots) receives
+   what to give to ush_assign_restore() afterwards.
+ */
+void ush_assign(struct ush_command *command, struct ush_saved_var *saved)
+{
+  for (size_t i = 0; i < command->num_assigns; i++){
+    const char *word = command->words[i];
+    size_t len = ush_var_name_len(word);
+    char *value = ush_expand_word(&cmd_arena, word + len + 1);
+    struct ush_var *var;
+
+    if(saved != NULL){
+      struct ush_var *old = *ush_var_slot(word, len);
+
+      saved[i].name = ush_arena_strndup(&cmd_arena, word, len);
+      saved[i].value = (old != NULL) ? ush_arena_strndup(&cmd_arena, old->entry + len + 1, strlen(old->entry + len + 1)) : NULL;
+      saved[i].exported = (old != NULL) && old->exported;
+    }
+    var = ush_var_setn(word, len, value);
+    if(saved != NULL){
+      ush_var_set_exported(var, 1);
+    }
+  }
+}
+
+/**
+   @brief Undo temporary assignments made by ush_assign().
+   @param saved The saved variables.
+   @param count Number of them.
+ */
+void ush_assign_restore(struct ush_saved_var *saved, size_t count)
+{
+  //Backwards, so a variable assigned twice gets its first saved value.
+  while(count-- > 0){
+    if(saved[count].value == NULL){
+      ush_var_unset(saved[count].name);
+    }
+    else{
+      ush_var_set_exported(ush_var_set(saved[count].name, saved[count].value), saved[count].exported);
+    }
+  }
+}
+
+/**
+   @brief Builtin command: show the environment, or run a command in it.
+   @param args List of args.  args[0] is "env".  Leading NAME=value arguments
+   are added to the environment of the command that follows, or of the
+   listing when there is none.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_env(char **args)
+{
+  struct ush_command command;
+  struct ush_saved_var *saved;
+  int ret = 1;
+
+  memset(&command, 0, sizeof(command));
+  command.words = args + 1;
+  while(args[1 + command.num_assigns] != NULL && strchr(args[1 + command.num_assigns], '=') != NULL &&
+        args[1 + command.num_assigns][ush_var_name_len(args[1 + command.num_assigns])] == '='){
+    command.num_assigns++;
+  }
+  saved = ush_arena_alloc(&cmd_arena, (command.num_assigns + 1) * sizeof(struct ush_saved_var));
+  ush_assign(&command, saved);
+  if(args[1 + command.num_assigns] != NULL){
+    ret = ush_execute(args + 1 + command.num_assigns);
+  }
+  else{
+    char **envp = ush_envp();
+
+    for (size_t i = 0; envp[i] != NULL; i++){
+      ush_out_puts(envp[i]);
+      ush_out_str("\n", 1);
+    }
+    ush_out_flush();
+  }
+  ush_assign_restore(saved, command.num_assigns);
+  return ret;
+}
+
+/**
+   @brief Feed a here-string to a command.
+   The text lives in an anonymous memory file (a pipe where memfd_create is
+   unavailable), so nothing touches the filesystem.
+   @param text The here-string; a newline is appended.
+   @return Readable descriptor positioned at the start of the text, or -1.
+ */
+int ush_herestring_fd(const char *text)
+{
+  size_t len = strlen(text);
+  int fd = memfd_create("ush-herestring", MFD_CLOEXEC);
+
+  if(fd >= 0){
+    if(write(fd, text, len) != (ssize_t)len || write(fd, "\n", 1) != 1 || lseek(fd, 0, SEEK_SET) != 0){
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  int pipefd[2];
+  if(pipe2(pipefd, O_CLOEXEC) != 0){
+    return -1;
+  }
+  //Without a reader the whole text must fit in the pipe buffer.
+  if(len + 1 > (size_t)fcntl(pipefd[1], F_GETPIPE_SZ) ||
+     write(pipefd[1], text, len) != (ssize_t)len || write(pipefd[1], "\n", 1) != 1){
+    close(pipefd[0]);
+    close(pipefd[1]);
+    errno = E2BIG;
+    return -1;
+  }
+  close(pipefd[1]);
+  return pipefd[0];
+}
+
+/**
+   @brief Open the redirections of a command.
+   Every descriptor is opened close-on-exec above 2 and only installed as
+   0, 1 or 2 in the child (or temporarily in the shell for a builtin).
+   @param command The command.
+   @param fds Descriptors for stdin/stdout/stderr, updated by the redirections.
+   @param opened Receives the descriptors opened here (num_redirects slots).
+   @param num_opened Receives the number of descriptors opened.
+   @return 0 on success, -1 on failure (error already reported).
+ */
+int ush_open_redirects(struct ush_command *command, int *fds, int *opened, size_t *num_opened)
+{
+  *num_opened = 0;
+  for (size_t i = 0; i < command->num_redirects; i++){
+    struct ush_redirect *redirect = &command->redirects[i];
+    char *target = (redirect->target != NULL) ? ush_expand_word(&cmd_arena, redirect->target) : "2>&1";
+    int slot = 1;
+    int fd;
+
+    switch(redirect->kind){
+    case USH_TOK_IN:
+      slot = 0;
+      fd = open(target, O_RDONLY | O_CLOEXEC);
+      break;
+    case USH_TOK_HERESTRING:
+      slot = 0;
+      fd = ush_herestring_fd(target);
+      break;
+    case USH_TOK_ERR_OUT:
+      slot = 2;
+      //Fall through.
+    case USH_TOK_OUT:
+      fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+      break;
+    case USH_TOK_ERR_APPEND:
+      slot = 2;
+      //Fall through.
+    case USH_TOK_APPEND:
+      fd = open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+      break;
+    default:
+      //2>&1: share whatever stdout is at this point.
+      if(fds[1] >= 0){
+        fds[2] = fds[1];
+        continue;
+      }
+      slot = 2;
+      fd = fcntl(1, F_DUPFD_CLOEXEC, 3);
+      break;
+    }
+
+    if(fd < 0){
+      fprintf(stderr, "ush: %s: %s\n", target, strerror(errno));
+      for (size_t j = 0; j < *num_opened; j++){
+        close(opened[j]);
+      }
+      *num_opened = 0;
+      return -1;
+    }
+    opened[(*num_opened)++] = fd;
+    fds[slot] = fd;
+  }
+  return 0;
+}
+
+/**
+   @brief Close the descriptors opened by ush_open_redirects().
+   @param opened The descriptors.
+   @param num_opened Number of descriptors.
+ */
+void ush_close_redirects(int *opened, size_t num_opened)
+{
+  for (size_t i = 0; i < num_opened; i++){
+    close(opened[i]);
+  }
+}
+
+/**
+   @brief Install descriptors as the shell's own stdin/stdout/stderr.
+   @param fds Descriptors to install (-1 keeps the shell's).
+   @param saved Receives copies of the shell's descriptors (-1 where kept),
+   for ush_restore_fds().
+   @param keep_stdout Nonzero to leave stdout alone in any case.
+ */
+void ush_install_fds(const int *fds, int *saved, int keep_stdout)
+{
+  fflush(stdout);
+  for (int i = 0; i < 3; i++){
+    saved[i] = -1;
+    if(fds[i] >= 0 && !(i == 1 && keep_stdout)){
+      saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+      dup2(fds[i], i);
+    }
+  }
+}
+
+/**
+   @brief Put back the descriptors saved by ush_install_fds().
+   @param saved The saved descriptors.
+ */
+void ush_restore_fds(const int *saved)
+{
+  fflush(stdout);
+  for (int i = 0; i < 3; i++){
+    if(saved[i] >= 0){
+      dup2(saved[i], i);
+      close(saved[i]);
+    }
+  }
+}
+
+/**
+   @brief Run a builtin in the shell with its standard descriptors redirected.
+   The output of a USH_BUILTIN_PIPESAFE builtin is written straight to its
+   descriptor; only the others get it installed as the shell's stdout.
+   @param builtin The builtin.
+   @param args Null terminated list of arguments.
+   @param fds Descriptors to use as stdin/stdout/stderr (-1 keeps the shell's).
+   @return The builtin's return value.
+ */
+int ush_run_builtin_redirected(const struct ush_builtin *builtin, char **args, const int *fds)
+{
+  int saved[3];
+  int direct = (builtin->flags & USH_BUILTIN_PIPESAFE) && fds[1] >= 0;
+  int ret;
+
+  ush_install_fds(fds, saved, direct);
+  if(direct){
+    builtin_out.fd = fds[1];
+  }
+  ret = ush_call_builtin(builtin, args);
+  builtin_out.fd = STDOUT_FILENO;
+  ush_restore_fds(saved);
+  return ret;
+}
+
+/**
+ * Control flow.  break, continue and return set ush_flow; every list stops
+ * at once when it is set, and the loop (levels of them for break N and
+ * continue N) or function it is meant for clears it.
+ */
+enum ush_flow { USH_FLOW_NONE, USH_FLOW_BREAK, USH_FLOW_CONTINUE, USH_FLOW_RETURN };
+
+int ush_flow = USH_FLOW_NONE;
+long ush_flow_levels = 0;
+int ush_loop_depth = 0;
+int ush_func_depth = 0;
+
+/**
+ * Functions.  A definition is parsed again from its text into an arena of
+ * its own, so the body outlives the parse cache; running the same
+ * definition again (in a loop, or a script run twice) keeps the one there
+ * is.  The bodies of redefined functions are only freed at exit.
+ */
+#define USH_FUNC_BUCKETS 64
+#define USH_FUNC_MAX_DEPTH 1000
+
+struct ush_function {
+  char *name;
+  char *text;
+  struct ush_list *body;
+  struct ush_function *next;
+};
+
+struct ush_function *func_table[USH_FUNC_BUCKETS];
+size_t num_functions = 0;
+struct ush_arena func_arena;
+
+//Compound commands and functions run lists, which run commands.
+int ush_execute_list(struct ush_list *list);
+int ush_execute_compound(struct ush_command *command);
+
+/**
+   @brief Look up a function.
+   @param name Its name.
+   @return The function, or NULL if there is none of that name.
+ */
+struct ush_function* ush_find_function(const char *name)
+{
+  if(num_functions == 0){
+    return NULL;
+  }
+  for (struct ush_function *func = func_table[ush_strhash(name) % USH_FUNC_BUCKETS]; func != NULL; func = func->next){
+    if(strcmp(func->name, name) == 0){
+      return func;
+    }
+  }
+  return NULL;
+}
+
+/**
+   @brief Define a function.
+   @param command The definition.
+ */
+void ush_define_function(struct ush_command *command)
+{
+  struct ush_function *func = ush_find_function(command->name);
+  struct ush_list *list;
+  int incomplete;
+
+  ush_last_status = 0;
+  if(func != NULL && strcmp(func->text, command->text) == 0){
+    return;
+  }
+  list = ush_parse(command->text, &func_arena, &incomplete);
+  if(list == NULL){
+    ush_last_status = 1;
+    return;
+  }
+  if(func == NULL){
+    unsigned long hash = ush_strhash(command->name);
+
+    func = ush_arena_alloc(&func_arena, sizeof(struct ush_function));
+    func->name = ush_arena_strndup(&func_arena, command->name, strlen(command->name));
+    func->next = func_table[hash % USH_FUNC_BUCKETS];
+    func_table[hash % USH_FUNC_BUCKETS] = func;
+    num_functions++;
+  }
+  func->text = ush_arena_strndup(&func_arena, command->text, strlen(command->text));
+  func->body = list->pipelines[0].commands[0].body;
+}
+
+/**
+   @brief Call a function, with the arguments as its positional parameters.
+   @param func The function.
+   @param args Null terminated list of arguments; args[0] is its name.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_call_function(struct ush_function *func, char **args)
+{
+  struct ush_params saved = params;
+  int loop_depth = ush_loop_depth;
+  int ret;
+
+  if(ush_func_depth >= USH_FUNC_MAX_DEPTH){
+    fprintf(stderr, "ush: %s: maximum function nesting level exceeded (%d)\n", args[0], USH_FUNC_MAX_DEPTH);
+    ush_last_status = 1;
+    return 1;
+  }
+  params.argv = args + 1;
+  for (params.argc = 0; params.argv[params.argc] != NULL; params.argc++)
+    ;
+  ush_func_depth++;
+  //break and continue cannot reach the caller's loops.
+  ush_loop_depth = 0;
+  ret = ush_execute_list(func->body);
+  ush_flow = USH_FLOW_NONE;
+  ush_loop_depth = loop_depth;
+  ush_func_depth--;
+  params = saved;
+  return ret;
+}
+
+/**
+   @brief Run a single command with its redirections.
+   @param command The command.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_execute_command(struct ush_command *command)
+{
+  char **argv;
+  struct ush_saved_var *saved = NULL;
+  const struct ush_builtin *builtin;
+  struct ush_function *func;
+  int fds[3] = { -1, -1, -1 };
+  int saved_fds[3];
+  int *opened;
+  size_t num_opened;
+  unsigned long substs;
+  int ret = 1;
+
+  if(command->kind != USH_CMD_SIMPLE){
+    if(command->num_redirects == 0){
+      return ush_execute_compound(command);
+    }
+    opened = ush_arena_alloc(&cmd_arena, command->num_redirects * sizeof(int));
+    if(ush_open_redirects(command, fds, opened, &num_opened) < 0){
+      ush_last_status = 1;
+      return 1;
+    }
+    ush_install_fds(fds, saved_fds, 0);
+    ret = ush_execute_compound(command);
+    ush_restore_fds(saved_fds);
+    ush_close_redirects(opened, num_opened);
+    return ret;
+  }
+
+  argv = ush_command_argv(command);
+  substs = subst_count;
+  if(command->num_assigns > 0){
+    if(argv[0] == NULL){
+      //Only assignments: they are for the shell itself.
+      ush_assign(command, NULL);
+    }
+    else{
+      saved = ush_arena_alloc(&cmd_arena, command->num_assigns * sizeof(struct ush_saved_var));
+      ush_assign(command, saved);
+    }
+  }
+  func = (argv[0] != NULL) ? ush_find_function(argv[0]) : NULL;
+
+  if(command->num_redirects == 0){
+    if(argv[0] == NULL && subst_count == substs){
+      ush_last_status = 0;
+    }
+    ret = (func != NULL) ? ush_call_function(func, argv) : ush_execute(argv);
+  }
+  else{
+    opened = ush_arena_alloc(&cmd_arena, command->num_redirects * sizeof(int));
+    if(ush_open_redirects(command, fds, opened, &num_opened) < 0){
+      ush_last_status = 1;
+    }
+    else{
+      if(argv[0] == NULL){
+        //Only redirections: the files have been created, nothing to run.
+        ush_last_status = 0;
+      }
+      else if(func != NULL){
+        ush_install_fds(fds, saved_fds, 0);
+        ret = ush_call_function(func, argv);
+        ush_restore_fds(saved_fds);
+      }
+      else if((builtin = ush_find_builtin(argv[0])) != NULL){
+        ret = ush_run_builtin_redirected(builtin, argv, fds);
+      }
+      else{
+        ret = ush_launch(argv, fds);
+      }
+      ush_close_redirects(opened, num_opened);
+    }
+  }
+
+  if(saved != NULL){
+    ush_assign_restore(saved, command->num_assigns);
+  }
+  return ret;
+}
+
+/**
+ * Shell options, changed with "set -o name" and "set +o name".
+ */
+int ush_opt_bigpipe = 0;
+
+struct ush_option {
+  const char *name;
+  int *value;
+  const char *help;
+};
+
+const struct ush_option options[] = {
+  { "bigpipe",    &ush_opt_bigpipe,    "enlarge pipeline buffers to the system maximum" },
+  { "ignoredups", &ush_opt_ignoredups, "do not add commands already in the history" },
+  { "timing",     &ush_opt_timing,     "report time and resource usage of every command" },
+  { "trace",      &ush_opt_trace,      "record where the shell spends its time, for profile" },
+};
+
+#define USH_NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+/**
+   @brief Builtin command: set or show shell options.
+   @param args List of args.  args[0] is "set".  "-o name" turns an option on,
+   "+o name" turns it off; without arguments the options are listed.
+   @return Always returns 1, to continue executing.
+ */
+int ush_set(char **args)
+{
+  if(args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)){
+    for (size_t i = 0; i < USH_NUM_OPTIONS; i++){
+      ush_out_printf("%-12s%-5s%s\n", options[i].name, *options[i].value ? "on" : "off", options[i].help);
+    }
+    return 1;
+  }
+
+  for (int i = 1; args[i] != NULL; i++){
+    size_t j;
+
+    if((strcmp(args[i], "-o") != 0 && strcmp(args[i], "+o") != 0) || args[i + 1] == NULL){
+      fprintf(stderr, "ush: usage: set [-o|+o option]...\n");
+      ush_last_status = 2;
+      return 1;
+    }
+    for (j = 0; j < USH_NUM_OPTIONS && strcmp(args[i + 1], options[j].name) != 0; j++)
+      ;
+    if(j == USH_NUM_OPTIONS){
+      fprintf(stderr, "ush: set: %s: invalid option name\n", args[i + 1]);
+      ush_last_status = 2;
+      return 1;
+    }
+    *options[j].value = (args[i][0] == '-');
+    i++;
+  }
+  return 1;
+}
+
+/**
+   @brief Size pipes are enlarged to in "bigpipe" mode.
+   @return The system's maximum pipe size (looked up once).
+ */
+int ush_pipe_max_size()
+{
+  static int max_size = 0;
+
+  if(max_size == 0){
+    FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+
+    if(file == NULL || fscanf(file, "%d", &max_size) != 1 || max_size <= 0){
+      max_size = 1024 * 1024;
+    }
+    if(file != NULL){
+      fclose(file);
+    }
+  }
+  return max_size;
+}
+
+/**
+   @brief Leave behind, in a forked copy of the shell, what belongs to the
+   shell itself: the zygote (its children would be the shell's, not ours),
+   the pipe and captured output of command substitutions, the execution
+   log (the copy is logged as one process), and job control
+   (the copy is part of a job, and its children go in the same process
+   group).  Called once the child's descriptors are in place, as they may
+   come from that pipe.
+ */
+void ush_forked_child()
+{
+  ush_child_pgroup();
+  ush_job_sigs_default();
+  ush_job_control = 0;
+  spawn_group.pgid = -1;
+  spawn_group.foreground = 0;
+  if(zygote_fd >= 0){
+    close(zygote_fd);
+    zygote_fd = -1;
+  }
+  if(ush_log_fd >= 0){
+    close(ush_log_fd);
+    ush_log_fd = -1;
+    log_len = 0;
+  }
+  for (int i = 0; i < 2; i++){
+    if(subst_pipe[i] >= 0){
+      close(subst_pipe[i]);
+      subst_pipe[i] = -1;
+    }
+  }
+  capturing = 0;
+  capture_len = 0;
+}
+
+/**
+   @brief Run a builtin as a pipeline stage in a child process.
+   @param builtin The builtin.
+   @param args Null terminated list of arguments.
+   @param fds Descriptors for the child's stdin/stdout/stderr.
+   @return Pid of the child, or -1 on failure (error already reported).
+ */
+pid_t ush_fork_builtin(const struct ush_builtin *builtin, char **args, const int *fds)
+{
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+  if(pid == 0){
+    //Child Process: still a shell, so SIGCHLD stays on ush_sigchld_fd.
+    ush_child_fds(fds);
+    ush_forked_child();
+    ush_call_builtin(builtin, args);
+    _exit(ush_last_status);
+  }
+  else if(pid < 0){
+    perror("ush");
+  }
+  return pid;
+}
+
+/**
+   @brief Run a compound command or a function call as a pipeline stage, in
+   a forked copy of the shell.
+   @param command The command.
+   @param func The function called, or NULL for a compound command.
+   @param args Null terminated list of arguments of the call.
+   @param fds Descriptors for the child's stdin/stdout/stderr.
+   @return Pid of the child, or -1 on failure (error already reported).
+ */
+pid_t ush_fork_shell(struct ush_command *command, struct ush_function *func, char **args, const int *fds)
+{
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+  if(pid == 0){
+    ush_child_fds(fds);
+    ush_forked_child();
+    if(func == NULL){
+      ush_execute_compound(command);
+    }
+    else{
+      ush_assign(command, ush_arena_alloc(&cmd_arena, (command->num_assigns + 1) * sizeof(struct ush_saved_var)));
+      ush_call_function(func, args);
+    }
+    fflush(stdout);
+    _exit(ush_last_status);
+  }
+  else if(pid < 0){
+    perror("ush");
+  }
+  return pid;
+}
+
+/**
+ * A pipeline stage that runs in the shell itself, after the other stages
+ * have been started.
+ */
+struct ush_stage {
+  struct ush_command *command;
+  const struct ush_builtin *builtin;
+  char **args;
+  int fds[3];
+  int pipe_in;
+  int pipe_out;
+  int *opened;
+  size_t num_opened;
+};
+
+/**
+   @brief Run a pipeline.
+   All stages are started before waiting for any of them, each connected to
+   the next by a close-on-exec pipe that is only dup2()ed into the children.
+   A USH_BUILTIN_PIPESAFE builtin runs in the shell instead of a child, once
+   every other stage has started, unless its reader is such a builtin too
+   (it could fill the pipe before anyone reads it) or the pipeline runs in
+   the background.
+   @param pipeline The parsed pipeline.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_run_pipeline(struct ush_pipeline *pipeline)
+{
+  struct ush_job *job;
+  char ***argvs;
+  const struct ush_builtin **stage_builtins;
+  char *in_parent;
+  struct ush_stage *stages;
+  size_t num_stages = 0;
+  int prev_read = -1;
+  int last_failed = 0;
+  int last_in_parent;
+
+  if(pipeline->count == 0){
+    return 1;
+  }
+  if(pipeline->count == 1 && !pipeline->background){
+    return ush_execute_command(&pipeline->commands[0]);
+  }
+
+  argvs = ush_arena_alloc(&cmd_arena, pipeline->count * sizeof(char**));
+  stage_builtins = ush_arena_alloc(&cmd_arena, pipeline->count * sizeof(struct ush_builtin*));
+  in_parent = ush_arena_alloc(&cmd_arena, pipeline->count + 1);
+  stages = ush_arena_alloc(&cmd_arena, pipeline->count * sizeof(struct ush_stage));
+  in_parent[pipeline->count] = 0;
+  for (size_t i = pipeline->count; i-- > 0; ){
+    //Compound commands have no arguments.
+    argvs[i] = (pipeline->commands[i].kind == USH_CMD_SIMPLE) ? ush_command_argv(&pipeline->commands[i]) : NULL;
+    stage_builtins[i] = (argvs[i] != NULL && argvs[i][0] != NULL && ush_find_function(argvs[i][0]) == NULL) ?
+      ush_find_builtin(argvs[i][0]) : NULL;
+    in_parent[i] = !pipeline->background && stage_builtins[i] != NULL &&
+      (stage_builtins[i]->flags & USH_BUILTIN_PIPESAFE) && !in_parent[i + 1];
+  }
+  last_in_parent = in_parent[pipeline->count - 1];
+
+  job = ush_job_new(pipeline->text, pipeline->background);
+  for (size_t i = 0; i < pipeline->count; i++){
+    struct ush_command *command = &pipeline->commands[i];
+    char **args = argvs[i];
+    const struct ush_builtin *builtin = stage_builtins[i];
+    int fds[3] = { prev_read, -1, -1 };
+    int pipefd[2] = { -1, -1 };
+    int *opened = ush_arena_alloc(&cmd_arena, (command->num_redirects + 1) * sizeof(int));
+    size_t num_opened = 0;
+    struct ush_function *func = NULL;
+    pid_t pid;
+
+    if(i + 1 < pipeline->count){
+      if(pipe2(pipefd, O_CLOEXEC) != 0){
+        perror("ush");
+        pipefd[0] = pipefd[1] = -1;
+      }
+      else if(ush_opt_bigpipe){
+        fcntl(pipefd[1], F_SETPIPE_SZ, ush_pipe_max_size());
+      }
+      fds[1] = pipefd[1];
+    }
+
+    if(ush_open_redirects(command, fds, opened, &num_opened) < 0 || (args != NULL && args[0] == NULL)){
+      pid = -1;
+    }
+    else if(args == NULL || (func = ush_find_function(args[0])) != NULL){
+      pid = ush_fork_shell(command, func, args, fds);
+    }
+    else if(command->num_assigns > 0 && !in_parent[i]){
+      //The child takes its environment with it when it starts.
+      struct ush_saved_var *saved = ush_arena_alloc(&cmd_arena, command->num_assigns * sizeof(struct ush_saved_var));
+
+      ush_assign(command, saved);
+      pid = (builtin != NULL) ? ush_fork_builtin(builtin, args, fds) : ush_spawn(args, fds);
+      ush_assign_restore(saved, command->num_assigns);
+    }
+    else if(in_parent[i]){
+      //Keep its descriptors open until it has run.
+      struct ush_stage *stage = &stages[num_stages++];
+
+      stage->command = command;
+      stage->builtin = builtin;
+      stage->args = args;
+      memcpy(stage->fds, fds, sizeof(fds));
+      stage->pipe_in = prev_read;
+      stage->pipe_out = pipefd[1];
+      stage->opened = opened;
+      stage->num_opened = num_opened;
+      prev_read = pipefd[0];
+      continue;
+    }
+    else if(builtin != NULL){
+      pid = ush_fork_builtin(builtin, args, fds);
+    }
+    else{
+      pid = ush_spawn(args, fds);
+    }
+    ush_close_redirects(opened, num_opened);
+    if(pid > 0){
+      ush_job_add_process(job, pid, (args != NULL) ? args[0] : pipeline->text);
+    }
+    last_failed = (pid < 0);
+
+    //The children hold their own copies now.
+    if(prev_read >= 0){
+      close(prev_read);
+    }
+    if(pipefd[1] >= 0){
+      close(pipefd[1]);
+    }
+    prev_read = pipefd[0];
+  }
+
+  for (size_t i = 0; i < num_stages; i++){
+    struct ush_stage *stage = &stages[i];
+
+    struct ush_saved_var *saved = ush_arena_alloc(&cmd_arena, (stage->command->num_assigns + 1) * sizeof(struct ush_saved_var));
+
+    ush_last_status = 0;
+    ush_assign(stage->command, saved);
+    ush_run_builtin_redirected(stage->builtin, stage->args, stage->fds);
+    ush_assign_restore(saved, stage->command->num_assigns);
+    ush_close_redirects(stage->opened, stage->num_opened);
+    if(stage->pipe_in >= 0){
+      close(stage->pipe_in);
+    }
+    if(stage->pipe_out >= 0){
+      close(stage->pipe_out);
+    }
+  }
+
+  if(job->num_procs == 0){
+    ush_job_release(job);
+    if(!last_in_parent){
+      ush_last_status = 127;
+    }
+    return 1;
+  }
+  if(pipeline->background){
+    current_job = job->id;
+    if(ush_interactive){
+      printf("[%d] %d\n", job->id, (int)job->procs[job->num_procs - 1].pid);
+    }
+    ush_last_status = 0;
+    return 1;
+  }
+  if(last_in_parent){
+    int status = ush_last_status;
+
+    ush_job_wait(job);
+    ush_last_status = status;
+    return 1;
+  }
+  ush_last_status = ush_job_wait(job);
+  if(last_failed){
+    ush_last_status = 127;
+  }
+  return 1;
+}
+
+/**
+   @brief Execute a pipeline, timing it if it starts with "time" or
+   "set -o timing" is on.
+   @param pipeline The parsed pipeline.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_execute_pipeline(struct ush_pipeline *pipeline)
+{
+  int ret;
+
+  //Tells the pipeline's records in the execution log apart.
+  log_pipeline++;
+  if((!pipeline->timed && !ush_opt_timing) || pipeline->background || pipeline->count == 0
+     || !ush_timing_begin()){
+    return ush_run_pipeline(pipeline);
+  }
+  ret = ush_run_pipeline(pipeline);
+  ush_timing_end();
+  return ret;
+}
+
+/**
+   @brief Execute a list: each pipeline in turn, skipping one after "&&" if
+   the last status is a failure and one after "||" if it is a success.
+   @param list The parsed list.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_execute_list(struct ush_list *list)
+{
+  for (size_t i = 0; i < list->count; i++){
+    struct ush_pipeline *pipeline = &list->pipelines[i];
+
+    if(ush_interrupted){
+      //Ctrl-C: the rest of the command line is dropped.
+      ush_last_status = 130;
+      break;
+    }
+    if((pipeline->connector == USH_LIST_AND && ush_last_status != 0)
+       || (pipeline->connector == USH_LIST_OR && ush_last_status == 0)){
+      continue;
+    }
+    if(!ush_execute_pipeline(pipeline)){
+      return 0;
+    }
+    if(ush_flow != USH_FLOW_NONE){
+      //break, continue or return: skip the rest.
+      break;
+    }
+  }
+  return 1;
+}
+
+/**
+   @brief Deal with a break, continue or return that ended a loop's list.
+   @return Nonzero if the loop must stop.
+ */
+int ush_loop_interrupted()
+{
+  int stop;
+
+  if(ush_flow != USH_FLOW_BREAK && ush_flow != USH_FLOW_CONTINUE){
+    return ush_flow == USH_FLOW_RETURN;
+  }
+  if(--ush_flow_levels > 0){
+    //Meant for a loop further out.
+    return 1;
+  }
+  stop = (ush_flow == USH_FLOW_BREAK);
+  ush_flow = USH_FLOW_NONE;
+  return stop;
+}
+
+/**
+   @brief Run a while or until loop.
+   @param command The loop.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_execute_while(struct ush_command *command)
+{
+  struct ush_arena_mark mark;
+  int status = 0;
+  int ret = 1;
+
+  ush_arena_mark(&cmd_arena, &mark);
+  ush_loop_depth++;
+  while(!ush_interrupted){
+    //What the last iteration allocated is no longer in use.
+    ush_arena_rewind(&cmd_arena, &mark);
+    ush_glob_reset();
+    if(!ush_execute_list(command->cond)){
+      ret = 0;
+      break;
+    }
+    if(ush_flow != USH_FLOW_NONE){
+      if(ush_loop_interrupted()){
+        break;
+      }
+      continue;
+    }
+    if((ush_last_status == 0) != (command->kind == USH_CMD_WHILE)){
+      break;
+    }
+    if(!ush_execute_list(command->body)){
+      ret = 0;
+      break;
+    }
+    status = ush_last_status;
+    if(ush_loop_interrupted()){
+      break;
+    }
+  }
+  ush_loop_depth--;
+  if(ret){
+    ush_last_status = ush_interrupted ? 130 : status;
+  }
+  return ret;
+}
+
+/**
+   @brief Run a for loop.  The words are expanded (and globbed) once, then
+   the body runs for each value.
+   @param command The loop.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_execute_for(struct ush_command *command)
+{
+  struct ush_arena_mark mark;
+  char **values = params.argv;
+  int ret = 1;
+
+  if(command->words != NULL){
+    struct ush_command words;
+
+    memset(&words, 0, sizeof(words));
+    words.words = command->words;
+    values = ush_command_argv(&words);
+  }
+  ush_last_status = 0;
+  ush_arena_mark(&cmd_arena, &mark);
+  ush_loop_depth++;
+  for (size_t i = 0; values[i] != NULL && !ush_interrupted; i++){
+    ush_arena_rewind(&cmd_arena, &mark);
+    ush_glob_reset();
+    ush_var_set(command->name, values[i]);
+    if(!ush_execute_list(command->body)){
+      ret = 0;
+      break;
+    }
+    if(ush_loop_interrupted()){
+      break;
+    }
+  }
+  ush_loop_depth--;
+  if(ush_interrupted){
+    ush_last_status = 130;
+  }
+  return ret;
+}
+
+/**
+   @brief Run a compound command, or define a function, in the shell itself.
+   Everything runs from the parsed form; a loop body is not parsed again for
+   each iteration, and an iteration that only runs builtins does not fork.
+   @param command The command; its redirections are already in place.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_execute_compound(struct ush_command *command)
+{
+  switch(command->kind){
+  case USH_CMD_IF:
+    if(!ush_execute_list(command->cond)){
+      return 0;
+    }
+    if(ush_flow != USH_FLOW_NONE){
+      return 1;
+    }
+    if(ush_last_status == 0){
+      return ush_execute_list(command->body);
+    }
+    if(command->orelse != NULL){
+      return ush_execute_list(command->orelse);
+    }
+    ush_last_status = 0;
+    return 1;
+  case USH_CMD_WHILE:
+  case USH_CMD_UNTIL:
+    return ush_execute_while(command);
+  case USH_CMD_FOR:
+    return ush_execute_for(command);
+  case USH_CMD_GROUP:
+    return ush_execute_list(command->body);
+  default:
+    ush_define_function(command);
+    return 1;
+  }
+}
+
+/**
+   @brief Start a break or continue.
+   @param args List of args.  args[1], if given, is the number of enclosing
+   loops it applies to (default 1).
+   @param flow USH_FLOW_BREAK or USH_FLOW_CONTINUE.
+   @return Always returns 1, to continue executing.
+ */
+int ush_loop_control(char **args, int flow)
+{
+  long levels = (args[1] != NULL) ? atol(args[1]) : 1;
+
+  if(levels < 1){
+    fprintf(stderr, "ush: %s: %s: loop count out of range\n", args[0], args[1]);
+    ush_last_status = 1;
+    return 1;
+  }
+  if(ush_loop_depth == 0){
+    fprintf(stderr, "ush: %s: only meaningful in a loop\n", args[0]);
+    return 1;
+  }
+  ush_flow = flow;
+  ush_flow_levels = (levels < ush_loop_depth) ? levels : ush_loop_depth;
+  return 1;
+}
+
+/**
+   @brief Builtin command: leave the enclosing loop.
+   @param args List of args.  args[0] is "break".  args[1], if given, is the
+   number of loops to leave.
+   @return Always returns 1, to continue executing.
+ */
+int ush_break(char **args)
+{
+  return ush_loop_control(args, USH_FLOW_BREAK);
+}
+
+/**
+   @brief Builtin command: go on with the next iteration of the enclosing loop.
+   @param args List of args.  args[0] is "continue".  args[1], if given,
+   counts the loops out from the innermost one to continue.
+   @return Always returns 1, to continue executing.
+ */
+int ush_continue(char **args)
+{
+  return ush_loop_control(args, USH_FLOW_CONTINUE);
+}
+
+/**
+   @brief Builtin command: return from a function.
+   @param args List of args.  args[0] is "return".  args[1], if given, is the
+   status to return; otherwise it is that of the last command.
+   @return Always returns 1, to continue executing.
+ */
+int ush_return(char **args)
+{
+  if(ush_func_depth == 0){
+    fprintf(stderr, "ush: return: can only `return' from a function\n");
+    ush_last_status = 1;
+    return 1;
+  }
+  ush_last_status = (args[1] != NULL) ? atoi(args[1]) & 0xff : ush_prev_status;
+  ush_flow = USH_FLOW_RETURN;
+  return 1;
+}
+
+/**
+   @brief Builtin command: shift the positional parameters.
+   @param args List of args.  args[0] is "shift".  args[1], if given, is how
+   many to drop from the front (default 1).
+   @return Always returns 1, to continue executing.
+ */
+int ush_shift(char **args)
+{
+  long n = (args[1] != NULL) ? atol(args[1]) : 1;
+
+  if(n < 0 || (size_t)n > params.argc){
+    fprintf(stderr, "ush: shift: %ld: shift count out of range\n", n);
+    ush_last_status = 1;
+    return 1;
+  }
+  params.argv += n;
+  params.argc -= n;
+  return 1;
+}
+
+/**
+ * Command substitution.  The commands are parsed once, through the parse
+ * cache, and run the cheapest way that leaves the shell as it was.  A list
+ * of builtins that only print (USH_BUILTIN_PIPESAFE, without assignments or
+ * redirections) runs in the shell itself with its output captured: no
+ * process is started.  A single other command is started directly, with
+ * its output going to subst_pipe, and anything else runs in a forked copy
+ * of the shell.  The shell keeps both ends of the pipe, so it serves one
+ * substitution after another: the output is read while the commands run
+ * and the rest once they have exited.  Anything written to it later, by a
+ * process they left running, is thrown away by the next substitution.
+ */
+
+/**
+   @brief Check whether a substitution can run in the shell itself.
+   @param list Its commands.
+   @return Nonzero if they are all plain calls of USH_BUILTIN_PIPESAFE builtins.
+ */
+int ush_subst_in_shell(struct ush_list *list)
+{
+  for (size_t i = 0; i < list->count; i++){
+    struct ush_pipeline *pipeline = &list->pipelines[i];
+    struct ush_command *command = &pipeline->commands[0];
+    const struct ush_builtin *builtin;
+
+    if(pipeline->count != 1 || pipeline->background || pipeline->timed || command->kind != USH_CMD_SIMPLE
+       || command->num_assigns > 0 || command->num_redirects > 0 || command->words[0] == NULL){
+      return 0;
+    }
+    //The name must be one as written, not one that comes from an expansion.
+    if(strpbrk(command->words[0], "'\"\\$`*?[") != NULL || ush_find_function(command->words[0]) != NULL){
+      return 0;
+    }
+    builtin = ush_find_builtin(command->words[0]);
+    if(builtin == NULL || !(builtin->flags & USH_BUILTIN_PIPESAFE)){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+   @brief Read what is in the substitution pipe into capture_buf.
+ */
+void ush_subst_read()
+{
+  for (;;){
+    ssize_t n;
+
+    capture_buf = ush_grow_array(capture_buf, &capture_capacity, capture_len + USH_READ_CHUNK, 1);
+    n = read(subst_pipe[0], capture_buf + capture_len, capture_capacity - capture_len - 1);
+    if(n > 0){
+      capture_len += n;
+    }
+    else if(n == 0 || errno != EINTR){
+      //EAGAIN: nothing more for now.
+      return;
+    }
+  }
+}
+
+/**
+   @brief Wait for the commands of a substitution, reading their output as
+   they run so that they never wait on a full pipe.
+   @param job Their job.
+ */
+void ush_subst_wait(struct ush_job *job)
+{
+  struct pollfd pfd[2] = { { subst_pipe[0], POLLIN, 0 }, { ush_sigchld_fd, POLLIN, 0 } };
+
+  while(job->state == USH_JOB_RUNNING){
+    //Without ush_sigchld_fd, look for the children now and then.
+    if(poll(pfd, (ush_sigchld_fd >= 0) ? 2 : 1, (ush_sigchld_fd >= 0) ? -1 : 10) < 0 && errno != EINTR){
+      break;
+    }
+    ush_subst_read();
+    if(ush_sigchld_fd < 0 || (pfd[1].revents & POLLIN)){
+      ush_reap_children();
+    }
+  }
+  //What they wrote before exiting is all in the pipe.
+  ush_subst_read();
+  ush_last_status = ush_job_wait(job);
+}
+
+/**
+   @brief Start a substitution of a single simple command, the output
+   going to the substitution pipe, or run it in the shell if it turns out
+   to be a builtin that only prints.
+   @param command The command.
+   @return Pid of the child, 0 if nothing was started, or -1 on failure
+   (error already reported, status set).
+ */
+pid_t ush_subst_command(struct ush_command *command)
+{
+  char **argv = ush_command_argv(command);
+  int fds[3] = { -1, subst_pipe[1], -1 };
+  int *opened = ush_arena_alloc(&cmd_arena, (command->num_redirects + 1) * sizeof(int));
+  size_t num_opened;
+  const struct ush_builtin *builtin = NULL;
+  struct ush_function *func = NULL;
+  pid_t pid = 0;
+
+  if(ush_open_redirects(command, fds, opened, &num_opened) < 0){
+    ush_last_status = 1;
+    return -1;
+  }
+  if(argv[0] != NULL && (func = ush_find_function(argv[0])) == NULL){
+    builtin = ush_find_builtin(argv[0]);
+  }
+
+  if(argv[0] == NULL){
+    //Assignments and redirections only, made in a subshell: nothing to do.
+    ush_last_status = 0;
+  }
+  else if(func != NULL){
+    pid = ush_fork_shell(command, func, argv, fds);
+  }
+  else if(builtin != NULL && (builtin->flags & USH_BUILTIN_PIPESAFE) && command->num_assigns == 0 && fds[1] == subst_pipe[1]){
+    int builtin_fds[3] = { fds[0], -1, fds[2] };
+    int outer = capturing;
+
+    capturing = 1;
+    ush_run_builtin_redirected(builtin, argv, builtin_fds);
+    capturing = outer;
+  }
+  else{
+    struct ush_saved_var *saved = ush_arena_alloc(&cmd_arena, (command->num_assigns + 1) * sizeof(struct ush_saved_var));
+
+    //The child takes its environment with it when it starts.
+    ush_assign(command, saved);
+    pid = (builtin != NULL) ? ush_fork_builtin(builtin, argv, fds) : ush_spawn(argv, fds);
+    ush_assign_restore(saved, command->num_assigns);
+    if(pid < 0){
+      ush_last_status = 127;
+    }
+  }
+  ush_close_redirects(opened, num_opened);
+  return pid;
+}
+
+/**
+   @brief Run the commands of a command substitution and collect their output.
+   $? is then their exit status.
+   @param text The commands.
+   @param len Receives the length of the output.
+   @return The output, without its trailing newlines, from the command arena.
+ */
+char* ush_substitute(const char *text, size_t *len)
+{
+  struct ush_list *list;
+  size_t base = capture_len;
+  int incomplete;
+  char *output;
+  size_t n = 0;
+
+  subst_count++;
+  list = ush_parse_line(text, &incomplete);
+  if(list == NULL){
+    if(incomplete){
+      fprintf(stderr, "ush: syntax error: unexpected end of file\n");
+    }
+    ush_last_status = 2;
+  }
+  else if(ush_subst_in_shell(list)){
+    int outer = capturing;
+
+    capturing = 1;
+    ush_execute_list(list);
+    capturing = outer;
+  }
+  else if(subst_pipe[0] < 0 && (pipe2(subst_pipe, O_CLOEXEC) != 0 || fcntl(subst_pipe[0], F_SETFL, O_NONBLOCK) != 0)){
+    //Only the shell's end is non-blocking.
+    perror("ush");
+    subst_pipe[0] = subst_pipe[1] = -1;
+    ush_last_status = 1;
+  }
+  else{
+    struct ush_pipeline *pipeline = &list->pipelines[0];
+    struct ush_command group;
+    struct ush_spawn_group outer = spawn_group;
+    struct ush_job *job = ush_job_new(text, 0);
+    pid_t pid;
+
+    //Whatever is left from before is stale.
+    ush_subst_read();
+    capture_len = base;
+    if(list->count == 1 && pipeline->count == 1 && !pipeline->background && !pipeline->timed
+       && pipeline->commands[0].kind == USH_CMD_SIMPLE){
+      pid = ush_subst_command(&pipeline->commands[0]);
+    }
+    else{
+      int fds[3] = { -1, subst_pipe[1], -1 };
+
+      memset(&group, 0, sizeof(group));
+      group.kind = USH_CMD_GROUP;
+      group.body = list;
+      if((pid = ush_fork_shell(&group, NULL, NULL, fds)) < 0){
+        ush_last_status = 1;
+      }
+    }
+    if(pid > 0){
+      ush_job_add_process(job, pid, text);
+      ush_subst_wait(job);
+    }
+    else{
+      ush_job_release(job);
+    }
+    //The substitution may be in the middle of starting the stages of a pipeline.
+    spawn_group = outer;
+  }
+
+  //NUL bytes cannot be part of an argument.
+  for (size_t i = base; i < capture_len; i++){
+    if(capture_buf[i] != '\0'){
+      capture_buf[base + n++] = capture_buf[i];
+    }
+  }
+  while(n > 0 && capture_buf[base + n - 1] == '\n'){
+    n--;
+  }
+  output = ush_arena_strndup(&cmd_arena, (n > 0) ? capture_buf + base : "", n);
+  capture_len = base;
+  *len = n;
+  return output;
+}
+
+/**
+   @brief Builtin command: run a command and report its resource usage.
+   A pipeline starting with "time" is timed as a whole by the shell; this
+   runs when "time" is reached as a command (e.g. "env time ls").
+   @param args List of args.  args[0] is "time".  The rest is the command.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_time(char **args)
+{
+  int started = ush_timing_begin();
+  int ret = ush_execute(args + 1);
+
+  if(started){
+    ush_timing_end();
+  }
+  return ret;
+}
+
+/**
+ * Source of arguments for the fan-out builtins: either a list of words, where
+ * deferred patterns are expanded as they are reached, or the lines of a
+ * reader.  With sorted set (for -k) the patterns are walked through the
+ * directory cache, in sorted order, instead of straight from getdents64().
+ */
+struct ush_argsrc {
+  char **list;
+  struct ush_reader *reader;
+  struct ush_glob_stream glob;
+  int globbing;
+  int sorted;
+};
+
+/**
+   @brief Get the next argument from a source.
+   @param src The source.
+   @return The argument (valid until the next call), or NULL when exhausted.
+ */
+const char* ush_argsrc_next(struct ush_argsrc *src)
+{
+  if(src->list == NULL){
+    return ush_reader_line(src->reader);
+  }
+  for (;;){
+    const char *pattern;
+
+    if(src->globbing){
+      const char *match = ush_glob_next(&src->glob);
+
+      if(match != NULL){
+        return match;
+      }
+      ush_glob_close(&src->glob, 1);
+      src->globbing = 0;
+    }
+    if(*src->list == NULL){
+      return NULL;
+    }
+    if((pattern = ush_arg_pattern(src->list)) == NULL){
+      return *src->list++;
+    }
+    ush_glob_open(&src->glob, pattern, *src->list++, src->sorted);
+    src->globbing = 1;
+  }
+}
+
+/**
+   @brief Build the command line for one argument of a template.
+   Every "{}" in the template is replaced by the argument; if there is no
+   "{}" at all the argument is appended.
+   @param arena Arena the new argv is allocated from.
+   @param template Null terminated command template.
+   @param arg The argument.
+   @return Null terminated argv.
+ */
+char** ush_expand_template(struct ush_arena *arena, char **template, const char *arg)
+{
+  size_t argc = 0;
+  size_t arg_len = strlen(arg);
+  int used = 0;
+  char **argv;
+
+  while(template[argc] != NULL){
+    argc++;
+  }
+  argv = ush_arena_alloc(arena, (argc + 2) * sizeof(char*));
+  for (size_t i = 0; i < argc; i++){
+    const char *word = template[i];
+    const char *hole = strstr(word, "{}");
+    size_t holes = 0;
+    char *out;
+
+    if(hole == NULL){
+      argv[i] = (char*)word;
+      continue;
+    }
+    for (const char *p = hole; p != NULL; p = strstr(p + 2, "{}")){
+      holes++;
+    }
+    out = argv[i] = ush_arena_alloc(arena, strlen(word) + holes * arg_len + 1);
+    for (const char *p = word; *p != '\0'; ){
+      if(p[0] == '{' && p[1] == '}'){
+        memcpy(out, arg, arg_len);
+        out += arg_len;
+        p += 2;
+      }
+      else{
+        *out++ = *p++;
+      }
+    }
+    *out = '\0';
+    used = 1;
+  }
+  if(!used){
+    argv[argc++] = ush_arena_strndup(arena, arg, arg_len);
+  }
+  argv[argc] = NULL;
+  return argv;
+}
+
+/**
+ * Longest single argument execve() accepts (MAX_ARG_STRLEN on Linux).
+ */
+#define USH_MAX_ARG_STRLEN (32 * 4096)
+
+/**
+ * Room kept free below the argument size limit, as xargs does.
+ */
+#define USH_ARG_HEADROOM 2048
+
+/**
+ * Turns a stream of arguments into the command lines run by the fan-out
+ * builtins: one per argument through a template (parallel), or, when
+ * batching, the fixed words followed by as many arguments as fit (batch).
+ */
+struct ush_cmdgen {
+  char **template;
+  struct ush_argsrc *src;
+  int batching;
+  size_t max_args;
+  size_t max_bytes;
+  size_t skipped;
+  char **argv;
+  size_t argv_capacity;
+  char *carry;
+  size_t carry_capacity;
+  int has_carry;
+};
+
+/**
+   @brief Room for the arguments of one batch.
+   The kernel counts every argument and environment string, NUL included,
+   plus its pointer, against sysconf(_SC_ARG_MAX).
+   @param template The fixed words of the command.
+   @return Bytes left for the batched arguments.
+ */
+size_t ush_batch_budget(char **template)
+{
+  long arg_max = sysconf(_SC_ARG_MAX);
+  size_t used = USH_ARG_HEADROOM + sizeof(char*);
+  char **envp = ush_envp();
+
+  for (size_t i = 0; envp[i] != NULL; i++){
+    used += strlen(envp[i]) + 1 + sizeof(char*);
+  }
+  for (size_t i = 0; template[i] != NULL; i++){
+    used += strlen(template[i]) + 1 + sizeof(char*);
+  }
+  if(arg_max <= 0){
+    arg_max = 131072;
+  }
+  return ((size_t)arg_max > used) ? arg_max - used : 0;
+}
+
+/**
+   @brief Produce the next command line.
+   @param gen The generator.
+   @param arena Arena the command line is allocated from.
+   @return Null terminated argv, or NULL once the arguments are exhausted.
+ */
+char** ush_cmdgen_next(struct ush_cmdgen *gen, struct ush_arena *arena)
+{
+  size_t argc = 0;
+  size_t bytes = 0;
+  size_t num_args = 0;
+  char **argv;
+
+  if(!gen->batching){
+    const char *arg = ush_argsrc_next(gen->src);
+
+    return (arg != NULL) ? ush_expand_template(arena, gen->template, arg) : NULL;
+  }
+
+  while(gen->template[argc] != NULL){
+    gen->argv = ush_grow_array(gen->argv, &gen->argv_capacity, argc + 1, sizeof(char*));
+    gen->argv[argc] = gen->template[argc];
+    argc++;
+  }
+  for (;;){
+    const char *arg = gen->has_carry ? gen->carry : ush_argsrc_next(gen->src);
+    size_t len, cost;
+
+    if(arg == NULL){
+      break;
+    }
+    len = strlen(arg);
+    cost = len + 1 + sizeof(char*);
+    if(len >= USH_MAX_ARG_STRLEN || cost > gen->max_bytes){
+      fprintf(stderr, "ush: batch: argument too long: %.40s...\n", arg);
+      gen->skipped++;
+      gen->has_carry = 0;
+      continue;
+    }
+    if(bytes + cost > gen->max_bytes || (gen->max_args > 0 && num_args == gen->max_args)){
+      //Starts the next batch; the source may reuse its buffer meanwhile.
+      if(!gen->has_carry){
+        gen->carry = ush_grow_array(gen->carry, &gen->carry_capacity, len + 1, 1);
+        memcpy(gen->carry, arg, len + 1);
+        gen->has_carry = 1;
+      }
+      break;
+    }
+    gen->argv = ush_grow_array(gen->argv, &gen->argv_capacity, argc + 1, sizeof(char*));
+    gen->argv[argc++] = ush_arena_strndup(arena, arg, len);
+    bytes += cost;
+    num_args++;
+    gen->has_carry = 0;
+  }
+  if(num_args == 0){
+    return NULL;
+  }
+  argv = ush_arena_alloc(arena, (argc + 1) * sizeof(char*));
+  memcpy(argv, gen->argv, argc * sizeof(char*));
+  argv[argc] = NULL;
+  return argv;
+}
+
+/**
+ * A running command of a fan-out, and the output it has produced so far.
+ */
+struct ush_fanout_task {
+  size_t seq;
+  struct ush_job *job;
+  int fd;
+  char *out;
+  size_t len;
+  size_t capacity;
+};
+
+/**
+ * Fan-out runner shared by the parallel and batch builtins: runs one command
+ * per call of the producer with at most max_jobs children at a time.  Each
+ * child's stdout goes to its own pipe and is emitted in one piece when the
+ * child finishes, either as soon as it finishes or in start order.
+ */
+struct ush_fanout {
+  size_t max_jobs;
+  int keep_order;
+  int child_stdin;
+  struct ush_fanout_task *tasks;
+  size_t running;
+
+  //Finished tasks waiting for an earlier one (keep_order only).
+  struct ush_fanout_task *held;
+  size_t num_held;
+  size_t held_capacity;
+
+  size_t next_seq;
+  size_t next_emit;
+  size_t failed;
+  struct ush_arena arena;
+};
+
+/**
+   @brief Give up on a command that could not be started, so that its place
+   in the order does not hold up the output of later ones.
+   @param fan The fan-out.
+   @param task The task, with its sequence number.
+ */
+void ush_fanout_skip(struct ush_fanout *fan, struct ush_fanout_task *task)
+{
+  fan->failed++;
+  if(task->seq == fan->next_emit){
+    fan->next_emit++;
+  }
+  else if(fan->keep_order){
+    fan->held = ush_grow_array(fan->held, &fan->held_capacity, fan->num_held + 1, sizeof(struct ush_fanout_task));
+    fan->held[fan->num_held] = *task;
+    fan->held[fan->num_held].out = NULL;
+    fan->held[fan->num_held].len = 0;
+    fan->num_held++;
+  }
+}
+
+/**
+   @brief Start one command of a fan-out.
+   @param fan The fan-out; a task slot must be free.
+   @param argv The command.
+   @return 0 if started, -1 if it could not be started (counted as failed).
+ */
+int ush_fanout_start(struct ush_fanout *fan, char **argv)
+{
+  const struct ush_builtin *builtin = ush_find_builtin(argv[0]);
+  struct ush_fanout_task *task = NULL;
+  int fds[3] = { fan->child_stdin, -1, -1 };
+  int pipefd[2];
+  pid_t pid;
+
+  for (size_t i = 0; i < fan->max_jobs && task == NULL; i++){
+    if(fan->tasks[i].job == NULL){
+      task = &fan->tasks[i];
+    }
+  }
+  task->seq = fan->next_seq++;
+  if(pipe2(pipefd, O_CLOEXEC) != 0){
+    perror("ush");
+    ush_fanout_skip(fan, task);
+    return -1;
+  }
+  //Only our end is non-blocking; the child sees an ordinary pipe.
+  fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+  fds[1] = pipefd[1];
+  task->job = ush_job_new(argv[0], 0);
+  //Several run at once, so none of them has the terminal: Ctrl-C reaches
+  //the shell, which passes it on (see ush_fanout_run()).
+  task->job->foreground = spawn_group.foreground = 0;
+  pid = (builtin != NULL) ? ush_fork_builtin(builtin, argv, fds) : ush_spawn(argv, fds);
+  close(pipefd[1]);
+  if(pid < 0){
+    ush_job_release(task->job);
+    task->job = NULL;
+    close(pipefd[0]);
+    ush_fanout_skip(fan, task);
+    return -1;
+  }
+  ush_job_add_process(task->job, pid, argv[0]);
+  task->fd = pipefd[0];
+  task->len = 0;
+  fan->running++;
+  return 0;
+}
+
+/**
+   @brief Emit held outputs that are now next in order.
+   @param fan The fan-out.
+ */
+void ush_fanout_flush_held(struct ush_fanout *fan)
+{
+  for (size_t i = 0; i < fan->num_held; ){
+    struct ush_fanout_task *held = &fan->held[i];
+
+    if(held->seq != fan->next_emit){
+      i++;
+      continue;
+    }
+    ush_write_all(1, held->out, held->len);
+    free(held->out);
+    fan->next_emit++;
+    *held = fan->held[--fan->num_held];
+    i = 0;
+  }
+}
+
+/**
+   @brief Finish a task whose child has exited and whose pipe is at EOF.
+   @param fan The fan-out.
+   @param task The task.
+ */
+void ush_fanout_finish(struct ush_fanout *fan, struct ush_fanout_task *task)
+{
+  if(ush_job_status(task->job) != 0){
+    fan->failed++;
+  }
+  ush_job_release(task->job);
+  task->job = NULL;
+  fan->running--;
+
+  if(!fan->keep_order || task->seq == fan->next_emit){
+    ush_write_all(1, task->out, task->len);
+    fan->next_emit++;
+  }
+  else{
+    //Hand the buffer over to the held list; the slot gets a new one later.
+    fan->held = ush_grow_array(fan->held, &fan->held_capacity, fan->num_held + 1, sizeof(struct ush_fanout_task));
+    fan->held[fan->num_held++] = *task;
+    task->out = NULL;
+    task->capacity = 0;
+  }
+  if(fan->keep_order){
+    ush_fanout_flush_held(fan);
+  }
+}
+
+/**
+   @brief Wait for some child of a fan-out to make progress.
+   Collects output from every readable pipe and finishes completed tasks.
+   @param fan The fan-out.
+ */
+void ush_fanout_step(struct ush_fanout *fan)
+{
+  struct pollfd *pfd = ush_arena_alloc(&fan->arena, (fan->max_jobs + 1) * sizeof(struct pollfd));
+  size_t num_pfd = 0;
+
+  for (size_t i = 0; i < fan->max_jobs; i++){
+    if(fan->tasks[i].job != NULL && fan->tasks[i].fd >= 0){
+      pfd[num_pfd].fd = fan->tasks[i].fd;
+      pfd[num_pfd].events = POLLIN;
+      num_pfd++;
+    }
+  }
+  pfd[num_pfd].fd = ush_sigchld_fd;
+  pfd[num_pfd].events = POLLIN;
+
+  if(poll(pfd, num_pfd + 1, -1) > 0 && (pfd[num_pfd].revents & POLLIN)){
+    ush_reap_children();
+  }
+
+  for (size_t i = 0; i < fan->max_jobs; i++){
+    struct ush_fanout_task *task = &fan->tasks[i];
+
+    if(task->job == NULL){
+      continue;
+    }
+    while(task->fd >= 0){
+      ssize_t n;
+
+      if(task->capacity - task->len < USH_READ_CHUNK){
+        task->capacity = (task->capacity == 0) ? USH_READ_CHUNK : 2 * task->capacity;
+        task->out = ush_realloc(task->out, task->capacity);
+      }
+      n = read(task->fd, task->out + task->len, task->capacity - task->len);
+      if(n > 0){
+        task->len += n;
+        continue;
+      }
+      if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+        break;
+      }
+      close(task->fd);
+      task->fd = -1;
+    }
+    if(task->fd < 0 && task->job->state == USH_JOB_DONE){
+      ush_fanout_finish(fan, task);
+    }
+  }
+}
+
+/**
+   @brief Run commands over a stream of arguments with bounded concurrency.
+   @param gen Where the command lines come from.
+   @param max_jobs Maximum number of children at once.
+   @param keep_order Nonzero to emit outputs in argument order.
+   @param child_stdin Descriptor given to the children as stdin (-1 to inherit).
+   @return Number of commands that failed.
+ */
+size_t ush_fanout_run(struct ush_cmdgen *gen, size_t max_jobs, int keep_order, int child_stdin)
+{
+  struct ush_fanout fan;
+  char **argv;
+
+  memset(&fan, 0, sizeof(fan));
+  fan.max_jobs = max_jobs;
+  fan.keep_order = keep_order;
+  fan.child_stdin = child_stdin;
+  fan.tasks = calloc(max_jobs, sizeof(struct ush_fanout_task));
+  if(fan.tasks == NULL){
+    fprintf(stderr, "ush: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  ush_heap_allocs++;
+
+  fflush(stdout);
+  //The argv only has to live until the child has been started.
+  while(!ush_interrupted && (argv = ush_cmdgen_next(gen, &fan.arena)) != NULL){
+    ush_fanout_start(&fan, argv);
+    while(fan.running == fan.max_jobs && !ush_interrupted){
+      ush_fanout_step(&fan);
+    }
+    ush_arena_reset(&fan.arena);
+  }
+  if(ush_interrupted){
+    //Ctrl-C: start no more, and pass it on to those running.
+    for (size_t i = 0; i < max_jobs; i++){
+      if(fan.tasks[i].job != NULL && fan.tasks[i].job->pgid > 0){
+        killpg(fan.tasks[i].job->pgid, SIGINT);
+      }
+    }
+  }
+  while(fan.running > 0){
+    ush_arena_reset(&fan.arena);
+    ush_fanout_step(&fan);
+  }
+  ush_fanout_flush_held(&fan);
+
+  for (size_t i = 0; i < max_jobs; i++){
+    free(fan.tasks[i].out);
+  }
+  free(fan.tasks);
+  free(fan.held);
+  ush_arena_release(&fan.arena);
+  return fan.failed;
+}
+
+/**
+   @brief Parse the options of the fan-out builtins: "-j N", "-k" and, for
+   batch, "-n N".
+   @param args Arguments of the builtin; args[0] is its name.
+   @param max_jobs Receives -j (left alone if not given).
+   @param keep_order Receives whether -k was given.
+   @param max_args Receives -n (left alone if not given), or NULL if -n is not accepted.
+   @return Index of the first argument after the options, or -1 on a usage error.
+ */
+int ush_fanout_options(char **args, size_t *max_jobs, int *keep_order, size_t *max_args)
+{
+  int i;
+
+  *keep_order = 0;
+  for (i = 1; args[i] != NULL && args[i][0] == '-'; i++){
+    if(strcmp(args[i], "-k") == 0){
+      *keep_order = 1;
+    }
+    else if(strcmp(args[i], "-j") == 0 && args[i + 1] != NULL && atol(args[i + 1]) > 0){
+      *max_jobs = atol(args[++i]);
+    }
+    else if(max_args != NULL && strcmp(args[i], "-n") == 0 && args[i + 1] != NULL && atol(args[i + 1]) > 0){
+      *max_args = atol(args[++i]);
+    }
+    else{
+      return -1;
+    }
+  }
+  return (args[i] == NULL || strcmp(args[i], ":::") == 0) ? -1 : i;
+}
+
+/**
+   @brief Set up where a fan-out builtin takes its arguments from.
+   @param args Arguments of the builtin; a ":::" in them is replaced by NULL.
+   @param start Index of the command.
+   @param src Receives the source: the words after ":::", or else the lines of stdin.
+   @param reader Reader to use for stdin.
+   @return Descriptor the commands get as stdin (/dev/null when the arguments
+   come from stdin), or -1 to let them inherit it.
+ */
+int ush_fanout_source(char **args, int start, struct ush_argsrc *src, struct ush_reader *reader)
+{
+  int i;
+
+  memset(src, 0, sizeof(*src));
+  for (i = start; args[i] != NULL && strcmp(args[i], ":::") != 0; i++)
+    ;
+  if(args[i] != NULL){
+    args[i] = NULL;
+    src->list = args + i + 1;
+    return -1;
+  }
+  //Arguments come from stdin, so the commands must not read it too.
+  src->reader = reader;
+  return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/**
+   @brief Builtin command: run a command once per argument, several at a time.
+   @param args List of args.  args[0] is "parallel".  Then the options
+   "-j N" (at most N at once, default: number of CPUs) and "-k" (keep output
+   in argument order), the command template, and optionally ":::" followed
+   by the arguments; without ":::" the arguments are the lines of stdin.
+   @return Always returns 1, to continue executing.
+ */
+int ush_parallel(char **args)
+{
+  struct ush_argsrc src;
+  struct ush_reader reader = { 0, NULL, 0, 0, 0, 0, USH_READ_CHUNK, 0 };
+  struct ush_cmdgen gen;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_jobs = (cpus > 0) ? cpus : 1;
+  int keep_order;
+  int child_stdin;
+  int start = ush_fanout_options(args, &max_jobs, &keep_order, NULL);
+
+  if(start < 0){
+    fprintf(stderr, "ush: usage: parallel [-j N] [-k] command [args...] [::: arg...]\n");
+    ush_last_status = 2;
+    return 1;
+  }
+  child_stdin = ush_fanout_source(args, start, &src, &reader);
+  src.sorted = keep_order;
+  memset(&gen, 0, sizeof(gen));
+  gen.template = args + start;
+  gen.src = &src;
+
+  size_t failed = ush_fanout_run(&gen, max_jobs, keep_order, child_stdin);
+  ush_last_status = (failed > 101) ? 101 : failed;
+
+  if(child_stdin >= 0){
+    close(child_stdin);
+  }
+  free(reader.buf);
+  return 1;
+}
+
+/**
+   @brief Builtin command: run a command over many arguments, each run taking
+   as many arguments as fit in one execve().
+   @param args List of args.  args[0] is "batch".  Then the options "-j N"
+   (run N batches at once through the fan-out, default 1: one after the
+   other, with the shell's output), "-k" (with -j, keep output in order) and
+   "-n N" (at most N arguments per run), the command and its fixed
+   arguments, and optionally ":::" followed by the arguments; without ":::"
+   the arguments are the lines of stdin.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int ush_batch(char **args)
+{
+  struct ush_argsrc src;
+  struct ush_reader reader = { 0, NULL, 0, 0, 0, 0, USH_READ_CHUNK, 0 };
+  struct ush_cmdgen gen;
+  size_t max_jobs = 1;
+  size_t max_args = 0;
+  size_t failed = 0;
+  int keep_order;
+  int child_stdin;
+  int start = ush_fanout_options(args, &max_jobs, &keep_order, &max_args);
+  int ret = 1;
+
+  if(start < 0){
+    fprintf(stderr, "ush: usage: batch [-j N] [-k] [-n N] command [args...] [::: arg...]\n");
+    ush_last_status = 2;
+    return 1;
+  }
+  child_stdin = ush_fanout_source(args, start, &src, &reader);
+  src.sorted = keep_order;
+  memset(&gen, 0, sizeof(gen));
+  gen.template = args + start;
+  gen.src = &src;
+  gen.batching = 1;
+  gen.max_args = max_args;
+  gen.max_bytes = ush_batch_budget(gen.template);
+
+  if(max_jobs > 1){
+    failed = ush_fanout_run(&gen, max_jobs, keep_order, child_stdin);
+  }
+  else{
+    const struct ush_builtin *builtin = ush_find_builtin(args[start]);
+    int fds[3] = { child_stdin, -1, -1 };
+    struct ush_arena arena;
+    char **argv;
+
+    memset(&arena, 0, sizeof(arena));
+    while(ret && (argv = ush_cmdgen_next(&gen, &arena)) != NULL){
+      ush_last_status = 0;
+      ret = (builtin != NULL) ? ush_run_builtin_redirected(builtin, argv, fds) : ush_launch(argv, fds);
+      failed += (ush_last_status != 0);
+      ush_arena_reset(&arena);
+    }
+    ush_arena_release(&arena);
+  }
+  failed += gen.skipped;
+  ush_last_status = (failed > 101) ? 101 : failed;
+
+  if(child_stdin >= 0){
+    close(child_stdin);
+  }
+  free(gen.argv);
+  free(gen.carry);
+  free(reader.buf);
+  return ret;
+}
+
+/**
+ * Worker pools: helper programs started once and kept running, each attached
+ * to the shell by a pipe to its stdin and one from its stdout, so repeated
+ * calls skip fork, exec and dynamic linking.  A worker must be a line
+ * filter that answers every line it reads with exactly one line and flushes
+ * it (e.g. "sed -u", "jq -c --unbuffered", "bc").  Requests are handed to the
+ * workers in turn with at most one outstanding per worker, and replies are
+ * written in request order.  The workers are not jobs: a pool lives until
+ * "pool stop", and a worker that dies is reaped like any other child.
+ */
+#define USH_POOL_OUT_CHUNK 65536
+
+struct ush_worker {
+  pid_t pid;
+  int in;
+  struct ush_reader out;
+};
+
+struct ush_pool {
+  char *name;
+  char *text;
+  struct ush_worker *workers;
+  size_t num_workers;
+  size_t next;
+  unsigned long served;
+  struct ush_pool *next_pool;
+};
+
+struct ush_pool *pools = NULL;
+char *pool_out = NULL;
+size_t pool_out_len = 0;
+size_t pool_out_capacity = 0;
+
+/**
+   @brief Join words with single spaces.
+   @param words Null terminated list of words.
+   @param arena Arena to allocate the result from, or NULL for the heap.
+   @return The joined string.
+ */
+char* ush_join_words(char **words, struct ush_arena *arena)
+{
+  size_t len = 0;
+  char *joined;
+  char *p;
+
+  for (size_t i = 0; words[i] != NULL; i++){
+    len += strlen(words[i]) + 1;
+  }
+  joined = (arena != NULL) ? ush_arena_alloc(arena, len + 1) : ush_malloc(len + 1);
+  p = joined;
+  for (size_t i = 0; words[i] != NULL; i++){
+    size_t n = strlen(words[i]);
+
+    if(i > 0){
+      *p++ = ' ';
+    }
+    memcpy(p, words[i], n);
+    p += n;
+  }
+  *p = '\0';
+  return joined;
+}
+
+/**
+   @brief Find a pool by name.
+   @param name The name.
+   @return Link pointing to the pool (*link is NULL if there is none).
+ */
+struct ush_pool** ush_pool_find(const char *name)
+{
+  struct ush_pool **link = &pools;
+
+  while(*link != NULL && strcmp((*link)->name, name) != 0){
+    link = &(*link)->next_pool;
+  }
+  return link;
+}
+
+/**
+   @brief Stop a pool: close the workers' input and wait for them to exit.
+   @param pool The pool, already unlinked.
+ */
+void ush_pool_free(struct ush_pool *pool)
+{
+  for (size_t i = 0; i < pool->num_workers; i++){
+    struct ush_worker *worker = &pool->workers[i];
+
+    if(worker->in >= 0){
+      close(worker->in);
+    }
+    close(worker->out.fd);
+    free(worker->out.buf);
+    //It may already have been reaped along with other children.
+    waitpid(worker->pid, NULL, 0);
+  }
+  free(pool->workers);
+  free(pool->name);
+  free(pool->text);
+  free(pool);
+}
+
+/**
+   @brief Start the workers of a pool.
+   @param name Pool name; an existing pool of that name is stopped first.
+   @param num_workers Number of workers.
+   @param argv Command of the workers.
+   @return 0 on success, -1 if a worker could not be started (error reported).
+ */
+int ush_pool_start(const char *name, size_t num_workers, char **argv)
+{
+  struct ush_pool **link = ush_pool_find(name);
+  struct ush_pool *pool = *link;
+
+  if(pool != NULL){
+    *link = pool->next_pool;
+    ush_pool_free(pool);
+  }
+  pool = ush_malloc(sizeof(struct ush_pool));
+  pool->name = ush_strdup(name);
+  pool->workers = ush_malloc(num_workers * sizeof(struct ush_worker));
+  pool->num_workers = 0;
+  pool->next = 0;
+  pool->served = 0;
+  pool->text = ush_join_words(argv, NULL);
+
+  //The workers share a process group, out of the way of Ctrl-C.
+  spawn_group.pgid = ush_job_control ? 0 : -1;
+  spawn_group.foreground = 0;
+  for (size_t i = 0; i < num_workers; i++){
+    struct ush_worker *worker = &pool->workers[i];
+    int to_worker[2], from_worker[2];
+    int fds[3];
+
+    if(pipe2(to_worker, O_CLOEXEC) != 0){
+      perror("ush: pool");
+      break;
+    }
+    if(pipe2(from_worker, O_CLOEXEC) != 0){
+      perror("ush: pool");
+      close(to_worker[0]);
+      close(to_worker[1]);
+      break;
+    }
+    fds[0] = to_worker[0];
+    fds[1] = from_worker[1];
+    fds[2] = -1;
+    worker->pid = ush_spawn(argv, fds);
+    close(to_worker[0]);
+    close(from_worker[1]);
+    if(worker->pid < 0){
+      close(to_worker[1]);
+      close(from_worker[0]);
+      break;
+    }
+    if(ush_job_control){
+      spawn_group.pgid = pool->workers[0].pid;
+      setpgid(worker->pid, spawn_group.pgid);
+    }
+    worker->in = to_worker[1];
+    memset(&worker->out, 0, sizeof(worker->out));
+    worker->out.fd = from_worker[0];
+    worker->out.chunk = USH_READ_CHUNK;
+    pool->num_workers++;
+  }
+  spawn_group.pgid = -1;
+  if(pool->num_workers < num_workers){
+    ush_pool_free(pool);
+    return -1;
+  }
+  pool->next_pool = pools;
+  pools = pool;
+  return 0;
+}
+
+/**
+   @brief Queue a reply line for stdout, writing the queue out when it is full.
+   @param line The reply (without newline); NULL just writes the queue out.
+ */
+void ush_pool_output(const char *line)
+{
+  if(line != NULL){
+    size_t len = strlen(line);
+
+    pool_out = ush_grow_array(pool_out, &pool_out_capacity, pool_out_len + len + 1, 1);
+    memcpy(pool_out + pool_out_len, line, len);
+    pool_out[pool_out_len + len] = '\n';
+    pool_out_len += len + 1;
+    if(pool_out_len < USH_POOL_OUT_CHUNK){
+      return;
+    }
+  }
+  if(pool_out_len > 0 && ush_write_all(STDOUT_FILENO, pool_out, pool_out_len) < 0 && errno != EPIPE){
+    perror("ush: pool");
+  }
+  pool_out_len = 0;
+}
+
+/**
+   @brief Send one request line to a worker.
+   @param worker The worker.
+   @param line The request, without newline.
+   @return 0 on success, -1 on error.
+ */
+int ush_pool_send(struct ush_worker *worker, const char *line)
+{
+  size_t len = strlen(line);
+  struct iovec iov[2] = { { (void*)line, len }, { "\n", 1 } };
+  ssize_t n = writev(worker->in, iov, 2);
+
+  if(n == (ssize_t)(len + 1)){
+    return 0;
+  }
+  //Longer than the pipe takes at once (or interrupted): finish piecewise.
+  if(n < 0 && errno != EINTR){
+    return -1;
+  }
+  n = (n < 0) ? 0 : n;
+  if((size_t)n < len && ush_write_all(worker->in, line + n, len - n) < 0){
+    return -1;
+  }
+  return ush_write_all(worker->in, "\n", 1);
+}
+
+/**
+   @brief Send requests to a pool and print the replies in request order.
+   If a worker fails the pool is stopped, as its replies can no longer be
+   matched to the requests.
+   @param link Link pointing to the pool.
+   @param request The one request to send, or NULL to send each line of stdin.
+   @return 0 on success, -1 if a worker failed (error reported).
+ */
+int ush_pool_run(struct ush_pool **link, const char *request)
+{
+  struct ush_pool *pool = *link;
+  struct ush_reader input = { 0, NULL, 0, 0, 0, 0, USH_READ_CHUNK, 0 };
+  size_t oldest = pool->next;
+  size_t in_flight = 0;
+  int done = 0;
+  int ret = 0;
+
+  fflush(stdout);
+  for (;;){
+    const char *line = NULL;
+    struct ush_worker *worker;
+
+    //Keep every worker busy, then collect the oldest reply.
+    if(!done && in_flight < pool->num_workers){
+      line = (request != NULL) ? request : ush_reader_line(&input);
+      done = (request != NULL || line == NULL);
+    }
+    if(line != NULL){
+      worker = &pool->workers[pool->next];
+      if(ush_pool_send(worker, line) < 0){
+        fprintf(stderr, "ush: pool: %s: worker %d: %s\n", pool->name, (int)worker->pid, strerror(errno));
+        ret = -1;
+        break;
+      }
+      pool->next = (pool->next + 1) % pool->num_workers;
+      in_flight++;
+      continue;
+    }
+    if(in_flight == 0){
+      break;
+    }
+    worker = &pool->workers[oldest];
+    if((line = ush_reader_line(&worker->out)) == NULL){
+      fprintf(stderr, "ush: pool: %s: worker %d exited\n", pool->name, (int)worker->pid);
+      ret = -1;
+      break;
+    }
+    ush_pool_output(line);
+    oldest = (oldest + 1) % pool->num_workers;
+    in_flight--;
+    pool->served++;
+  }
+  ush_pool_output(NULL);
+  free(input.buf);
+  if(ret < 0){
+    fprintf(stderr, "ush: pool: %s: stopped\n", pool->name);
+    *link = pool->next_pool;
+    ush_pool_free(pool);
+  }
+  return ret;
+}
+
+/**
+   @brief Builtin command: manage worker pools.
+   @param args List of args.  args[0] is "pool".  Then one of
+   "start NAME [-n N] command [args...]" (start N workers, default 1),
+   "run NAME [words...]" (send the words as one request, or without them
+   each line of stdin), "stop NAME", or nothing to list the pools.
+   @return Always returns 1, to continue executing.
+ */
+int ush_pool(char **args)
+{
+  struct ush_pool **link;
+  int i = 3;
+
+  if(args[1] == NULL){
+    for (struct ush_pool *pool = pools; pool != NULL; pool = pool->next_pool){
+      ush_out_printf("%-12s %3zu workers %10lu requests  %s\n", pool->name, pool->num_workers, pool->served, pool->text);
+    }
+    return 1;
+  }
+
+  if(args[2] != NULL && strcmp(args[1], "start") == 0){
+    size_t num_workers = 1;
+
+    if(args[i] != NULL && strcmp(args[i], "-n") == 0 && args[i + 1] != NULL && atol(args[i + 1]) > 0){
+      num_workers = atol(args[i + 1]);
+      i += 2;
+    }
+    if(args[i] != NULL && strcmp(args[i], "-n") != 0){
+      ush_last_status = (ush_pool_start(args[2], num_workers, args + i) < 0);
+      return 1;
+    }
+  }
+  else if(args[2] != NULL && (strcmp(args[1], "run") == 0 || strcmp(args[1], "stop") == 0)){
+    link = ush_pool_find(args[2]);
+    if(*link == NULL){
+      fprintf(stderr, "ush: pool: %s: no such pool\n", args[2]);
+      ush_last_status = 1;
+    }
+    else if(args[1][0] == 's'){
+      struct ush_pool *pool = *link;
+
+      *link = pool->next_pool;
+      ush_pool_free(pool);
+    }
+    else{
+      ush_last_status = (ush_pool_run(link, args[3] != NULL ? ush_join_words(args + 3, &cmd_arena) : NULL) < 0);
+    }
+    return 1;
+  }
+
+  fprintf(stderr, "ush: usage: pool [start NAME [-n N] command [args...] | run NAME [words...] | stop NAME]\n");
+  ush_last_status = 2;
+  return 1;
+}
+
+/**
+ * @brief Check whether a line holds anything besides whitespace.
+ * @param line The input line.
+ * @return 1 if blank, 0 otherwise.
+ */
+int ush_blank_line(const char *line)
+{
+  return line[strspn(line, USH_TOK_DELIM)] == '\0';
+}
+
+/**
+ * Index of the programs on $PATH, for completing command names.  It is built
+ * by the first completion that needs it, one sorted list of names per
+ * directory, and kept up to date with inotify: a directory is only listed
+ * again after it has changed, at the next completion.  A change also drops
+ * the names concerned from the command location cache, where a program added
+ * earlier on $PATH would otherwise stay shadowed.  Directories that cannot be
+ * watched are checked by their modification time instead, and relative ones
+ * (which change with the current directory) are listed every time.
+ */
+#define USH_PATH_WATCH (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct ush_path_dir {
+  char *path;
+  int wd;
+  int stale;
+  struct timespec mtime;
+  char **names;
+  size_t count;
+  size_t capacity;
+  struct ush_arena arena;
+};
+
+struct ush_path_index {
+  char *path_value;
+  struct ush_path_dir *dirs;
+  size_t num_dirs;
+  size_t capacity;
+  int inotify_fd;
+};
+
+struct ush_path_index path_index = { NULL, NULL, 0, 0, -1 };
+
+/**
+   @brief List the programs of a $PATH directory into the index.
+   @param dir The directory.
+ */
+void ush_path_dir_list(struct ush_path_dir *dir)
+{
+  size_t pos = 0, len = 0;
+  unsigned char type;
+  const char *name;
+  struct stat sb;
+  int fd;
+
+  ush_arena_reset(&dir->arena);
+  dir->count = 0;
+  dir->stale = 0;
+  fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd < 0){
+    return;
+  }
+  if(fstat(fd, &sb) == 0){
+    dir->mtime = sb.st_mtim;
+  }
+  if(dirent_buf == NULL){
+    dirent_buf = ush_malloc(USH_GLOB_BUF_SIZE);
+  }
+  while((name = ush_read_dirent(fd, dirent_buf, &pos, &len, &type)) != NULL){
+    //What ush_path_search() would run: executable regular files.
+    if((type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)
+       || (type != DT_REG && (fstatat(fd, name, &sb, 0) != 0 || !S_ISREG(sb.st_mode)))
+       || faccessat(fd, name, X_OK, 0) != 0){
+      continue;
+    }
+    dir->names = ush_grow_array(dir->names, &dir->capacity, dir->count + 1, sizeof(char*));
+    dir->names[dir->count++] = ush_arena_strndup(&dir->arena, name, strlen(name));
+  }
+  close(fd);
+  qsort(dir->names, dir->count, sizeof(char*), ush_argcmp);
+}
+
+/**
+   @brief Forget the whole index.
+ */
+void ush_path_index_clear()
+{
+  for (size_t i = 0; i < path_index.num_dirs; i++){
+    free(path_index.dirs[i].path);
+    free(path_index.dirs[i].names);
+    ush_arena_release(&path_index.dirs[i].arena);
+  }
+  path_index.num_dirs = 0;
+  free(path_index.path_value);
+  path_index.path_value = NULL;
+  if(path_index.inotify_fd >= 0){
+    //Takes the watches with it.
+    close(path_index.inotify_fd);
+    path_index.inotify_fd = -1;
+  }
+}
+
+/**
+   @brief Set up the index for a value of $PATH; the directories are listed
+   when first needed.
+   @param path The value of $PATH.
+ */
+void ush_path_index_build(const char *path)
+{
+  ush_path_index_clear();
+  path_index.path_value = ush_strdup(path);
+  path_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  for (const char *dir = path; ; dir++){
+    const char *end = strchrnul(dir, ':');
+    struct ush_path_dir *entry;
+
+    path_index.dirs = ush_grow_array(path_index.dirs, &path_index.capacity, path_index.num_dirs + 1, sizeof(struct ush_path_dir));
+    entry = &path_index.dirs[path_index.num_dirs++];
+    memset(entry, 0, sizeof(*entry));
+    //An empty PATH element stands for the current directory.
+    entry->path = (end == dir) ? ush_strdup(".") : strndup(dir, end - dir);
+    if(entry->path == NULL){
+      perror("ush");
+      exit(EXIT_FAILURE);
+    }
+    entry->wd = (entry->path[0] == '/' && path_index.inotify_fd >= 0) ?
+      inotify_add_watch(path_index.inotify_fd, entry->path, USH_PATH_WATCH) : -1;
+    entry->stale = 1;
+    if(*end == '\0'){
+      break;
+    }
+    dir = end;
+  }
+}
+
+/**
+   @brief Take in the changes inotify has reported for the $PATH directories.
+   Cheap when there are none: one read() that fails.
+ */
+void ush_path_index_events()
+{
+  union {
+    struct inotify_event event;
+    char buf[4096];
+  } u;
+  ssize_t n;
+
+  if(path_index.inotify_fd < 0){
+    return;
+  }
+  while((n = read(path_index.inotify_fd, u.buf, sizeof(u.buf))) > 0){
+    for (ssize_t off = 0; off < n; ){
+      const struct inotify_event *event = (const struct inotify_event*)(u.buf + off);
+
+      for (size_t i = 0; i < path_index.num_dirs; i++){
+        struct ush_path_dir *dir = &path_index.dirs[i];
+
+        if((event->mask & IN_Q_OVERFLOW) || dir->wd == event->wd){
+          dir->stale = 1;
+          if(event->mask & IN_IGNORED){
+            //Removed or moved away: from now on its time tells.
+            dir->wd = -1;
+          }
+        }
+      }
+      if(event->mask & IN_Q_OVERFLOW){
+        ush_hash_clear();
+      }
+      else if(event->len > 0){
+        ush_hash_forget(event->name);
+      }
+      off += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+/**
+   @brief Bring the index up to date with $PATH and its directories.
+ */
+void ush_path_index_update()
+{
+  const char *path = ush_var_get("PATH");
+
+  if(path == NULL){
+    path = "/bin:/usr/bin";
+  }
+  if(path_index.path_value == NULL || strcmp(path_index.path_value, path) != 0){
+    ush_path_index_build(path);
+  }
+  ush_path_index_events();
+  for (size_t i = 0; i < path_index.num_dirs; i++){
+    struct ush_path_dir *dir = &path_index.dirs[i];
+    struct stat sb;
+
+    if(dir->wd < 0 && !dir->stale){
+      dir->stale = (dir->path[0] != '/' || stat(dir->path, &sb) != 0 ||
+                    sb.st_mtim.tv_sec != dir->mtime.tv_sec || sb.st_mtim.tv_nsec != dir->mtime.tv_nsec);
+    }
+    if(dir->stale){
+      ush_path_dir_list(dir);
+    }
+  }
+}
+
+/**
+ * Completion candidates, from the command arena.
+ */
+char **complete_buf = NULL;
+size_t complete_buf_capacity = 0;
+size_t complete_count = 0;
+
+/**
+   @brief Add a completion candidate.
+   @param name The candidate; a directory ends with '/'.
+ */
+void ush_complete_add(char *name)
+{
+  complete_buf = ush_grow_array(complete_buf, &complete_buf_capacity, complete_count + 1, sizeof(char*));
+  complete_buf[complete_count++] = name;
+}
+
+/**
+   @brief Collect the command names starting with a prefix: builtins,
+   functions and the programs on $PATH.
+   @param prefix The prefix.
+   @param len Its length.
+ */
+void ush_complete_commands(const char *prefix, size_t len)
+{
+  for (size_t i = 0; i < USH_NUM_BUILTINS; i++){
+    if(strncmp(builtins[i].name, prefix, len) == 0){
+      ush_complete_add((char*)builtins[i].name);
+    }
+  }
+  for (size_t i = 0; i < USH_FUNC_BUCKETS; i++){
+    for (struct ush_function *func = func_table[i]; func != NULL; func = func->next){
+      if(strncmp(func->name, prefix, len) == 0){
+        ush_complete_add(func->name);
+      }
+    }
+  }
+
+  ush_path_index_update();
+  for (size_t i = 0; i < path_index.num_dirs; i++){
+    struct ush_path_dir *dir = &path_index.dirs[i];
+    size_t lo = 0, hi = dir->count;
+
+    //The first name not below the prefix, then all that start with it.
+    while(lo < hi){
+      size_t mid = lo + (hi - lo) / 2;
+
+      if(strncmp(dir->names[mid], prefix, len) < 0){
+        lo = mid + 1;
+      }
+      else{
+        hi = mid;
+      }
+    }
+    for (; lo < dir->count && strncmp(dir->names[lo], prefix, len) == 0; lo++){
+      ush_complete_add(dir->names[lo]);
+    }
+  }
+}
+
+/**
+   @brief Remember where a completed program is, so that running it needs no
+   search of $PATH.
+   @param name The program's name.
+ */
+void ush_complete_hash(const char *name)
+{
+  const char *path = ush_var_get("PATH");
+
+  ush_hash_check_path((path != NULL) ? path : "");
+  if(*ush_hash_slot(name) != NULL){
+    return;
+  }
+  for (size_t i = 0; i < path_index.num_dirs; i++){
+    struct ush_path_dir *dir = &path_index.dirs[i];
+
+    if(dir->path[0] == '/' && bsearch(&name, dir->names, dir->count, sizeof(char*), ush_argcmp) != NULL){
+      char *full = ush_arena_alloc(&cmd_arena, strlen(dir->path) + strlen(name) + 2);
+
+      sprintf(full, "%s/%s", dir->path, name);
+      ush_hash_set(name, full);
+      return;
+    }
+  }
+}
+
+/**
+   @brief Collect the files starting with a prefix in a directory.
+   Hidden files only match a prefix that starts with a dot.
+   @param dir The directory as typed, with its trailing slash ("" for the
+   current directory).
+   @param prefix The prefix.
+   @param len Its length.
+ */
+void ush_complete_files(const char *dir, const char *prefix, size_t len)
+{
+  struct ush_dircache *entries = ush_dircache_get(dir);
+
+  for (size_t i = 0; i < entries->count; i++){
+    const char *name = entries->names[i].name;
+    unsigned char type = entries->names[i].type;
+    size_t name_len = strlen(name);
+    char *candidate;
+    struct stat sb;
+
+    if(strncmp(name, prefix, len) != 0 || (name[0] == '.' && prefix[0] != '.')
+       || strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+      continue;
+    }
+    candidate = ush_arena_alloc(&cmd_arena, strlen(dir) + name_len + 2);
+    sprintf(candidate, "%s%s", dir, name);
+    if(type == DT_LNK || type == DT_UNKNOWN){
+      type = (stat(candidate, &sb) == 0 && S_ISDIR(sb.st_mode)) ? DT_DIR : DT_REG;
+    }
+    //Only the name is a candidate; the directory is put back in front of it.
+    candidate = ush_arena_strndup(&cmd_arena, name, name_len + 1);
+    candidate[name_len] = (type == DT_DIR) ? '/' : '\0';
+    ush_complete_add(candidate);
+  }
+  //The listing must not stand in for the directory when the command runs.
+  ush_glob_reset();
+}
+
+/**
+   @brief Check whether a word is in the place of a command name.
+   @param line The line.
+   @param start Where the word starts.
+   @return Nonzero at the start of the line, after an operator that starts
+   a command, or after a reserved word that is followed by one.
+ */
+int ush_complete_command_word(const char *line, size_t start)
+{
+  const char *keywords[] = { "then", "do", "else", "elif", "if", "while", "until", "!", "{", "time" };
+  size_t end = start;
+  size_t word;
+
+  while(end > 0 && (line[end - 1] == ' ' || line[end - 1] == '\t')){
+    end--;
+  }
+  if(end == 0 || strchr(";&|(`\n", line[end - 1]) != NULL){
+    return 1;
+  }
+  for (word = end; word > 0 && strchr(" \t;&|()<>`", line[word - 1]) == NULL; word--)
+    ;
+  for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++){
+    if(strlen(keywords[i]) == end - word && memcmp(keywords[i], line + word, end - word) == 0){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Quote a completed name so that it stands for itself in the line.
+   @param name The name.
+   @param len Its length.
+   @return The quoted name, from the command arena.
+ */
+char* ush_complete_quote(const char *name, size_t len)
+{
+  char *quoted = ush_arena_alloc(&cmd_arena, 2 * len + 1);
+  size_t n = 0;
+
+  for (size_t i = 0; i < len; i++){
+    if(strchr(" \t\n'\"\\$`*?[]&;|()<>#!{}", name[i]) != NULL){
+      quoted[n++] = '\\';
+    }
+    quoted[n++] = name[i];
+  }
+  quoted[n] = '\0';
+  return quoted;
+}
+
+/**
+ * Line editor, used when commands are read from a terminal.  The terminal is
+ * only in raw mode while a line is edited, so commands run with it the way
+ * they expect.  Input is read a block at a time; what comes after the end of
+ * a line (pasted text) is kept for the next one.  Lines longer than the
+ * terminal is wide scroll sideways.
+ */
+enum ush_key {
+  USH_KEY_UP = 256, USH_KEY_DOWN, USH_KEY_RIGHT, USH_KEY_LEFT, USH_KEY_HOME, USH_KEY_END, USH_KEY_DELETE
+};
+
+#define USH_CTRL(c) ((c) & 0x1f)
+//Matches needing a confirmation before they are all listed.
+#define USH_COMPLETE_QUERY_ITEMS 100
+
+struct ush_editor {
+  struct termios saved;
+  const char *prompt;
+  char *line;
+  size_t len;
+  size_t pos;
+  size_t capacity;
+  size_t offset;
+  char *kept;
+  size_t kept_len;
+  size_t kept_capacity;
+  size_t history;
+  unsigned char in[256];
+  size_t in_pos;
+  size_t in_len;
+  char *out;
+  size_t out_len;
+  size_t out_capacity;
+};
+
+struct ush_editor editor;
+int ush_line_editing = -1;
+
+/**
+   @brief Read a byte typed at the terminal.
+   @param timeout How long to wait, in milliseconds; -1 to wait as long as
+   it takes (reaping children meanwhile).
+   @return The byte, or -1 on timeout, end of input or error.
+ */
+int ush_editor_byte(int timeout)
+{
+  if(editor.in_pos == editor.in_len){
+    ssize_t n;
+
+    if(timeout >= 0){
+      struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+
+      if(poll(&pfd, 1, timeout) <= 0){
+        return -1;
+      }
+    }
+    else{
+      ush_wait_input(STDIN_FILENO);
+    }
+    do{
+      n = read(STDIN_FILENO, editor.in, sizeof(editor.in));
+    } while(n < 0 && errno == EINTR);
+    if(n <= 0){
+      return -1;
+    }
+    editor.in_pos = 0;
+    editor.in_len = n;
+  }
+  return editor.in[editor.in_pos++];
+}
+
+/**
+   @brief Read a key, turning the escape sequences of the cursor keys into
+   their USH_KEY_* code.
+   @return The key, 0 for an escape sequence that means nothing here, or -1
+   at end of input.
+ */
+int ush_editor_key()
+{
+  int c = ush_editor_byte(-1);
+  int param = 0;
+
+  if(c != 27){
+    return c;
+  }
+  //A lone Escape is not followed by anything soon.
+  c = ush_editor_byte(50);
+  if(c != '[' && c != 'O'){
+    return 0;
+  }
+  while((c = ush_editor_byte(50)) >= '0' && c <= ';'){
+    if(c >= '0' && c <= '9' && param < 100){
+      param = param * 10 + c - '0';
+    }
+  }
+  switch(c){
+  case 'A': return USH_KEY_UP;
+  case 'B': return USH_KEY_DOWN;
+  case 'C': return USH_KEY_RIGHT;
+  case 'D': return USH_KEY_LEFT;
+  case 'H': return USH_KEY_HOME;
+  case 'F': return USH_KEY_END;
+  case '~':
+    if(param == 1 || param == 7){
+      return USH_KEY_HOME;
+    }
+    if(param == 4 || param == 8){
+      return USH_KEY_END;
+    }
+    return (param == 3) ? USH_KEY_DELETE : 0;
+  default:
+    return 0;
+  }
+}
+
+/**
+   @brief Add text to what goes to the terminal next.
+   @param str The text.
+   @param len Its length.
+ */
+void ush_editor_out(const char *str, size_t len)
+{
+  editor.out = ush_grow_array(editor.out, &editor.out_capacity, editor.out_len + len, 1);
+  memcpy(editor.out + editor.out_len, str, len);
+  editor.out_len += len;
+}
+
+/**
+   @brief Send what has been added with ush_editor_out() to the terminal, in
+   one write.
+ */
+void ush_editor_flush()
+{
+  ush_write_all(STDOUT_FILENO, editor.out, editor.out_len);
+  editor.out_len = 0;
+}
+
+/**
+   @brief Width of the terminal.
+   @return Number of columns.
+ */
+size_t ush_editor_cols()
+{
+  struct winsize ws;
+
+  if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0){
+    return 80;
+  }
+  return ws.ws_col;
+}
+
+/**
+   @brief Number of columns some text takes: one per character, UTF-8
+   continuation bytes taking none.
+   @param str The text.
+   @param len Its length in bytes.
+   @return Its width.
+ */
+size_t ush_editor_width(const char *str, size_t len)
+{
+  size_t width = 0;
+
+  for (size_t i = 0; i < len; i++){
+    width += ((str[i] & 0xc0) != 0x80);
+  }
+  return width;
+}
+
+/**
+   @brief Step to the next or previous character of the line.
+   @param pos A position in the line.
+   @param dir 1 to go forward, -1 back.
+   @return The position of the character there.
+ */
+size_t ush_editor_step(size_t pos, int dir)
+{
+  do{
+    pos += dir;
+  } while(pos > 0 && pos < editor.len && (editor.line[pos] & 0xc0) == 0x80);
+  return pos;
+}
+
+/**
+   @brief Draw the prompt and the line again, with the cursor in its place.
+ */
+void ush_editor_refresh()
+{
+  size_t cols = ush_editor_cols();
+  size_t prompt_width = ush_editor_width(editor.prompt, strlen(editor.prompt));
+  size_t room = (cols > prompt_width + 1) ? cols - prompt_width - 1 : 1;
+  size_t end, column;
+  char move[32];
+
+  //Scroll so that the cursor shows.
+  if(editor.pos < editor.offset){
+    editor.offset = editor.pos;
+  }
+  while(ush_editor_width(editor.line + editor.offset, editor.pos - editor.offset) > room){
+    editor.offset = ush_editor_step(editor.offset, 1);
+  }
+  for (end = editor.offset; end < editor.len && ush_editor_width(editor.line + editor.offset, end - editor.offset) < room; ){
+    end = ush_editor_step(end, 1);
+  }
+
+  ush_editor_out("\r", 1);
+  ush_editor_out(editor.prompt, strlen(editor.prompt));
+  ush_editor_out(editor.line + editor.offset, end - editor.offset);
+  ush_editor_out("\x1b[K\r", 4);
+  column = prompt_width + ush_editor_width(editor.line + editor.offset, editor.pos - editor.offset);
+  //A move of 0 columns is taken as a move of one.
+  if(column > 0){
+    ush_editor_out(move, snprintf(move, sizeof(move), "\x1b[%zuC", column));
+  }
+  ush_editor_flush();
+}
+
+/**
+   @brief Put text into the line at the cursor.
+   @param str The text.
+   @param len Its length.
+ */
+void ush_editor_insert(const char *str, size_t len)
+{
+  editor.line = ush_grow_array(editor.line, &editor.capacity, editor.len + len + 1, 1);
+  memmove(editor.line + editor.pos + len, editor.line + editor.pos, editor.len - editor.pos);
+  memcpy(editor.line + editor.pos, str, len);
+  editor.len += len;
+  editor.pos += len;
+}
+
+/**
+   @brief Remove part of the line.
+   @param from Where it starts.
+   @param to Where it ends.
+ */
+void ush_editor_delete(size_t from, size_t to)
+{
+  memmove(editor.line + from, editor.line + to, editor.len - to);
+  editor.len -= to - from;
+  if(editor.pos > to){
+    editor.pos -= to - from;
+  }
+  else if(editor.pos > from){
+    editor.pos = from;
+  }
+}
+
+/**
+   @brief Replace the whole line.
+   @param str The new line.
+   @param len Its length.
+ */
+void ush_editor_set(const char *str, size_t len)
+{
+  editor.len = editor.pos = editor.offset = 0;
+  ush_editor_insert(str, len);
+}
+
+/**
+   @brief Go back or forward in the history.  The line being typed is kept
+   while older ones are shown.
+   @param dir 1 for an older line, -1 for a newer one.
+ */
+void ush_editor_history(int dir)
+{
+  const char *entry;
+  size_t len;
+
+  if(dir < 0 && editor.history == 0){
+    return;
+  }
+  if(editor.history == 0 && histfile.fd >= 0){
+    //Pick up what has been added since.
+    ush_histfile_map();
+  }
+  if(editor.history + dir == 0){
+    editor.history = 0;
+    ush_editor_set(editor.kept, editor.kept_len);
+    return;
+  }
+  if((entry = ush_history_back(editor.history + dir, &len)) == NULL){
+    return;
+  }
+  if(editor.history == 0){
+    editor.kept = ush_grow_array(editor.kept, &editor.kept_capacity, editor.len + 1, 1);
+    memcpy(editor.kept, editor.line, editor.len);
+    editor.kept_len = editor.len;
+  }
+  editor.history += dir;
+  ush_editor_set(entry, len);
+}
+
+/**
+   @brief Search the history backwards as the query is typed (Ctrl-R).
+   Ctrl-R again finds an older match, Ctrl-G or Ctrl-C gives up; any other
+   key takes the match and is then acted on as usual.
+   @return The key that ended the search, or 0.
+ */
+int ush_editor_search()
+{
+  char query[256];
+  size_t query_len = 0;
+  size_t found = editor.history;
+  char *before = ush_arena_strndup(&cmd_arena, editor.line, editor.len);
+  size_t before_len = editor.len;
+  size_t before_history = editor.history;
+  int failed = 0;
+
+  if(editor.history == 0 && histfile.fd >= 0){
+    ush_histfile_map();
+  }
+  for (;;){
+    size_t cols = ush_editor_cols();
+    const char *label = failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`";
+    size_t shown = strlen(label) + query_len + 3;
+    int key;
+
+    ush_editor_out("\r", 1);
+    ush_editor_out(label, strlen(label));
+    ush_editor_out(query, query_len);
+    ush_editor_out("': ", 3);
+    ush_editor_out(editor.line, (shown + editor.len < cols) ? editor.len : (cols > shown + 1) ? cols - shown - 1 : 0);
+    ush_editor_out("\x1b[K", 3);
+    ush_editor_flush();
+
+    key = ush_editor_key();
+    if(key == USH_CTRL('G') || key == USH_CTRL('C')){
+      editor.history = before_history;
+      ush_editor_set(before, before_len);
+      return 0;
+    }
+    if(key == USH_CTRL('H') || key == 127){
+      if(query_len > 0){
+        query_len--;
+      }
+      found = 0;
+    }
+    else if((key >= ' ' && key < 127) || (key >= 128 && key < 256)){
+      if(query_len < sizeof(query)){
+        query[query_len++] = key;
+      }
+      //The match so far may still be one.
+      found -= (found > 0);
+    }
+    else if(key != USH_CTRL('R')){
+      return key;
+    }
+
+    failed = (query_len > 0);
+    for (size_t back = found + 1; query_len > 0; back++){
+      size_t len;
+      const char *entry = ush_history_back(back, &len);
+
+      if(entry == NULL){
+        break;
+      }
+      if(memmem(entry, len, query, query_len) != NULL){
+        if(editor.history == 0 && before_history == 0){
+          editor.kept = ush_grow_array(editor.kept, &editor.kept_capacity, before_len + 1, 1);
+          memcpy(editor.kept, before, before_len);
+          editor.kept_len = before_len;
+        }
+        found = editor.history = back;
+        ush_editor_set(entry, len);
+        editor.pos = (const char*)memmem(entry, len, query, query_len) - entry;
+        failed = 0;
+        break;
+      }
+    }
+  }
+}
+
+/**
+   @brief List completion candidates in columns under the line, asking
+   first when there are many of them.
+   @param names The candidates, sorted.
+   @param count Number of them.
+ */
+void ush_editor_list(char **names, size_t count)
+{
+  size_t cols = ush_editor_cols();
+  size_t width = 1;
+  size_t per_row, rows;
+  char num[64];
+
+  if(count > USH_COMPLETE_QUERY_ITEMS){
+    int key;
+
+    ush_editor_out(num, snprintf(num, sizeof(num), "\nDisplay all %zu possibilities? (y or n)", count));
+    ush_editor_flush();
+    key = ush_editor_key();
+    if(key != 'y' && key != 'Y'){
+      ush_editor_out("\n", 1);
+      return;
+    }
+  }
+  for (size_t i = 0; i < count; i++){
+    size_t w = ush_editor_width(names[i], strlen(names[i]));
+
+    width = (w + 2 > width) ? w + 2 : width;
+  }
+  per_row = (cols / width > 0) ? cols / width : 1;
+  rows = (count + per_row - 1) / per_row;
+  //Down the columns, as ls does.
+  for (size_t row = 0; row < rows; row++){
+    ush_editor_out("\n", 1);
+    for (size_t col = 0; col < per_row && col * rows + row < count; col++){
+      const char *name = names[col * rows + row];
+      size_t w = ush_editor_width(name, strlen(name));
+
+      ush_editor_out(name, strlen(name));
+      if((col + 1) * rows + row < count){
+        for (; w < width; w++){
+          ush_editor_out(" ", 1);
+        }
+      }
+    }
+  }
+  ush_editor_out("\n", 1);
+}
+
+/**
+   @brief Complete the word before the cursor (Tab): a command name in the
+   place of a command, otherwise a file name.  A single match is put in
+   whole; several are completed as far as they agree, and listed when that
+   adds nothing and Tab is pressed again.
+   @param again Nonzero if the key before was Tab too.
+ */
+void ush_editor_complete(int again)
+{
+  size_t start = editor.pos;
+  char *word;
+  size_t len = 0;
+  const char *slash;
+  char *dir = "";
+  const char *prefix;
+  size_t kept = 0;
+  size_t common;
+  int commands;
+  char *text;
+
+  while(start > 0 && (strchr(" \t;&|()<>`", editor.line[start - 1]) == NULL ||
+                      (start > 1 && editor.line[start - 2] == '\\'))){
+    start--;
+  }
+  //What the word stands for: quotes and backslashes removed.
+  word = ush_arena_alloc(&cmd_arena, editor.pos - start + 1);
+  for (size_t i = start; i < editor.pos; i++){
+    if(editor.line[i] == '\\' && i + 1 < editor.pos){
+      i++;
+    }
+    else if(editor.line[i] == '\'' || editor.line[i] == '"'){
+      continue;
+    }
+    word[len++] = editor.line[i];
+  }
+  word[len] = '\0';
+
+  complete_count = 0;
+  slash = strrchr(word, '/');
+  commands = (slash == NULL && ush_complete_command_word(editor.line, start));
+  if(commands){
+    prefix = word;
+    ush_complete_commands(word, len);
+  }
+  else{
+    if(slash != NULL){
+      kept = slash + 1 - word;
+      dir = ush_arena_strndup(&cmd_arena, word, kept);
+    }
+    prefix = word + kept;
+    ush_complete_files(dir, prefix, len - kept);
+  }
+  qsort(complete_buf, complete_count, sizeof(char*), ush_argcmp);
+  for (size_t i = 1, n = 1; i <= complete_count; i++){
+    //Drop duplicates (a program in several directories).
+    if(i == complete_count){
+      complete_count = n;
+    }
+    else if(strcmp(complete_buf[i], complete_buf[n - 1]) != 0){
+      complete_buf[n++] = complete_buf[i];
+    }
+  }
+  if(complete_count == 0){
+    ush_editor_out("\a", 1);
+    return;
+  }
+
+  common = strlen(complete_buf[0]);
+  for (size_t i = 1; i < complete_count; i++){
+    size_t j = 0;
+
+    while(j < common && complete_buf[i][j] == complete_buf[0][j]){
+      j++;
+    }
+    common = j;
+  }
+  if(complete_count > 1 && common <= len - kept){
+    if(again){
+      ush_editor_list(complete_buf, complete_count);
+    }
+    else{
+      ush_editor_out("\a", 1);
+    }
+    return;
+  }
+
+  text = ush_arena_alloc(&cmd_arena, 2 * (kept + common) + 2);
+  strcpy(text, ush_complete_quote(dir, kept));
+  strcat(text, ush_complete_quote(complete_buf[0], common));
+  if(complete_count == 1 && complete_buf[0][common - 1] != '/'){
+    strcat(text, " ");
+    if(commands){
+      ush_complete_hash(complete_buf[0]);
+    }
+  }
+  ush_editor_delete(start, editor.pos);
+  ush_editor_insert(text, strlen(text));
+}
+
+/**
+   @brief Edit a line typed at the terminal.
+   Keys: the arrows, Home and End (or Ctrl-A, -E, -B, -F) move, Up and Down
+   (Ctrl-P, -N) go through the history and Ctrl-R searches it, Backspace,
+   Delete and Ctrl-D remove a character, Ctrl-K, -U and -W remove to the end,
+   to the start and the word before the cursor, Ctrl-L clears the screen,
+   Ctrl-C starts the line again, Tab completes and Enter ends the line.
+   @param prompt The prompt.
+   @return The line, valid until the next one is edited, or NULL at end of
+   input (Ctrl-D on an empty line).
+ */
+char* ush_edit_line(const char *prompt)
+{
+  struct termios raw;
+  int last = 0;
+  int eof = 0;
+
+  if(tcgetattr(STDIN_FILENO, &editor.saved) != 0){
+    fputs(prompt, stdout);
+    fflush(stdout);
+    return ush_reader_line(&stdin_reader);
+  }
+  raw = editor.saved;
+  raw.c_iflag &= ~(ICRNL | INLCR | IGNCR | IXON | ISTRIP);
+  raw.c_lflag &= ~(ICANON | ECHO | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  //TCSADRAIN keeps what was typed ahead.
+  fflush(stdout);
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+  editor.prompt = prompt;
+  editor.len = editor.pos = editor.offset = editor.history = 0;
+  editor.line = ush_grow_array(editor.line, &editor.capacity, 1, 1);
+  ush_editor_refresh();
+  for (;;){
+    int key = ush_editor_key();
+
+    if(key == USH_CTRL('R')){
+      key = ush_editor_search();
+    }
+    if(key < 0 || (key == USH_CTRL('D') && editor.len == 0)){
+      eof = 1;
+    }
+    if(eof || key == '\r' || key == '\n'){
+      //The finished line stays on the screen as typed.
+      editor.pos = editor.len;
+      ush_editor_refresh();
+      ush_editor_out("\n", 1);
+      ush_editor_flush();
+      break;
+    }
+    switch(key){
+    case USH_CTRL('A'):
+    case USH_KEY_HOME:
+      editor.pos = 0;
+      break;
+    case USH_CTRL('E'):
+    case USH_KEY_END:
+      editor.pos = editor.len;
+      break;
+    case USH_CTRL('B'):
+    case USH_KEY_LEFT:
+      if(editor.pos > 0){
+        editor.pos = ush_editor_step(editor.pos, -1);
+      }
+      break;
+    case USH_CTRL('F'):
+    case USH_KEY_RIGHT:
+      if(editor.pos < editor.len){
+        editor.pos = ush_editor_step(editor.pos, 1);
+      }
+      break;
+    case USH_CTRL('P'):
+    case USH_KEY_UP:
+      ush_editor_history(1);
+      break;
+    case USH_CTRL('N'):
+    case USH_KEY_DOWN:
+      ush_editor_history(-1);
+      break;
+    case USH_CTRL('H'):
+    case 127:
+      if(editor.pos > 0){
+        ush_editor_delete(ush_editor_step(editor.pos, -1), editor.pos);
+      }
+      break;
+    case USH_CTRL('D'):
+    case USH_KEY_DELETE:
+      if(editor.pos < editor.len){
+        ush_editor_delete(editor.pos, ush_editor_step(editor.pos, 1));
+      }
+      break;
+    case USH_CTRL('K'):
+      ush_editor_delete(editor.pos, editor.len);
+      break;
+    case USH_CTRL('U'):
+      ush_editor_delete(0, editor.pos);
+      break;
+    case USH_CTRL('W'):{
+      size_t from = editor.pos;
+
+      while(from > 0 && editor.line[from - 1] == ' '){
+        from--;
+      }
+      while(from > 0 && editor.line[from - 1] != ' '){
+        from--;
+      }
+      ush_editor_delete(from, editor.pos);
+      break;
+    }
+    case USH_CTRL('L'):
+      ush_editor_out("\x1b[H\x1b[2J", 7);
+      break;
+    case USH_CTRL('C'):
+      ush_editor_out("^C\n", 3);
+      editor.len = editor.pos = editor.offset = editor.history = 0;
+      ush_last_status = 130;
+      break;
+    case '\t':
+      ush_editor_complete(last == '\t');
+      break;
+    default:
+      if((key >= ' ' && key < 127) || (key >= 128 && key < 256)){
+        char c = key;
+
+        ush_editor_insert(&c, 1);
+      }
+      break;
+    }
+    last = key;
+    ush_editor_refresh();
+  }
+
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.saved);
+  if(eof){
+    return NULL;
+  }
+  editor.line[editor.len] = '\0';
+  return editor.line;
+}
+
+/**
+ * @brief Read a line of commands.
+ * From a terminal the line is edited (see ush_edit_line()); otherwise it
+ * comes from the reader's buffer, reused for every line.
+ * @param reader Where the commands come from.
+ * @param prompt Shown first when the shell is interactive.
+ * @return The line read, or NULL at end of input.
+ */
+char* ush_read_line(struct ush_reader *reader, const char *prompt)
+{
+  if(ush_interactive && reader == &stdin_reader){
+    if(ush_line_editing < 0){
+      const char *term = getenv("TERM");
+
+      ush_line_editing = isatty(STDOUT_FILENO) && term != NULL && strcmp(term, "dumb") != 0;
+    }
+    if(ush_line_editing){
+      return ush_edit_line(prompt);
+    }
+  }
+  if(ush_interactive){
+    fputs(prompt, stdout);
+    fflush(stdout);
+  }
+  return ush_reader_line(reader);
+}
+
+/**
+ * Buffer the lines of a command that goes on over several lines are joined in.
+ */
+char *cont_buf = NULL;
+size_t cont_buf_capacity = 0;
+
+/**
+ * @brief Count the words in a line that may close a compound command.
+ * @param line The line.
+ * @return Number of fi, done and } words (an upper bound on the real ones).
+ */
+size_t ush_count_closers(const char *line)
+{
+  size_t count = 0;
+
+  for (const char *r = line; *r != '\0'; ){
+    size_t len = strcspn(r, " \t;&|()<>");
+
+    if((len == 2 && memcmp(r, "fi", 2) == 0) || (len == 4 && memcmp(r, "done", 4) == 0) || (len == 1 && *r == '}')){
+      count++;
+    }
+    r += len;
+    r += (*r != '\0');
+  }
+  return count;
+}
+
+/**
+ * @brief Read the rest of a command that goes on over several lines, and parse it.
+ * The lines are joined with newlines (a trailing backslash joins them
+ * directly).  An open compound command is only parsed again once enough
+ * closing words have been read, so a long function is not parsed once per line.
+ * @param reader Where the commands come from.
+ * @param line The first line(s), which stop in the middle of a command.
+ * @param incomplete What ush_parse_line() said about them.
+ * @return The parsed list, or NULL on a syntax error or end of input (reported).
+ */
+struct ush_list* ush_parse_continued(struct ush_reader *reader, const char *line, int incomplete)
+{
+  size_t len = strlen(line);
+  size_t closers = 0;
+  struct ush_list *list = NULL;
+
+  cont_buf = ush_grow_array(cont_buf, &cont_buf_capacity, len + 1, 1);
+  memcpy(cont_buf, line, len + 1);
+  while(incomplete){
+    char *next;
+    size_t next_len;
+
+    if((next = ush_read_line(reader, "... ")) == NULL){
+      if(session_lexer.open_quote != '\0' && session_lexer.open_quote != '\\'){
+        fprintf(stderr, "ush: unexpected EOF while looking for matching `%c'\n", session_lexer.open_quote);
+      }
+      else{
+        fprintf(stderr, "ush: syntax error: unexpected end of file\n");
+      }
+      ush_last_status = 2;
+      return NULL;
+    }
+    if(ush_interactive && !ush_blank_line(next)){
+      add_to_history_util(next);
+    }
+
+    next_len = strlen(next);
+    cont_buf = ush_grow_array(cont_buf, &cont_buf_capacity, len + next_len + 2, 1);
+    if(session_lexer.open_quote == '\\'){
+      len--;
+    }
+    else{
+      cont_buf[len++] = '\n';
+    }
+    memcpy(cont_buf + len, next, next_len + 1);
+    len += next_len;
+
+    closers += ush_count_closers(next);
+    if(closers + 1 >= (size_t)incomplete){
+      list = ush_parse_line(cont_buf, &incomplete);
+      closers = 0;
+    }
+  }
+  return list;
+}
+
+/**
+ * @brief Loop for getting input and excuting it.
+ * @param reader Where the commands come from.
+ */
+void ush_loop(struct ush_reader *reader)
+{
+  char* line;
+  struct ush_list* list;
+  int status = 1;
+  int incomplete;
+
+  do
+  {
+    ush_interrupted = 0;
+    ush_arena_reset(&cmd_arena);
+    ush_glob_reset();
+    ush_ast_cache_trim();
+    if(ush_interactive){
+      ush_reap_children();
+      ush_notify_jobs();
+      fputs("\n", stdout);
+    }
+    if(ush_log_fd >= 0 && log_len > 0){
+      ush_log_flush();
+    }
+    USH_TRACE_BEGIN(read_start);
+    line = ush_read_line(reader, "> ");
+    USH_TRACE_END(USH_TR_READ, read_start);
+    if(line == NULL){
+      //End of input.
+      break;
+    }
+
+    if(ush_interactive && !ush_blank_line(line)){
+      add_to_history_util(line);
+    }
+    USH_TRACE_BEGIN(parse_start);
+    list = ush_parse_line(line, &incomplete);
+    if(list == NULL && incomplete){
+      list = ush_parse_continued(reader, line, incomplete);
+    }
+    USH_TRACE_END(USH_TR_PARSE, parse_start);
+    if(list != NULL){
+      USH_TRACE_BEGIN(start);
+      status = ush_execute_list(list);
+      USH_TRACE_END(USH_TR_COMMAND, start);
+    }
+  } while (status);
+}
+
+//bench/ush_bench.c builds the shell without main() to drive its internals.
+#ifndef USH_NO_MAIN
+/**
+ * @brief Main entry point.
+ * @param argc Argument count.
+ * @param argv Argument(Command Line) vector.
+ * @return status code.
+ */
+int main(int argc, char** argv)
+{
+  struct ush_reader script;
+  struct ush_reader *input = &stdin_reader;
+  char *command = NULL;
+  int opt;
+
+  while((opt = getopt(argc, argv, "+b:c:")) != -1){
+    if(opt == 'b'){
+      size_t num_backends = sizeof(backend_str) / sizeof(char *);
+      size_t i;
+
+      for (i = 0; i < num_backends && strcmp(optarg, backend_str[i]) != 0; i++)
+        ;
+      if(i == num_backends){
+        fprintf(stderr, "ush: unknown backend \"%s\" (expected spawn, vfork, fork or zygote)\n", optarg);
+        return EXIT_FAILURE;
+      }
+      ush_backend = i;
+    }
+    else if(opt == 'c'){
+      command = optarg;
+    }
+    else{
+      fprintf(stderr, "usage: %s [-b spawn|vfork|fork|zygote] [-c command | script [args...]]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  //Before anything else makes the shell bigger.
+  if(ush_backend == USH_BACKEND_ZYGOTE && ush_zygote_start() < 0){
+    ush_backend = USH_BACKEND_FORK;
+  }
+
+  //The script (or the name after -c's command) is $0, the rest $1...
+  ush_arg0 = argv[0];
+  if(optind < argc){
+    ush_arg0 = argv[optind];
+    params.argv = argv + optind + 1;
+    params.argc = argc - optind - 1;
+  }
+  if(command != NULL){
+    ush_reader_string(&script, command);
+    input = &script;
+  }
+  else if(optind < argc){
+    if(ush_reader_file(&script, argv[optind]) < 0){
+      fprintf(stderr, "ush: %s: %s\n", argv[optind], strerror(errno));
+      return 127;
+    }
+    input = &script;
+  }
+  else if(isatty(STDIN_FILENO)){
+    ush_interactive = 1;
+  }
+  else{
+    //Commands piped in: read them in large chunks.
+    stdin_reader.chunk = USH_SCRIPT_READ_CHUNK;
+  }
+
+  if(ush_interactive){
+    for (int i = 0; i < 80; i++){
+      fputc('*', stdout);
+    }
+    puts("\n Welcome to Linux Shell.");
+    puts("\nDeveloped in C by Aditya Narad - CSE 1");
+    for (int i = 0; i < 80; i++){
+      fputc('*', stdout);
+    }
+  }
+
+  ush_var_import();
+  const char *trace = ush_var_get("USH_TRACE");
+  ush_opt_trace = (trace != NULL && trace[0] != '\0' && strcmp(trace, "0") != 0);
+  const char *log = ush_var_get("USH_LOG");
+  if(log != NULL && log[0] != '\0'){
+    ush_log_start(log);
+  }
+  ush_cwd_init();
+  //Size the history ring.
+  ush_history_resize(ush_histsize());
+  if(ush_interactive){
+    ush_histfile_open();
+  }
+
+  //Take SIGCHLD through a descriptor so the prompt loop can wait for input
+  //and children at the same time.
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  ush_sigchld_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  //Builtins write to pipes from the shell itself: a reader that has gone
+  //away must give them EPIPE rather than kill the shell.
+  sigaddset(&sigchld, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &sigchld, &ush_child_sigmask);
+  if(ush_interactive){
+    ush_job_control_init();
+  }
+
+  //Run command loop.
+  ush_loop(input);
+  ush_job_control_end();
+  ush_log_end();
+
+  if(ush_interactive){
+    puts("\nGoodBye!!!");
+  }
+  fflush(stdout);
+  if(input != &stdin_reader){
+    ush_reader_close(input);
+  }
+
+  return ush_last_status;
+}
+#endif